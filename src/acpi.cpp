@@ -2,24 +2,13 @@
 #include "common.h"
 #include "port.h"
 #include "debug.h"
-
-#define sleep(x) for(int _=0;_<x;++_){asm("nop");}
+#include "cpu.h"
+#include "aml.h"
+#include "routines.h"
+#include "paging.h"
 
 namespace acpi {
 
-static u32 *SMI_CMD;
-static u8 ACPI_ENABLE;
-//static u8 ACPI_DISABLE;
-static u32 *PM1a_CNT;
-static u32 *PM1b_CNT;
-static u16 SLP_TYPa;
-static u16 SLP_TYPb;
-static u16 SLP_EN;
-static u16 SCI_EN;
-//static u8 PM1_CNT_LEN;
-
-
-
 struct PACKED RSDP {
 	u8 signature[8];
 	u8 check_sum;
@@ -36,304 +25,332 @@ struct PACKED RSDP2 {
 	u8 reserved[3];
 };
 
-bool valid(RSDP *rsdp) {
-	u16 sum = 0;
-	for (u8 *byte = (u8 *)rsdp; byte < (u8 *)(rsdp + 1); ++byte) {
-		sum += *byte;
-	}
-	if ((sum & 0xff) == 0) {
-		if (rsdp->revision == 0) {
-			return true;
-		} else if (rsdp->revision == 2) {
-			auto rsdp2 = (RSDP2 *)rsdp;
-			sum = 0;
-			for (u8 *byte = (u8 *)rsdp2; byte < (u8 *)(rsdp2 + 1); ++byte) {
-				sum += *byte;
-			}
-			if ((sum & 0xff) == 0) {
-					return true;
-			}
-		}
-	}
-	return false;
+inline static constexpr u32 max_table_count = 64;
+// Open addressing, twice the tables so probes stay short
+inline static constexpr u32 index_size = max_table_count * 2;
+
+struct Table {
+	TableHeader *header;
+	u32 signature;
+	Table *next_same; // The next table with the same signature, in RSDT / XSDT order
+};
+
+internal StaticList<Table, max_table_count> tables;
+// Heads of the same signature lists, by signature
+internal Table *table_index[index_size];
+internal u8 rsdp_revision;
+
+internal u32 signature_value(ascii const *signature) {
+	u32 value;
+	copy_memory(&value, signature, 4);
+	return value;
+}
+
+internal u32 index_slot(u32 signature) {
+	return (signature * 0x9e3779b1u) % index_size;
 }
 
-RSDP *get_rsdp() {
-	auto address_to_check = (u8 *)0x000e0000;
-	while (address_to_check < (u8 *)0x00100000) {
-		if (memory_equals(address_to_check, "RSD PTR ", 8)) {
-			auto rsdp = (RSDP *)address_to_check;
-			if (valid(rsdp)) {
+internal bool checksum_valid(void const *data, u32 length) {
+	return (u8)routines::sum_bytes(data, length) == 0;
+}
+
+internal RSDP *rsdp_if_valid(u8 *address) {
+	if (!memory_equals(address, "RSD PTR ", 8))
+		return 0;
+	auto rsdp = (RSDP *)address;
+	if (!checksum_valid(rsdp, sizeof(RSDP)))
+		return 0;
+	// Revision 2 and later add fields with a checksum of their own
+	if (rsdp->revision >= 2 && !checksum_valid(rsdp, ((RSDP2 *)rsdp)->length))
+		return 0;
+	return rsdp;
+}
+
+// The RSDP is on a 16 byte boundary in the first KB of the EBDA, or in the BIOS area below 1 MB.
+internal RSDP *find_rsdp() {
+	// The real mode segment of the EBDA is at 0x40:0x0e
+	auto ebda = (u8 *)(umm)((*at_address<u16>(0x40e) << 4) & 0xfffff);
+	if (ebda) {
+		for (auto address = ebda; address < ebda + 1024; address += 16) {
+			if (auto rsdp = rsdp_if_valid(address))
 				return rsdp;
-			}
 		}
-		address_to_check += 16;
+	}
+	for (auto address = (u8 *)0x000e0000; address < (u8 *)0x00100000; address += 16) {
+		if (auto rsdp = rsdp_if_valid(address))
+			return rsdp;
 	}
 	return 0;
 }
 
+// Tables may be anywhere, in the demand zero window too. The header comes first, for the length.
+internal TableHeader *reach_table(u64 address) {
+	paging::exclude(address, sizeof(TableHeader));
+	auto header = (TableHeader *)(umm)address;
+	paging::exclude(address, header->length);
+	return header;
+}
 
-struct FACP {
-	u8 Signature[4];
-	u32 Length;
-	u8 unneded1[40 - 8];
-	u32 *DSDT;
-	u8 unneded2[48 - 44];
-	u32 *SMI_CMD;
-	u8 ACPI_ENABLE;
-	u8 ACPI_DISABLE;
-	u8 unneded3[64 - 54];
-	u32 *PM1a_CNT_BLK;
-	u32 *PM1b_CNT_BLK;
-	u8 unneded4[89 - 72];
-	u8 PM1_CNT_LEN;
-};
+// Checksums the table and puts it in the directory. `address` 0 or above 4 GB is skipped.
+internal TableHeader *add_table(u64 address) {
+	// Only the low 4 GB are reachable
+	if (!address || address > 0xffffffff)
+		return 0;
+	auto header = reach_table(address);
+	if (header->length < sizeof(TableHeader) || !checksum_valid(header, header->length))
+		return 0;
+	if (tables.count == tables.capacity) {
+		debug_print("acpi: table directory is full\n"s);
+		return 0;
+	}
 
+	u32 signature = signature_value(header->signature);
+	auto &table = tables.add({.header = header, .signature = signature, .next_same = 0});
 
-// check if the given address has a valid header
-unsigned int *checkRSDP(unsigned int *ptr) {
-	char const *sig = "RSD PTR ";
-	RSDP *rsdp = (RSDP *)ptr;
-	u8 *bptr;
-	u8 check = 0;
+	u32 slot = index_slot(signature);
+	while (table_index[slot] && table_index[slot]->signature != signature)
+		slot = (slot + 1) % index_size;
+	if (!table_index[slot]) {
+		table_index[slot] = &table;
+	} else {
+		auto last = table_index[slot];
+		while (last->next_same)
+			last = last->next_same;
+		last->next_same = &table;
+	}
+	return header;
+}
 
-	if (memory_equals(sig, rsdp, 8))    {
-	   // check checksum rsdpd
-		bptr = (u8 *)ptr;
-		for (u32 i = 0; i < (u32)sizeof(RSDP); i++) 	  {
-			check += *bptr;
-			bptr++;
-		}
+// The DSDT is not in the RSDT / XSDT, the FADT points to it.
+internal void add_dsdt(TableHeader *fadt) {
+	u64 dsdt = 0;
+	// The 64 bit field wins if the table is long enough to have it
+	if (fadt->length >= 148)
+		copy_memory(&dsdt, (u8 *)fadt + 140, sizeof(u64));
+	if (!dsdt && fadt->length >= 44)
+		copy_memory(&dsdt, (u8 *)fadt + 40, sizeof(u32));
+	add_table(dsdt);
+}
 
-		// found valid rsdpd
-		if (check == 0) {
-		   /*
-			if (desc->Revision == 0)
-			  debug_print("acpi 1"s);
-		   else
-			  debug_print("acpi 2"s);
-		   */
-			return (unsigned int *)rsdp->rsdt;
+// Fills the directory from the XSDT, or the RSDT if there's no usable XSDT.
+internal bool read_tables(RSDP *rsdp) {
+	if (rsdp->revision >= 2) {
+		u64 xsdt_address = ((RSDP2 *)rsdp)->xsdt;
+		if (xsdt_address && xsdt_address <= 0xffffffff) {
+			auto xsdt = reach_table(xsdt_address);
+			if (memory_equals(xsdt->signature, "XSDT", 4) && checksum_valid(xsdt, xsdt->length)) {
+				u32 entry_count = (xsdt->length - sizeof(TableHeader)) / sizeof(u64);
+				auto entries = (u8 *)(xsdt + 1);
+				for (u32 i = 0; i < entry_count; ++i) {
+					// Only 4 byte aligned
+					u64 entry;
+					copy_memory(&entry, entries + i * sizeof(u64), sizeof(u64));
+					add_table(entry);
+				}
+				return true;
+			}
 		}
 	}
 
+	if (!rsdp->rsdt)
+		return false;
+	auto rsdt = reach_table(rsdp->rsdt);
+	if ( !memory_equals(rsdt->signature, "RSDT", 4) || !checksum_valid(rsdt, rsdt->length))
+		return false;
+	u32 entry_count = (rsdt->length - sizeof(TableHeader)) / sizeof(u32);
+	auto entries = (u32 *)(rsdt + 1);
+	for (u32 i = 0; i < entry_count; ++i)
+		add_table(entries[i]);
+	return true;
+}
+
+TableHeader *find_table(ascii const *signature, u32 index) {
+	u32 value = signature_value(signature);
+	for (u32 slot = index_slot(value); table_index[slot]; slot = (slot + 1) % index_size) {
+		auto table = table_index[slot];
+		if (table->signature != value)
+			continue;
+		for (; table && index; --index)
+			table = table->next_same;
+		return table ? table->header : 0;
+	}
 	return 0;
 }
 
-// finds the acpi header and returns the address of the rsdt
-unsigned int *getRSDP(void) {
-	unsigned int *addr;
-	unsigned int *rsdp;
+struct PACKED GenericAddress {
+	u8 address_space;
+	u8 bit_width;
+	u8 bit_offset;
+	u8 access_size;
+	u64 address;
+};
 
-	// search below the 1mb mark for RSDP signature
-	for (addr = (unsigned int *)0x000E0000; (int)addr < 0x00100000; addr += 0x10 / sizeof(addr))    {
-		rsdp = checkRSDP(addr);
-		if (rsdp != 0)
-			return rsdp;
+inline static constexpr u8 address_space_memory = 0;
+inline static constexpr u8 address_space_io     = 1;
+
+struct PACKED Fadt {
+	TableHeader header;
+	u32 firmware_control;
+	u32 dsdt;
+	u8 reserved;
+	u8 preferred_power_profile;
+	u16 sci_interrupt;
+	u32 smi_command;
+	u8 acpi_enable;
+	u8 acpi_disable;
+	u8 unneeded1[64 - 54];
+	u32 pm1a_control;
+	u32 pm1b_control;
+	u8 unneeded2[112 - 72];
+	// From here on only in revision 2 and later, check the length
+	u32 flags;
+	GenericAddress reset_register;
+	u8 reset_value;
+};
+static_assert(sizeof(Fadt) == 129);
+
+inline static constexpr u32 fadt_reset_register_supported = 1 << 10;
+
+inline static constexpr u16 pm1_sci_enable       = 1 << 0;
+inline static constexpr u16 pm1_sleep_type_shift = 10;
+inline static constexpr u16 pm1_sleep_type_mask  = 7 << pm1_sleep_type_shift;
+inline static constexpr u16 pm1_sleep_enable     = 1 << 13;
+
+// How long the firmware gets to switch to ACPI mode, around a second. Counted in cycles, as this
+// runs with interrupts off too.
+inline static constexpr u64 acpi_enable_timeout_cycles = 2'000'000'000;
+
+internal u16 smi_command;
+internal u8 acpi_enable_value;
+internal u16 pm1a_control;
+internal u16 pm1b_control;
+internal u16 sleep_type_a;
+internal u16 sleep_type_b;
+internal bool can_power_off;
+
+internal GenericAddress reset_register;
+internal u8 reset_value;
+internal bool can_reset;
+
+// Power off writes the S5 sleep type to the PM1 control registers, with the types from the \\_S5_ package:
+// Name(_S5_, Package() {SLP_TYPa, SLP_TYPb, ...})
+internal void init_power(Fadt *fadt) {
+	if (fadt->header.length >= sizeof(Fadt) && (fadt->flags & fadt_reset_register_supported)) {
+		reset_register = fadt->reset_register;
+		reset_value = fadt->reset_value;
+		can_reset = reset_register.address_space == address_space_io
+		        || (reset_register.address_space == address_space_memory && reset_register.address <= 0xffffffff);
+		if (reset_register.address_space == address_space_memory)
+			paging::exclude(reset_register.address, 1);
 	}
 
+	smi_command = (u16)fadt->smi_command;
+	acpi_enable_value = fadt->acpi_enable;
+	pm1a_control = (u16)fadt->pm1a_control;
+	pm1b_control = (u16)fadt->pm1b_control;
 
-	// at address 0x40:0x0E is the RM segment of the ebda
-	int ebda = *((short *)0x40E);   // get pointer
-	ebda = ebda * 0x10 & 0x000FFFFF;   // transform segment into linear address
-
-	// search Extended BIOS Data Area for the Root System Description Pointer signature
-	for (addr = (unsigned int *)ebda; (int)addr < ebda + 1024; addr += 0x10 / sizeof(addr))    {
-		rsdp = checkRSDP(addr);
-		if (rsdp != 0)
-			return rsdp;
+	auto s5 = aml::find("\\_S5_");
+	if (!s5) {
+		debug_print("acpi: \\_S5 not present\n"s);
+		return;
 	}
-
-	return 0;
+	u64 sleep_types[2];
+	if (aml::package_integers(*s5, sleep_types, 2) != 2) {
+		debug_print("acpi: \\_S5 parse error\n"s);
+		return;
+	}
+	sleep_type_a = (u16)((sleep_types[0] << pm1_sleep_type_shift) & pm1_sleep_type_mask);
+	sleep_type_b = (u16)((sleep_types[1] << pm1_sleep_type_shift) & pm1_sleep_type_mask);
+	can_power_off = pm1a_control != 0;
 }
 
-
-
-// checks for a given header and validates checksum
-int checkHeader(unsigned int *ptr, char const *sig) {
-	if (memory_equals(ptr, sig, 4))    {
-		char *checkPtr = (char *)ptr;
-		int len = *(ptr + 1);
-		char check = 0;
-		while (0 < len--) 	  {
-			check += *checkPtr;
-			checkPtr++;
-		}
-		if (check == 0)
-			return 0;
+bool init() {
+	auto rsdp = find_rsdp();
+	if (!rsdp) {
+		debug_print("RSDP not found\n"s);
+		return false;
+	}
+	rsdp_revision = rsdp->revision;
+	if (!read_tables(rsdp)) {
+		debug_print("acpi: no valid RSDT / XSDT\n"s);
+		return false;
 	}
-	return -1;
+	auto fadt = (Fadt *)find_table("FACP");
+	if (fadt)
+		add_dsdt(&fadt->header);
+
+	aml::init();
+	if (fadt)
+		init_power(fadt);
+	else
+		debug_print("acpi: no FADT, no power off or reset\n"s);
+	return true;
 }
 
 
 
-int enable(void) {
-   // check if acpi is enabled
-	if ((port::read_u16((unsigned int)PM1a_CNT) & SCI_EN) == 0)    {
-	   // check if acpi can be enabled
-		if (SMI_CMD != 0 && ACPI_ENABLE != 0) 	  {
-			port::write_u8((unsigned int)SMI_CMD, ACPI_ENABLE); // send acpi enable command
-			// give 3 seconds time to enable acpi
-			int i;
-			for (i = 0; i < 300; i++) 		 {
-				if ((port::read_u16((unsigned int)PM1a_CNT) & SCI_EN) == 1)
-					break;
-				sleep(10);
-			}
-			if (PM1b_CNT != 0)
-				for (; i < 300; i++) 			{
-					if ((port::read_u16((unsigned int)PM1b_CNT) & SCI_EN) == 1)
-						break;
-					sleep(10);
-				}
-			if (i < 300) {
-				debug_print("enabled acpi\n"s);
-				return 0;
-			} else {
-				debug_print("couldn't enable acpi\n"s);
-				return -1;
-			}
-		} else {
-			debug_print("no known way to enable acpi\n"s);
-			return -1;
-		}
+void print_tables() {
+	debug_print("acpi: RSDP revision "s);
+	debug_print(rsdp_revision);
+	debug_print(", tables:"s);
+	for (auto &table : tables) {
+		debug_print(' ');
+		debug_print(Span<ascii>{table.header->signature, 4});
+	}
+	debug_print(can_power_off ? "\nacpi: S5 power off"s : "\nacpi: no S5 power off"s);
+	if (can_reset) {
+		debug_print(reset_register.address_space == address_space_io ? ", reset register: port "s : ", reset register: memory "s);
+		debug_print(format_int((u32)reset_register.address, 16));
+		debug_print(" = "s);
+		debug_print(format_int(reset_value, 16));
 	} else {
-	   //debug_print("acpi was already enabled\n"s);
-		return 0;
+		debug_print(", no reset register"s);
 	}
+	debug_print('\n');
 }
 
-
-
-#if 1
-bool init() {
-	auto rsdp = get_rsdp();
-	if (rsdp) {
-		debug_print("Found RSDP revision "s);
-		debug_print(rsdp->revision);
-		debug_print(".\n"s);
-		if (rsdp->revision == 0) {
-
-		} else {
-		}
+// Switches the firmware from legacy mode to ACPI mode if it isn't there yet. Sleep states only work in ACPI mode.
+internal bool enable_acpi() {
+	if (port::read_u16(pm1a_control) & pm1_sci_enable)
 		return true;
+	if (!smi_command || !acpi_enable_value)
+		return false;
+	port::write_u8(smi_command, acpi_enable_value);
+	u64 start = cpu::read_timestamp();
+	while (!(port::read_u16(pm1a_control) & pm1_sci_enable)) {
+		if (cpu::read_timestamp() - start > acpi_enable_timeout_cycles)
+			return false;
+		cpu::pause();
 	}
-	debug_print("RSDP not found\n"s);
-	return false;
+	return true;
 }
-#else
-//
-// bytecode of the \_S5 object
-// -----------------------------------------
-//        | (optional) |    |    |    |
-// NameOP | \          | _  | S  | 5  | _
-// 08     | 5A         | 5F | 53 | 35 | 5F
-//
-// -----------------------------------------------------------------------------------------------------------
-//           |           |              | ( SLP_TYPa   ) | ( SLP_TYPb   ) | ( Reserved   ) | (Reserved    )
-// PackageOP | PkgLength | NumElements  | byteprefix Num | byteprefix Num | byteprefix Num | byteprefix Num
-// 12        | 0A        | 04           | 0A         05  | 0A          05 | 0A         05  | 0A         05
-//
-//----this-structure-was-also-seen----------------------
-// PackageOP | PkgLength | NumElements |
-// 12        | 06        | 04          | 00 00 00 00
-//
-// (Pkglength bit 6-7 encode additional PkgLength bytes [shouldn't be the case here])
-//
-bool init() {
-	unsigned int *ptr = getRSDP();
-
-	// check if address is correct  ( if acpi is available on this pc )
-	if (ptr != 0 && checkHeader(ptr, "RSDT") == 0)    {
-	   // the RSDT contains an unknown number of pointers to acpi tables
-		int entrys = *(ptr + 1);
-		entrys = (entrys - 36) / 4;
-		ptr += 36 / 4;   // skip header information
-
-		while (0 < entrys--) 	  {
-		   // check if the desired table is reached
-			if (checkHeader((unsigned int *)*ptr, "FACP") == 0) 		 {
-				entrys = -2;
-				FACP *facp = (FACP *)*ptr;
-				if (checkHeader((unsigned int *)facp->DSDT, "DSDT") == 0) 			{
-				   // search the \_S5 package in the DSDT
-					char *S5Addr = (char *)facp->DSDT + 36; // skip header
-					int dsdtLength = *(facp->DSDT + 1) - 36;
-					while (0 < dsdtLength--) 			   {
-						if (memory_equals(S5Addr, "_S5_", 4))
-							break;
-						S5Addr++;
-					}
-					// check if \_S5 was found
-					if (dsdtLength > 0) 			   {
-					   // check for valid AML structure
-						if ((*(S5Addr - 1) == 0x08 || (*(S5Addr - 2) == 0x08 && *(S5Addr - 1) == '\\')) && *(S5Addr + 4) == 0x12) 				  {
-							S5Addr += 5;
-							S5Addr += ((*S5Addr & 0xC0) >> 6) + 2;   // calculate PkgLength size
-
-							if (*S5Addr == 0x0A)
-								S5Addr++;   // skip byteprefix
-							SLP_TYPa = *(S5Addr) << 10;
-							S5Addr++;
-
-							if (*S5Addr == 0x0A)
-								S5Addr++;   // skip byteprefix
-							SLP_TYPb = *(S5Addr) << 10;
-
-							SMI_CMD = facp->SMI_CMD;
-
-							ACPI_ENABLE = facp->ACPI_ENABLE;
-							ACPI_DISABLE = facp->ACPI_DISABLE;
-
-							PM1a_CNT = facp->PM1a_CNT_BLK;
-							PM1b_CNT = facp->PM1b_CNT_BLK;
-
-							PM1_CNT_LEN = facp->PM1_CNT_LEN;
-
-							SLP_EN = 1 << 13;
-							SCI_EN = 1;
-
-							return true;
-						} else {
-							debug_print("\\_S5 parse error\n"s);
-						}
-					} else {
-						debug_print("\\_S5 not present\n"s);
-					}
-				} else {
-					debug_print("DSDT invalid\n"s);
-				}
-			}
-			ptr++;
-		}
-		debug_print("no valid FACP present\n"s);
-	} else {
-		debug_print("no acpi\n"s);
-	}
 
-	return false;
+internal void enter_sleep_state(u16 control, u16 sleep_type) {
+	u16 value = port::read_u16(control);
+	port::write_u16(control, (value & ~pm1_sleep_type_mask) | sleep_type | pm1_sleep_enable);
 }
-#endif
-
-
-
-void power_off() {
-   // SCI_EN is set to 1 if acpi shutdown is possible
-	if (SCI_EN == 0)
-		return;
-
-	enable();
-
-	// send the shutdown command
-	port::write_u16((unsigned int)PM1a_CNT, SLP_TYPa | SLP_EN);
-	if (PM1b_CNT != 0)
-		port::write_u16((unsigned int)PM1b_CNT, SLP_TYPb | SLP_EN);
 
-	debug_print("acpi poweroff failed\n"s);
+bool power_off() {
+	if (!can_power_off)
+		return false;
+	if (!enable_acpi())
+		debug_print("acpi: couldn't switch to ACPI mode, trying S5 anyway\n"s);
+
+	cpu::disable_interrupts();
+	enter_sleep_state(pm1a_control, sleep_type_a);
+	if (pm1b_control)
+		enter_sleep_state(pm1b_control, sleep_type_b);
+	return true;
 }
 
-void restart() {
-	//port::write_u8(FADT->ResetReg.Address, FADT->ResetValue);
+bool reset() {
+	if (!can_reset)
+		return false;
+	if (reset_register.address_space == address_space_io)
+		port::write_u8((u16)reset_register.address, reset_value);
+	else
+		*(u8 volatile *)(umm)reset_register.address = reset_value;
+	return true;
 }
 
 }
@@ -1,9 +1,36 @@
 #pragma once
+#include "common.h"
 
 namespace acpi {
 
+struct PACKED TableHeader {
+	ascii signature[4];
+	u32 length;
+	u8 revision;
+	u8 checksum;
+	ascii oem_id[6];
+	ascii oem_table_id[8];
+	u32 oem_revision;
+	u32 creator_id;
+	u32 creator_revision;
+};
+
+// Finds the RSDP and reads the RSDT / XSDT into a directory of tables, each checksummed once.
+// The DSDT, which the FADT points to, is in there too.
 bool init();
-void restart();
-void power_off();
+
+// The `index`th table with this signature, in RSDT / XSDT order, or null. Several SSDTs are common.
+// A hash lookup in the directory `init` built.
+TableHeader *find_table(ascii const *signature, u32 index = 0);
+
+void print_tables();
+
+// Writes the FADT reset register. False if there isn't one we can reach, true if it was written:
+// the machine should be resetting, but the caller has to decide how long to wait for it.
+bool reset();
+
+// Enters S5 through the PM1 control registers, switching to ACPI mode first. False if \\_S5 or the
+// registers are missing; returns with interrupts off if they were written and we are still running.
+bool power_off();
 
 }
@@ -0,0 +1,567 @@
+#include "aml.h"
+#include "acpi.h"
+#include "debug.h"
+
+namespace aml {
+
+inline static constexpr u32 max_object_count = 1024;
+inline static constexpr u32 bucket_count = 1024;
+
+internal StaticList<Object, max_object_count> objects;
+internal Object *buckets[bucket_count];
+
+struct Stats {
+	u32 tables;
+	u32 bytes;
+	u32 skipped_bytes;  // In constructs the walker doesn't understand
+	u32 dropped;        // Objects that didn't fit in the index
+};
+
+internal Stats stats;
+
+inline static constexpr u8 op_zero          = 0x00;
+inline static constexpr u8 op_one           = 0x01;
+inline static constexpr u8 op_alias         = 0x06;
+inline static constexpr u8 op_name          = 0x08;
+inline static constexpr u8 op_byte          = 0x0a;
+inline static constexpr u8 op_word          = 0x0b;
+inline static constexpr u8 op_dword         = 0x0c;
+inline static constexpr u8 op_string        = 0x0d;
+inline static constexpr u8 op_qword         = 0x0e;
+inline static constexpr u8 op_scope         = 0x10;
+inline static constexpr u8 op_buffer        = 0x11;
+inline static constexpr u8 op_package       = 0x12;
+inline static constexpr u8 op_var_package   = 0x13;
+inline static constexpr u8 op_method        = 0x14;
+inline static constexpr u8 op_external      = 0x15;
+inline static constexpr u8 op_dual_name     = 0x2e;
+inline static constexpr u8 op_multi_name    = 0x2f;
+inline static constexpr u8 op_extended      = 0x5b;
+inline static constexpr u8 op_root          = '\\';
+inline static constexpr u8 op_parent        = '^';
+inline static constexpr u8 op_local_0       = 0x60;
+inline static constexpr u8 op_arg_6         = 0x6e;
+inline static constexpr u8 op_add           = 0x72;
+inline static constexpr u8 op_subtract      = 0x74;
+inline static constexpr u8 op_multiply      = 0x77;
+inline static constexpr u8 op_shift_left    = 0x79;
+inline static constexpr u8 op_shift_right   = 0x7a;
+inline static constexpr u8 op_and           = 0x7b;
+inline static constexpr u8 op_or            = 0x7d;
+inline static constexpr u8 op_xor           = 0x7f;
+inline static constexpr u8 op_if            = 0xa0;
+inline static constexpr u8 op_else          = 0xa1;
+inline static constexpr u8 op_while         = 0xa2;
+inline static constexpr u8 op_noop          = 0xa3;
+inline static constexpr u8 op_ones          = 0xff;
+
+// After op_extended
+inline static constexpr u8 op_mutex         = 0x01;
+inline static constexpr u8 op_event         = 0x02;
+inline static constexpr u8 op_revision      = 0x30;
+inline static constexpr u8 op_region        = 0x80;
+inline static constexpr u8 op_field         = 0x81;
+inline static constexpr u8 op_device        = 0x82;
+inline static constexpr u8 op_processor     = 0x83;
+inline static constexpr u8 op_power_resource = 0x84;
+inline static constexpr u8 op_thermal_zone  = 0x85;
+inline static constexpr u8 op_index_field   = 0x86;
+inline static constexpr u8 op_bank_field    = 0x87;
+
+// Nested expressions in region definitions are rarely more than a couple deep
+inline static constexpr u32 max_expression_depth = 8;
+
+internal u32 hash(Path const &path) {
+	u32 value = 2166136261u;
+	for (u32 i = 0; i < path.count; ++i)
+		value = (value ^ path.segments[i]) * 16777619u;
+	return value % bucket_count;
+}
+
+internal bool paths_equal(Path const &a, Path const &b) {
+	if (a.count != b.count)
+		return false;
+	for (u32 i = 0; i < a.count; ++i) {
+		if (a.segments[i] != b.segments[i])
+			return false;
+	}
+	return true;
+}
+
+internal Object *lookup(Path const &path) {
+	for (auto object = buckets[hash(path)]; object; object = object->next) {
+		if (paths_equal(object->path, path))
+			return object;
+	}
+	return 0;
+}
+
+// The first definition wins, later ones (an External of it, say) don't replace it.
+internal void add(Path const &path, Kind kind, u8 const *data, u8 const *end) {
+	if (lookup(path))
+		return;
+	if (objects.count == objects.capacity) {
+		stats.dropped += 1;
+		return;
+	}
+	auto &bucket = buckets[hash(path)];
+	bucket = &objects.add({.path = path, .kind = kind, .data = data, .end = end, .next = bucket});
+}
+
+// PkgLength: the top two bits of the first byte say how many bytes follow. With none, the low six bits
+// are the length; otherwise the low four bits are, and each following byte adds eight more on top.
+// The length counts the PkgLength itself.
+internal bool read_package_length(u8 const *&cursor, u8 const *limit, u8 const *&package_end) {
+	u8 const *start = cursor;
+	if (cursor >= limit)
+		return false;
+	u8 lead = *cursor++;
+	u32 follow_count = lead >> 6;
+	u32 length = follow_count ? lead & 0x0f : lead & 0x3f;
+	if ((umm)(limit - cursor) < follow_count)
+		return false;
+	for (u32 i = 0; i < follow_count; ++i)
+		length |= (u32)*cursor++ << (4 + i * 8);
+	if ((umm)(limit - start) < length || start + length < cursor)
+		return false;
+	package_end = start + length;
+	return true;
+}
+
+internal bool is_lead_character(u8 c) {
+	return c == '_' || ('A' <= c && c <= 'Z');
+}
+
+// Reads a NameString and resolves it against `scope`.
+internal bool read_name(u8 const *&cursor, u8 const *limit, Path const &scope, Path &result) {
+	result = scope;
+	if (cursor < limit && *cursor == op_root) {
+		result.count = 0;
+		++cursor;
+	} else {
+		while (cursor < limit && *cursor == op_parent) {
+			if (!result.count)
+				return false;
+			--result.count;
+			++cursor;
+		}
+	}
+	if (cursor >= limit)
+		return false;
+
+	u32 segment_count;
+	switch (*cursor) {
+		case op_zero: { // NullName
+			++cursor;
+			return true;
+		}
+		case op_dual_name: {
+			++cursor;
+			segment_count = 2;
+			break;
+		}
+		case op_multi_name: {
+			++cursor;
+			if (cursor >= limit)
+				return false;
+			segment_count = *cursor++;
+			break;
+		}
+		default: {
+			segment_count = 1;
+			break;
+		}
+	}
+	if ((umm)(limit - cursor) < segment_count * 4)
+		return false;
+	for (u32 i = 0; i < segment_count; ++i) {
+		if (!is_lead_character(*cursor) || result.count == max_depth)
+			return false;
+		copy_memory(&result.segments[result.count++], cursor, 4);
+		cursor += 4;
+	}
+	return true;
+}
+
+internal bool skip(u8 const *&cursor, u8 const *limit, umm count) {
+	if ((umm)(limit - cursor) < count)
+		return false;
+	cursor += count;
+	return true;
+}
+
+bool read_integer(u8 const *&cursor, u8 const *end, u64 &value) {
+	if (cursor >= end)
+		return false;
+	u32 size;
+	switch (*cursor) {
+		case op_zero:  { ++cursor; value = 0; return true; }
+		case op_one:   { ++cursor; value = 1; return true; }
+		case op_ones:  { ++cursor; value = ~(u64)0; return true; }
+		case op_byte:  { size = 1; break; }
+		case op_word:  { size = 2; break; }
+		case op_dword: { size = 4; break; }
+		case op_qword: { size = 8; break; }
+		default: return false;
+	}
+	if ((umm)(end - cursor) < 1 + size)
+		return false;
+	value = 0;
+	copy_memory(&value, cursor + 1, size);
+	cursor += 1 + size;
+	return true;
+}
+
+internal bool skip_data_object(u8 const *&cursor, u8 const *limit) {
+	u64 value;
+	if (read_integer(cursor, limit, value))
+		return true;
+	if (cursor >= limit)
+		return false;
+	switch (*cursor) {
+		case op_string: {
+			++cursor;
+			while (cursor < limit && *cursor)
+				++cursor;
+			return skip(cursor, limit, 1);
+		}
+		case op_buffer:
+		case op_package:
+		case op_var_package: {
+			++cursor;
+			u8 const *package_end;
+			if (!read_package_length(cursor, limit, package_end))
+				return false;
+			cursor = package_end;
+			return true;
+		}
+		case op_extended: {
+			if (limit - cursor < 2 || cursor[1] != op_revision)
+				return false;
+			cursor += 2;
+			return true;
+		}
+	}
+	return false;
+}
+
+internal bool is_name_start(u8 c) {
+	return is_lead_character(c) || c == op_root || c == op_parent || c == op_dual_name || c == op_multi_name;
+}
+
+// Target of an expression: a name, a local or argument, or nothing.
+internal bool skip_target(u8 const *&cursor, u8 const *limit) {
+	if (cursor >= limit)
+		return false;
+	u8 op = *cursor;
+	if (op == op_zero || (op_local_0 <= op && op <= op_arg_6)) {
+		++cursor;
+		return true;
+	}
+	Path name;
+	return is_name_start(op) && read_name(cursor, limit, {}, name);
+}
+
+// Only constants, names, locals, arguments and integer arithmetic. That covers what firmware
+// puts in region offsets and lengths.
+internal bool skip_term_argument(u8 const *&cursor, u8 const *limit, u32 depth = 0) {
+	if (cursor >= limit || depth == max_expression_depth)
+		return false;
+	u8 op = *cursor;
+	if (op_local_0 <= op && op <= op_arg_6) {
+		++cursor;
+		return true;
+	}
+	if (is_name_start(op)) {
+		Path name;
+		return read_name(cursor, limit, {}, name);
+	}
+	switch (op) {
+		case op_add:
+		case op_subtract:
+		case op_multiply:
+		case op_shift_left:
+		case op_shift_right:
+		case op_and:
+		case op_or:
+		case op_xor: {
+			++cursor;
+			return skip_term_argument(cursor, limit, depth + 1)
+				&& skip_term_argument(cursor, limit, depth + 1)
+				&& skip_target(cursor, limit);
+		}
+	}
+	return skip_data_object(cursor, limit);
+}
+
+// Definitions with a PkgLength, a name and a body: Scope, Device, Method, ...
+// Leaves `cursor` after the name and `package_end` at the end of the definition.
+internal bool read_named_package(u8 const *&cursor, u8 const *limit, Path const &scope, Path &name, u8 const *&package_end) {
+	return read_package_length(cursor, limit, package_end) && read_name(cursor, package_end, scope, name);
+}
+
+internal void walk(u8 const *cursor, u8 const *end, Path const &scope);
+
+// Walks the definition of something that has its own term list after `fixed_size` bytes of fields.
+internal bool walk_container(u8 const *&cursor, u8 const *end, Path const &scope, Kind kind, u32 fixed_size) {
+	Path name;
+	u8 const *package_end;
+	if (!read_named_package(cursor, end, scope, name, package_end) || !skip(cursor, package_end, fixed_size))
+		return false;
+	add(name, kind, cursor, package_end);
+	walk(cursor, package_end, name);
+	cursor = package_end;
+	return true;
+}
+
+internal bool walk_extended(u8 const *&cursor, u8 const *end, Path const &scope, u8 const *term) {
+	if (cursor >= end)
+		return false;
+	Path name;
+	u8 const *package_end;
+	switch (*cursor++) {
+		case op_device:         return walk_container(cursor, end, scope, Kind_device, 0);
+		case op_processor:      return walk_container(cursor, end, scope, Kind_processor, 6); // Id, block address and length
+		case op_power_resource: return walk_container(cursor, end, scope, Kind_power_resource, 3); // Level, order
+		case op_thermal_zone:   return walk_container(cursor, end, scope, Kind_thermal_zone, 0);
+		case op_region: {
+			// Name, space, offset, length
+			if (!read_name(cursor, end, scope, name) || !skip(cursor, end, 1)
+			 || !skip_term_argument(cursor, end) || !skip_term_argument(cursor, end))
+				return false;
+			add(name, Kind_region, term, cursor);
+			return true;
+		}
+		case op_field:
+		case op_index_field:
+		case op_bank_field: {
+			if (!read_package_length(cursor, end, package_end))
+				return false;
+			cursor = package_end;
+			return true;
+		}
+		case op_mutex: {
+			if (!read_name(cursor, end, scope, name) || !skip(cursor, end, 1))
+				return false;
+			add(name, Kind_mutex, term, cursor);
+			return true;
+		}
+		case op_event: {
+			if (!read_name(cursor, end, scope, name))
+				return false;
+			add(name, Kind_event, term, cursor);
+			return true;
+		}
+	}
+	return false;
+}
+
+// One term. Returns false on something it doesn't understand, with `cursor` anywhere.
+internal bool walk_term(u8 const *&cursor, u8 const *end, Path const &scope) {
+	u8 const *term = cursor;
+	Path name;
+	u8 const *package_end;
+	switch (*cursor++) {
+		case op_scope: {
+			if (!read_named_package(cursor, end, scope, name, package_end))
+				return false;
+			walk(cursor, package_end, name);
+			cursor = package_end;
+			return true;
+		}
+		case op_name: {
+			if (!read_name(cursor, end, scope, name))
+				return false;
+			u8 const *data = cursor;
+			if (!skip_data_object(cursor, end))
+				return false;
+			add(name, Kind_name, data, cursor);
+			return true;
+		}
+		case op_method: {
+			if (!read_named_package(cursor, end, scope, name, package_end))
+				return false;
+			add(name, Kind_method, cursor, package_end);
+			cursor = package_end;
+			return true;
+		}
+		case op_alias: {
+			Path target;
+			if (!read_name(cursor, end, scope, target) || !read_name(cursor, end, scope, name))
+				return false;
+			add(name, Kind_alias, term, cursor);
+			return true;
+		}
+		case op_external: {
+			// Type and argument count
+			return read_name(cursor, end, scope, name) && skip(cursor, end, 2);
+		}
+		case op_if:
+		case op_else:
+		case op_while: {
+			if (!read_package_length(cursor, end, package_end))
+				return false;
+			cursor = package_end;
+			return true;
+		}
+		case op_noop: {
+			return true;
+		}
+		case op_extended: {
+			return walk_extended(cursor, end, scope, term);
+		}
+	}
+	return false;
+}
+
+internal void walk(u8 const *cursor, u8 const *end, Path const &scope) {
+	while (cursor < end) {
+		u8 const *term = cursor;
+		if (!walk_term(cursor, end, scope)) {
+			stats.skipped_bytes += end - term;
+			return;
+		}
+	}
+}
+
+internal void walk_table(acpi::TableHeader *table) {
+	if (!table)
+		return;
+	stats.tables += 1;
+	stats.bytes += table->length;
+	walk((u8 const *)(table + 1), (u8 const *)table + table->length, {});
+}
+
+void init() {
+	walk_table(acpi::find_table("DSDT"));
+	for (u32 i = 0; auto ssdt = acpi::find_table("SSDT", i); ++i)
+		walk_table(ssdt);
+}
+
+// Parses "\\A.BB.CCC" into segments, padding with '_'.
+internal bool parse_path(ascii const *string, Path &path) {
+	path = {};
+	if (*string == '\\')
+		++string;
+	while (*string) {
+		if (path.count == max_depth)
+			return false;
+		ascii segment[4] = {'_', '_', '_', '_'};
+		for (u32 i = 0; *string && *string != '.'; ++i, ++string) {
+			if (i == 4)
+				return false;
+			segment[i] = *string;
+		}
+		copy_memory(&path.segments[path.count++], segment, 4);
+		if (*string == '.')
+			++string;
+	}
+	return true;
+}
+
+Object *find(ascii const *string) {
+	Path path;
+	if (!parse_path(string, path))
+		return 0;
+	return lookup(path);
+}
+
+Object *find_by_name(ascii const *segment, Object *after) {
+	Path path;
+	if (!parse_path(segment, path) || path.count != 1)
+		return 0;
+	for (auto object = after ? after + 1 : objects.begin(); object < objects.end(); ++object) {
+		if (object->path.count && object->path.segments[object->path.count - 1] == path.segments[0])
+			return object;
+	}
+	return 0;
+}
+
+u32 package_integers(Object const &object, u64 *values, u32 capacity) {
+	if (object.kind != Kind_name)
+		return 0;
+	u8 const *cursor = object.data;
+	if (cursor >= object.end || *cursor != op_package)
+		return 0;
+	++cursor;
+	u8 const *package_end;
+	if (!read_package_length(cursor, object.end, package_end) || cursor >= package_end)
+		return 0;
+	u32 element_count = *cursor++;
+	u32 count = 0;
+	while (count < capacity && count < element_count && read_integer(cursor, package_end, values[count]))
+		++count;
+	return count;
+}
+
+Span<u8 const> buffer_data(Object const &object) {
+	if (object.kind != Kind_name)
+		return {};
+	u8 const *cursor = object.data;
+	if (cursor >= object.end || *cursor != op_buffer)
+		return {};
+	++cursor;
+	u8 const *package_end;
+	u64 size;
+	if (!read_package_length(cursor, object.end, package_end) || !read_integer(cursor, package_end, size))
+		return {};
+	return {cursor, (umm)min<u64>(size, package_end - cursor)};
+}
+
+void print_path(Path const &path) {
+	debug::print('\\');
+	for (u32 i = 0; i < path.count; ++i) {
+		if (i)
+			debug::print('.');
+		debug::print(Span<ascii>{(ascii *)&path.segments[i], 4});
+	}
+}
+
+internal constexpr Array<Span<ascii>, Kind_count> kind_names = [] {
+	Array<Span<ascii>, Kind_count> result = {};
+	result.data[Kind_name]           = "names"s;
+	result.data[Kind_method]         = "methods"s;
+	result.data[Kind_device]         = "devices"s;
+	result.data[Kind_processor]      = "processors"s;
+	result.data[Kind_power_resource] = "power resources"s;
+	result.data[Kind_thermal_zone]   = "thermal zones"s;
+	result.data[Kind_region]         = "regions"s;
+	result.data[Kind_mutex]          = "mutexes"s;
+	result.data[Kind_event]          = "events"s;
+	result.data[Kind_alias]          = "aliases"s;
+	return result;
+}();
+
+void print_stats() {
+	u32 kind_counts[Kind_count] = {};
+	for (auto &object : objects)
+		kind_counts[object.kind] += 1;
+
+	debug::print("aml: "s);
+	debug::print(objects.count);
+	debug::print(" objects from "s);
+	debug::print(stats.tables);
+	debug::print(" tables ("s);
+	debug::print(stats.bytes);
+	debug::print(" bytes, "s);
+	debug::print(stats.skipped_bytes);
+	debug::print(" not understood), "s);
+	for (u32 kind = 0; kind < Kind_count; ++kind) {
+		if (!kind_counts[kind])
+			continue;
+		debug::print(kind_counts[kind]);
+		debug::print(' ');
+		debug::print(kind_names[kind]);
+		debug::print(", "s);
+	}
+	debug::print(stats.dropped);
+	debug::print(" dropped\n"s);
+
+	for (auto object = find_by_name("_PRT"); object; object = find_by_name("_PRT", object)) {
+		debug::print("  routing table: "s);
+		print_path(object->path);
+		debug::print('\n');
+	}
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "common.h"
+
+// Index of the named objects that the DSDT and SSDTs define.
+//
+// AML is not interpreted: `init` only walks the term lists, going into scopes and devices and over
+// method bodies by their PkgLength, and records where every Name, Method, Device and so on is defined.
+// Definitions inside If / Else / While are skipped, as their predicates would need evaluating. So do
+// constructs the walker doesn't understand, up to the end of the scope around them.
+namespace aml {
+
+inline static constexpr u32 max_depth = 8;
+
+struct Path {
+	u32 segments[max_depth]; // Four characters each, padded with '_'
+	u8 count;
+};
+
+enum Kind : u8 {
+	Kind_name,
+	Kind_method,
+	Kind_device,
+	Kind_processor,
+	Kind_power_resource,
+	Kind_thermal_zone,
+	Kind_region,
+	Kind_mutex,
+	Kind_event,
+	Kind_alias,
+	Kind_count,
+};
+
+struct Object {
+	Path path; // Absolute
+	Kind kind;
+	// Name: its data object. Method: the flags byte and the body. Device, processor, power resource and
+	// thermal zone: the definition after the name. Others: the whole definition.
+	u8 const *data;
+	u8 const *end;
+
+	Object *next; // In the hash bucket
+};
+
+// Walks the DSDT and every SSDT, in that order. Needs acpi.
+void init();
+
+// `path` is absolute, like "\\_SB_.PCI0._PRT". Short segments are padded: "\\_S5" is "\\_S5_".
+Object *find(ascii const *path);
+
+// The next object after `after` whose last segment is `segment`, e.g. every "_PRT" in the namespace.
+Object *find_by_name(ascii const *segment, Object *after = 0);
+
+// Reads an integer data object: Zero, One, Ones or a Byte/Word/DWord/QWord constant.
+bool read_integer(u8 const *&cursor, u8 const *end, u64 &value);
+
+// For a Name whose value is a package, reads its leading integer elements into `values`.
+// Returns how many were read, which stops at the first element that isn't an integer.
+u32 package_integers(Object const &object, u64 *values, u32 capacity);
+
+// For a Name whose value is a buffer (like a _CRS resource template), its bytes. Empty otherwise.
+Span<u8 const> buffer_data(Object const &object);
+
+void print_path(Path const &path);
+void print_stats();
+
+}
@@ -0,0 +1,138 @@
+#include "async.h"
+#include "cpu.h"
+
+namespace async {
+
+internal Waiter *ready_first;
+internal Waiter *ready_last;
+internal sync::WaitQueue ready_queue;
+
+// Sorted by deadline. Only touched by tasks, so no need to disable interrupts.
+internal SleepAwaiter *sleepers;
+
+void schedule(Waiter &waiter) {
+	{
+		cpu::InterruptGuard guard;
+		waiter.next = 0;
+		if (ready_last) {
+			ready_last->next = &waiter;
+		} else {
+			ready_first = &waiter;
+		}
+		ready_last = &waiter;
+	}
+	sync::wake_all(ready_queue);
+}
+
+internal bool sleeper_expired() {
+	return sleepers && (s32)(timer::tick - sleepers->deadline) >= 0;
+}
+
+void run_ready() {
+	while (sleeper_expired()) {
+		auto sleeper = sleepers;
+		sleepers = (SleepAwaiter *)sleeper->next;
+		schedule(*sleeper);
+	}
+
+	// Take the whole list at once, so tasks that are scheduled while resuming wait for the next round
+	// and a task that keeps rescheduling itself can't starve the sleep check above.
+	Waiter *waiter;
+	{
+		cpu::InterruptGuard guard;
+		waiter = ready_first;
+		ready_first = ready_last = 0;
+	}
+	while (waiter) {
+		auto next = waiter->next;
+		waiter->handle.resume();
+		waiter = next;
+	}
+}
+
+void run() {
+	while (1) {
+		run_ready();
+		sync::wait(ready_queue, [] { return ready_first != 0 || sleeper_expired(); });
+	}
+}
+
+void spawn(Task<void> task) {
+	auto handle = task.handle;
+	task.handle = {};
+	if (!handle)
+		return;
+
+	auto &promise = handle.promise();
+	promise.detached = true;
+	promise.start.handle = handle;
+	schedule(promise.start);
+}
+
+void signal(Event &event) {
+	Waiter *waiter;
+	{
+		cpu::InterruptGuard guard;
+		waiter = event.first;
+		if (!waiter) {
+			event.pending = event.pending + 1;
+			return;
+		}
+		event.first = waiter->next;
+		if (!event.first)
+			event.last = 0;
+	}
+	schedule(*waiter);
+}
+
+void broadcast(Event &event) {
+	Waiter *waiter;
+	{
+		cpu::InterruptGuard guard;
+		waiter = event.first;
+		event.first = event.last = 0;
+	}
+	while (waiter) {
+		auto next = waiter->next;
+		schedule(*waiter);
+		waiter = next;
+	}
+}
+
+bool try_consume(Event &event) {
+	cpu::InterruptGuard guard;
+	if (event.pending) {
+		event.pending = event.pending - 1;
+		return true;
+	}
+	return false;
+}
+
+bool EventAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+	cpu::InterruptGuard guard;
+	if (event.pending) {
+		event.pending = event.pending - 1;
+		return false;
+	}
+	handle = awaiting;
+	next = 0;
+	if (event.last) {
+		event.last->next = this;
+	} else {
+		event.first = this;
+	}
+	event.last = this;
+	return true;
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+	handle = awaiting;
+
+	auto link = &sleepers;
+	while (*link && (s32)(deadline - (*link)->deadline) >= 0)
+		link = (SleepAwaiter **)&(*link)->next;
+	next = *link;
+	*link = this;
+}
+
+}
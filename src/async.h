@@ -0,0 +1,215 @@
+#pragma once
+#include "common.h"
+#include "coroutine.h"
+#include "memory.h"
+#include "sync.h"
+#include "timer.h"
+
+// Coroutine based tasks.
+//
+// Coroutine frames come from memory::allocate_block, and everything a suspended coroutine waits on
+// is linked through the `Waiter` inside its awaiter, which lives in the frame. So an operation in flight
+// costs one frame and there is no limit on how many of them there can be.
+//
+// Tasks are resumed only by the executor (`run` / `run_ready`), never from irq context.
+// Irq handlers may call `signal`, `broadcast` and `push`.
+namespace async {
+
+struct Waiter {
+	Waiter *next = 0;
+	std::coroutine_handle<> handle;
+};
+
+// Puts the waiter on the ready list. Irq safe.
+void schedule(Waiter &waiter);
+
+// Resumes everything that is ready, including expired sleeps.
+void run_ready();
+
+// Runs tasks forever, sleeping when there's nothing to do.
+[[noreturn]] void run();
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	Waiter start;
+	bool detached = false;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <class Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			auto &promise = handle.promise();
+			if (promise.continuation)
+				return promise.continuation;
+			if (promise.detached)
+				handle.destroy();
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { unreachable(); }
+
+	static void *operator new(umm size) noexcept { return memory::allocate_block(size); }
+	static void operator delete(void *frame, umm size) { memory::free_block(frame, size); }
+};
+
+template <class T>
+struct Task;
+
+template <class T>
+struct Promise : PromiseBase {
+	T value;
+
+	Task<T> get_return_object();
+	static Task<T> get_return_object_on_allocation_failure();
+	void return_value(T const &result) { value = result; }
+	T &&result() { return static_cast<T &&>(value); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	static Task<void> get_return_object_on_allocation_failure();
+	void return_void() {}
+	void result() {}
+};
+
+// Lazily started: the body runs when the task is awaited or spawned.
+template <class T = void>
+struct Task {
+	using promise_type = Promise<T>;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	Task() = default;
+	explicit Task(Handle handle) : handle(handle) {}
+	Task(Task &&that) : handle(that.handle) { that.handle = {}; }
+	Task(Task const &) = delete;
+	~Task() {
+		if (handle)
+			handle.destroy();
+	}
+
+	struct Awaiter {
+		Handle handle;
+
+		bool await_ready() { return !handle; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+		T await_resume() { return handle.promise().result(); }
+	};
+
+	Awaiter operator co_await() { return {handle}; }
+
+	Handle handle;
+};
+
+template <class T>
+Task<T> Promise<T>::get_return_object() { return Task<T>{Task<T>::Handle::from_promise(*this)}; }
+template <class T>
+Task<T> Promise<T>::get_return_object_on_allocation_failure() { return {}; }
+inline Task<void> Promise<void>::get_return_object() { return Task<void>{Task<void>::Handle::from_promise(*this)}; }
+inline Task<void> Promise<void>::get_return_object_on_allocation_failure() { return {}; }
+
+// Starts the task on the executor. Its frame is freed when it completes.
+void spawn(Task<void> task);
+
+// Auto-reset event. Every `signal` releases exactly one waiter;
+// signals that nobody waits for are counted and consumed by later waits.
+struct Event {
+	Waiter *first = 0;
+	Waiter *last = 0;
+	u32 volatile pending = 0;
+};
+
+// Irq safe.
+void signal(Event &event);
+// Releases all current waiters. Irq safe.
+void broadcast(Event &event);
+// Consumes a pending signal if there is one.
+bool try_consume(Event &event);
+
+struct EventAwaiter : Waiter {
+	explicit EventAwaiter(Event &event) : event(event) {}
+
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> awaiting);
+	void await_resume() {}
+
+	Event &event;
+};
+
+inline EventAwaiter wait(Event &event) { return EventAwaiter{event}; }
+
+struct SleepAwaiter : Waiter {
+	explicit SleepAwaiter(u32 deadline) : deadline(deadline) {}
+
+	bool await_ready() { return (s32)(timer::tick - deadline) >= 0; }
+	void await_suspend(std::coroutine_handle<> awaiting);
+	void await_resume() {}
+
+	u32 deadline;
+};
+
+inline SleepAwaiter sleep_until(u32 tick) { return SleepAwaiter{tick}; }
+inline SleepAwaiter sleep(u32 milliseconds) { return SleepAwaiter{timer::tick + timer::milliseconds_to_ticks(milliseconds)}; }
+
+// Ring buffer that can be awaited until it becomes readable.
+// Filled from one irq handler or task, drained by tasks or by blocking `receive`.
+template <class T, umm capacity>
+struct Channel {
+	RingBuffer<T, capacity> buffer;
+	Event readable;
+	sync::WaitQueue waiters;
+};
+
+// Returns false if the channel is full. Irq safe.
+template <class T, umm capacity>
+bool push(Channel<T, capacity> &channel, T const &value) {
+	if (!channel.buffer.push(value))
+		return false;
+	signal(channel.readable);
+	sync::wake_all(channel.waiters);
+	return true;
+}
+
+template <class T, umm capacity>
+struct ReceiveAwaiter : EventAwaiter {
+	explicit ReceiveAwaiter(Channel<T, capacity> &channel) : EventAwaiter(channel.readable), channel(channel) {}
+
+	T await_resume() {
+		T value = {};
+		channel.buffer.pop(value);
+		return value;
+	}
+
+	Channel<T, capacity> &channel;
+};
+
+template <class T, umm capacity>
+ReceiveAwaiter<T, capacity> receive_async(Channel<T, capacity> &channel) {
+	return ReceiveAwaiter<T, capacity>{channel};
+}
+
+// Blocking version for code that isn't a task.
+template <class T, umm capacity>
+T receive(Channel<T, capacity> &channel) {
+	sync::wait(channel.waiters, [&] { return try_consume(channel.readable); });
+	T value = {};
+	channel.buffer.pop(value);
+	return value;
+}
+
+template <class T, umm capacity>
+bool try_receive(Channel<T, capacity> &channel, T &value) {
+	if (!try_consume(channel.readable))
+		return false;
+	channel.buffer.pop(value);
+	return true;
+}
+
+}
@@ -0,0 +1,684 @@
+#include "ata.h"
+#include "port.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "memory.h"
+#include "debug.h"
+#include "cpu.h"
+#include "pci.h"
+#include "disk_benchmark.h"
+
+namespace ata {
+
+Channel channels[channel_count] = {
+	{.io_base = 0x1f0, .control_base = 0x3f6, .irq = interrupt::irq_14, .irq_queue = {}},
+	{.io_base = 0x170, .control_base = 0x376, .irq = interrupt::irq_15, .irq_queue = {}},
+};
+
+Drive drives[drive_count];
+
+async::Channel<Request *, completion_capacity> completions;
+
+// Offsets from io_base
+inline static constexpr u16 register_data         = 0;
+inline static constexpr u16 register_error        = 1;
+inline static constexpr u16 register_sector_count = 2;
+inline static constexpr u16 register_lba_low      = 3;
+inline static constexpr u16 register_lba_mid      = 4;
+inline static constexpr u16 register_lba_high     = 5;
+inline static constexpr u16 register_drive        = 6;
+inline static constexpr u16 register_status       = 7; // Reading it acknowledges the interrupt
+inline static constexpr u16 register_command      = 7;
+// At control_base. Reading the alternate status does not acknowledge the interrupt.
+inline static constexpr u16 register_alternate_status = 0;
+inline static constexpr u16 register_device_control   = 0;
+
+inline static constexpr u8 status_error          = 1 << 0;
+inline static constexpr u8 status_data_request   = 1 << 3;
+inline static constexpr u8 status_device_fault   = 1 << 5;
+inline static constexpr u8 status_busy           = 1 << 7;
+
+// At bus_master_base
+inline static constexpr u16 bus_master_command   = 0;
+inline static constexpr u16 bus_master_status    = 2; // Error and interrupt bits are cleared by writing 1
+inline static constexpr u16 bus_master_prd_table = 4;
+
+inline static constexpr u8 bus_master_start     = 1 << 0;
+inline static constexpr u8 bus_master_to_memory = 1 << 3; // Set for disk reads
+
+inline static constexpr u8 bus_master_status_error     = 1 << 1;
+inline static constexpr u8 bus_master_status_interrupt = 1 << 2;
+
+// PCI programming interface of IDE controllers
+inline static constexpr u8 prog_if_native_primary   = 1 << 0;
+inline static constexpr u8 prog_if_native_secondary = 1 << 2;
+inline static constexpr u8 prog_if_bus_master       = 1 << 7;
+
+inline static constexpr u8 drive_lba = 0xe0; // LBA mode, plus the two obsolete bits that are always set
+
+inline static constexpr u8 command_read_sectors       = 0x20;
+inline static constexpr u8 command_read_sectors_ext   = 0x24;
+inline static constexpr u8 command_read_multiple      = 0xc4;
+inline static constexpr u8 command_read_multiple_ext  = 0x29;
+inline static constexpr u8 command_write_sectors      = 0x30;
+inline static constexpr u8 command_write_sectors_ext  = 0x34;
+inline static constexpr u8 command_write_multiple     = 0xc5;
+inline static constexpr u8 command_write_multiple_ext = 0x39;
+inline static constexpr u8 command_set_multiple_mode  = 0xc6;
+inline static constexpr u8 command_flush_cache        = 0xe7;
+inline static constexpr u8 command_flush_cache_ext    = 0xea;
+inline static constexpr u8 command_identify           = 0xec;
+inline static constexpr u8 command_read_dma           = 0xc8;
+inline static constexpr u8 command_read_dma_ext       = 0x25;
+inline static constexpr u8 command_write_dma          = 0xca;
+inline static constexpr u8 command_write_dma_ext      = 0x35;
+
+inline static constexpr u64 lba28_limit = 1 << 28;
+inline static constexpr u32 lba28_max_command_sectors = 256;
+inline static constexpr u32 lba48_max_command_sectors = 65536;
+
+// Polling with interrupts disabled, the tick does not advance, so give up after this many tries too.
+inline static constexpr u32 max_poll_count = 1 << 22;
+
+internal u8 alternate_status(Channel &channel) {
+	return port::read_u8(channel.control_base + register_alternate_status);
+}
+
+// The drive needs 400ns to put its status on the bus after being selected.
+internal void delay_400ns(Channel &channel) {
+	for (u32 i = 0; i < 4; ++i)
+		alternate_status(channel);
+}
+
+internal bool has_error(u8 status) {
+	return status & (status_error | status_device_fault);
+}
+
+internal bool timed_out(u32 start_tick) {
+	return timer::tick - start_tick >= timer::milliseconds_to_ticks(command_timeout_milliseconds);
+}
+
+// Polls the alternate status. Only used for the short waits that don't raise an interrupt.
+template <class Condition>
+internal bool poll(Channel &channel, Condition &&condition) {
+	u32 start_tick = timer::tick;
+	for (u32 i = 0; !condition(alternate_status(channel)); ++i) {
+		if (timed_out(start_tick) || i == max_poll_count)
+			return false;
+		cpu::pause();
+	}
+	return true;
+}
+
+internal bool wait_not_busy(Channel &channel) {
+	return poll(channel, [](u8 status) { return !(status & status_busy); });
+}
+
+internal bool wait_data_request(Channel &channel) {
+	return poll(channel, [](u8 status) {
+		return !(status & status_busy) && (status & (status_data_request | status_error | status_device_fault));
+	}) && !has_error(alternate_status(channel));
+}
+
+// Sleeps until the channel raises its irq. The status the handler read is in `channel.irq_status`.
+internal bool wait_irq(Channel &channel) {
+	u32 start_tick = timer::tick;
+	sync::wait(channel.irq_queue, [&] { return channel.irq_pending || timed_out(start_tick); });
+	if (!channel.irq_pending)
+		return false;
+	channel.irq_pending = false;
+	return !has_error(channel.irq_status);
+}
+
+internal void select(Drive &drive, u8 value) {
+	auto &channel = *drive.channel;
+	port::write_u8(channel.io_base + register_drive, value | (drive.slave << 4));
+	if (channel.selected_drive != drive.slave) {
+		channel.selected_drive = drive.slave;
+		delay_400ns(channel);
+	}
+}
+
+internal bool issue(Drive &drive, u8 command, u64 lba, u32 sector_count, bool lba48) {
+	auto &channel = *drive.channel;
+	auto io = channel.io_base;
+
+	if (lba48) {
+		select(drive, drive_lba);
+		if (!wait_not_busy(channel))
+			return false;
+		// Each register is a two byte fifo: high bytes go first
+		port::write_u8(io + register_sector_count, (u8)(sector_count >> 8));
+		port::write_u8(io + register_lba_low,      (u8)(lba >> 24));
+		port::write_u8(io + register_lba_mid,      (u8)(lba >> 32));
+		port::write_u8(io + register_lba_high,     (u8)(lba >> 40));
+	} else {
+		select(drive, drive_lba | (u8)((lba >> 24) & 0xf));
+		if (!wait_not_busy(channel))
+			return false;
+	}
+	port::write_u8(io + register_sector_count, (u8)sector_count);
+	port::write_u8(io + register_lba_low,      (u8)lba);
+	port::write_u8(io + register_lba_mid,      (u8)(lba >> 8));
+	port::write_u8(io + register_lba_high,     (u8)(lba >> 16));
+
+	channel.irq_pending = false;
+	port::write_u8(io + register_command, command);
+	return true;
+}
+
+internal bool needs_lba48(u64 lba, u32 sector_count) {
+	return sector_count > lba28_max_command_sectors || lba + sector_count > lba28_limit;
+}
+
+// Splits a transfer into commands and picks LBA28 or LBA48 for each.
+// `transfer(lba48, lba, sector_count)` issues one command and runs its data phase.
+template <class Transfer>
+internal bool for_each_command(Drive &drive, u64 lba, u32 sector_count, Transfer &&transfer) {
+	assert(drive.present);
+	bounds_check(lba + sector_count <= drive.sector_count);
+
+	while (sector_count) {
+		u32 count = min(sector_count, drive.lba48 ? lba48_max_command_sectors : lba28_max_command_sectors);
+
+		if (!transfer(needs_lba48(lba, count), lba, count))
+			return false;
+
+		lba += count;
+		sector_count -= count;
+	}
+	return true;
+}
+
+// Fills the channel's PRD table from the request's segments.
+internal bool build_prd_table(Channel &channel, Request &request) {
+	u32 entry_count = 0;
+	u32 byte_count = 0;
+	for (auto segment : request.segments) {
+		u32 address = (u32)segment.data;
+		u32 size = segment.size;
+		if ((address | size) & 1)
+			return false;
+		byte_count += size;
+		while (size) {
+			u32 region = min(size, 0x10000 - (address & 0xffff));
+			if (entry_count == prd_table_capacity)
+				return false;
+			channel.prd_table[entry_count++] = {.address = address, .byte_count = (u16)region, .flags = 0};
+			address += region;
+			size -= region;
+		}
+	}
+	if (!entry_count || byte_count != request.sector_count * sector_size)
+		return false;
+	channel.prd_table[entry_count - 1].flags = prd_end_of_table;
+	return true;
+}
+
+internal bool start_dma(Request &request) {
+	auto &drive = *request.drive;
+	auto &channel = *drive.channel;
+	u16 bus_master = channel.bus_master_base;
+
+	if (!build_prd_table(channel, request))
+		return false;
+
+	u8 direction = request.write ? 0 : bus_master_to_memory;
+	port::write_u8(bus_master + bus_master_command, direction);
+	port::write_u32(bus_master + bus_master_prd_table, (u32)channel.prd_table);
+	port::write_u8(bus_master + bus_master_status, bus_master_status_error | bus_master_status_interrupt);
+
+	bool lba48 = needs_lba48(request.lba, request.sector_count);
+	u8 command = request.write
+		? (lba48 ? command_write_dma_ext : command_write_dma)
+		: (lba48 ? command_read_dma_ext  : command_read_dma);
+	if (!issue(drive, command, request.lba, request.sector_count, lba48))
+		return false;
+
+	port::write_u8(bus_master + bus_master_command, direction | bus_master_start);
+	return true;
+}
+
+// Interrupts have to be disabled.
+internal void complete(Request &request, bool success) {
+	request.success = success;
+	request.complete_timestamp = cpu::read_timestamp();
+	bool pushed = async::push(completions, &request);
+	assert(pushed);
+}
+
+// Starts queued requests until one is in flight, if nothing else holds the channel.
+// Interrupts have to be disabled.
+internal void start_next(Channel &channel) {
+	while (!channel.active && !channel.pio_active && channel.queue_first) {
+		auto request = channel.queue_first;
+		channel.queue_first = request->next;
+		if (!channel.queue_first)
+			channel.queue_last = 0;
+
+		if (start_dma(*request)) {
+			channel.active = request;
+		} else {
+			complete(*request, false);
+		}
+	}
+}
+
+bool submit(Request &request) {
+	auto &drive = *request.drive;
+	if (!drive.dma)
+		return false;
+	bounds_check(request.lba + request.sector_count <= drive.sector_count);
+	assert(request.sector_count != 0);
+	assert(request.sector_count <= (drive.lba48 ? lba48_max_command_sectors : lba28_max_command_sectors));
+
+	auto &channel = *drive.channel;
+	request.next = 0;
+	request.submit_timestamp = cpu::read_timestamp();
+
+	cpu::InterruptGuard guard;
+	if (channel.queue_last)
+		channel.queue_last->next = &request;
+	else
+		channel.queue_first = &request;
+	channel.queue_last = &request;
+	start_next(channel);
+	return true;
+}
+
+internal void irq_handler(Registers &registers, void *context) {
+	(void)registers;
+	auto &channel = *(Channel *)context;
+
+	if (auto request = channel.active) {
+		u16 bus_master = channel.bus_master_base;
+		u8 dma_status = port::read_u8(bus_master + bus_master_status);
+		if (!(dma_status & bus_master_status_interrupt))
+			return;
+		port::write_u8(bus_master + bus_master_command, 0);
+		u8 status = port::read_u8(channel.io_base + register_status);
+		port::write_u8(bus_master + bus_master_status, bus_master_status_error | bus_master_status_interrupt);
+
+		channel.active = 0;
+		complete(*request, !(dma_status & bus_master_status_error) && !has_error(status));
+		start_next(channel);
+		// Somebody may be waiting to do PIO
+		sync::wake_all(channel.irq_queue);
+		return;
+	}
+
+	channel.irq_status = port::read_u8(channel.io_base + register_status);
+	channel.irq_pending = true;
+	sync::wake_all(channel.irq_queue);
+}
+
+// PIO commands and DMA transfers take turns on a channel.
+internal void begin_pio(Channel &channel) {
+	sync::wait(channel.irq_queue, [&] {
+		if (channel.active)
+			return false;
+		channel.pio_active = true;
+		return true;
+	});
+}
+
+internal void end_pio(Channel &channel) {
+	cpu::InterruptGuard guard;
+	channel.pio_active = false;
+	start_next(channel);
+}
+
+internal u32 block_sectors(Drive &drive) {
+	return drive.multiple_count ? drive.multiple_count : 1;
+}
+
+// Walks a scatter-gather list for PIO data phases.
+struct SegmentCursor {
+	Segment *segment;
+	Segment *end;
+	u32 offset;
+};
+
+internal void transfer(Channel &channel, SegmentCursor &cursor, u32 byte_count, bool write) {
+	while (byte_count) {
+		bounds_check(cursor.segment != cursor.end);
+		u8 *data = (u8 *)cursor.segment->data + cursor.offset;
+		u32 size = min(byte_count, cursor.segment->size - cursor.offset);
+		if (write)
+			port::write_u16s(channel.io_base + register_data, data, size / 2);
+		else
+			port::read_u16s(channel.io_base + register_data, data, size / 2);
+		byte_count -= size;
+		cursor.offset += size;
+		if (cursor.offset == cursor.segment->size) {
+			++cursor.segment;
+			cursor.offset = 0;
+		}
+	}
+}
+
+bool read(Drive &drive, u64 lba, u32 sector_count, Span<Segment> segments) {
+	SegmentCursor cursor = {segments.begin(), segments.end(), 0};
+	auto &channel = *drive.channel;
+	begin_pio(channel);
+	defer { end_pio(channel); };
+	return for_each_command(drive, lba, sector_count, [&](bool lba48, u64 command_lba, u32 count) {
+		u8 command = drive.multiple_count
+			? (lba48 ? command_read_multiple_ext : command_read_multiple)
+			: (lba48 ? command_read_sectors_ext  : command_read_sectors);
+		if (!issue(drive, command, command_lba, count, lba48))
+			return false;
+
+		// One interrupt per block, then the block is waiting in the data register
+		for (u32 done = 0; done < count;) {
+			if (!wait_irq(channel) || !(channel.irq_status & status_data_request))
+				return false;
+			u32 block = min(block_sectors(drive), count - done);
+			transfer(channel, cursor, block * sector_size, false);
+			done += block;
+		}
+		return true;
+	});
+}
+
+bool write(Drive &drive, u64 lba, u32 sector_count, Span<Segment> segments) {
+	SegmentCursor cursor = {segments.begin(), segments.end(), 0};
+	auto &channel = *drive.channel;
+	begin_pio(channel);
+	defer { end_pio(channel); };
+	return for_each_command(drive, lba, sector_count, [&](bool lba48, u64 command_lba, u32 count) {
+		u8 command = drive.multiple_count
+			? (lba48 ? command_write_multiple_ext : command_write_multiple)
+			: (lba48 ? command_write_sectors_ext  : command_write_sectors);
+		if (!issue(drive, command, command_lba, count, lba48))
+			return false;
+
+		// There's no interrupt before the first block, only after each one
+		if (!wait_data_request(channel))
+			return false;
+		for (u32 done = 0; done < count;) {
+			u32 block = min(block_sectors(drive), count - done);
+			transfer(channel, cursor, block * sector_size, true);
+			done += block;
+
+			if (!wait_irq(channel))
+				return false;
+			if (done < count && !(channel.irq_status & status_data_request))
+				return false;
+		}
+		return true;
+	});
+}
+
+bool read(Drive &drive, u64 lba, u32 sector_count, void *buffer) {
+	Segment segment = {.data = buffer, .size = sector_count * sector_size};
+	return read(drive, lba, sector_count, Span<Segment>{&segment, 1});
+}
+
+bool write(Drive &drive, u64 lba, u32 sector_count, void const *buffer) {
+	Segment segment = {.data = (void *)buffer, .size = sector_count * sector_size};
+	return write(drive, lba, sector_count, Span<Segment>{&segment, 1});
+}
+
+bool flush(Drive &drive) {
+	assert(drive.present);
+	auto &channel = *drive.channel;
+	begin_pio(channel);
+	defer { end_pio(channel); };
+	bool lba48 = drive.lba48;
+	if (!issue(drive, lba48 ? command_flush_cache_ext : command_flush_cache, 0, 0, lba48))
+		return false;
+	return wait_irq(channel);
+}
+
+block_cache::Device block_device(Drive &drive) {
+	block_cache::Device result = {};
+	result.read = [](void *context, u64 lba, u32 sector_count, Span<Segment> segments) {
+		return read(*(Drive *)context, lba, sector_count, segments);
+	};
+	result.write = [](void *context, u64 lba, u32 sector_count, Span<Segment> segments) {
+		return write(*(Drive *)context, lba, sector_count, segments);
+	};
+	result.context = &drive;
+	result.sector_count = drive.sector_count;
+	return result;
+}
+
+internal void identify(Drive &drive) {
+	auto &channel = *drive.channel;
+	auto io = channel.io_base;
+
+	select(drive, 0xa0);
+	port::write_u8(io + register_sector_count, 0);
+	port::write_u8(io + register_lba_low, 0);
+	port::write_u8(io + register_lba_mid, 0);
+	port::write_u8(io + register_lba_high, 0);
+	channel.irq_pending = false;
+	port::write_u8(io + register_command, command_identify);
+
+	u8 status = alternate_status(channel);
+	if (status == 0 || status == 0xff)
+		return;
+	if (!wait_not_busy(channel))
+		return;
+	// ATAPI and SATA devices abort IDENTIFY and leave their signature here
+	if (port::read_u8(io + register_lba_mid) || port::read_u8(io + register_lba_high))
+		return;
+	if (!wait_irq(channel) || !(channel.irq_status & status_data_request))
+		return;
+
+	u16 data[256];
+	port::read_u16s(io + register_data, data, 256);
+
+	bool lba = data[49] & (1 << 9);
+	if (!lba)
+		return; // CHS only drives are not worth it
+
+	drive.lba48 = data[83] & (1 << 10);
+	if (drive.lba48) {
+		drive.sector_count = data[100] | ((u64)data[101] << 16) | ((u64)data[102] << 32) | ((u64)data[103] << 48);
+	} else {
+		drive.sector_count = data[60] | ((u32)data[61] << 16);
+	}
+
+	// The model string is stored with the two bytes of each word swapped, padded with spaces
+	for (u32 i = 0; i < 20; ++i) {
+		drive.model[i*2]   = (ascii)(data[27 + i] >> 8);
+		drive.model[i*2+1] = (ascii)(data[27 + i]);
+	}
+	drive.model_length = 40;
+	while (drive.model_length && drive.model[drive.model_length - 1] == ' ')
+		--drive.model_length;
+
+	drive.present = true;
+	drive.dma = channel.bus_master_base && (data[49] & (1 << 8));
+
+	u16 max_multiple = data[47] & 0xff;
+	if (max_multiple) {
+		if (issue(drive, command_set_multiple_mode, 0, max_multiple, false) && wait_irq(channel))
+			drive.multiple_count = max_multiple;
+	}
+}
+
+// Only controllers in compatibility mode are supported: in native mode the channels have their ports
+// in BARs 0-3 and a PCI interrupt instead of the legacy ones.
+internal void init_dma() {
+	auto device = pci::find({.class_code = pci::class_mass_storage, .subclass = pci::subclass_ide});
+	if (!device)
+		return;
+	u8 prog_if = device->prog_if;
+	if (!(prog_if & prog_if_bus_master))
+		return;
+	u16 bus_master_base = pci::io_bar(*device, 4);
+	if (!bus_master_base)
+		return;
+
+	pci::enable(*device, true);
+
+	for (u32 i = 0; i < channel_count; ++i) {
+		if (prog_if & (i == 0 ? prog_if_native_primary : prog_if_native_secondary))
+			continue;
+		auto &channel = channels[i];
+		channel.bus_master_base = bus_master_base + i * 8;
+		// Aligned to its size, so it can't cross a 64 KB boundary
+		umm table_size = prd_table_capacity * sizeof(PrdEntry);
+		channel.prd_table = (PrdEntry *)memory::allocate(table_size, table_size);
+	}
+}
+
+void init() {
+	init_dma();
+
+	for (u32 i = 0; i < channel_count; ++i) {
+		auto &channel = channels[i];
+
+		// Nothing attached to the channel reads as a floating bus
+		if (port::read_u8(channel.io_base + register_status) == 0xff)
+			continue;
+
+		port::write_u8(channel.control_base + register_device_control, 0); // Enable interrupts
+		interrupt::set_handler(channel.irq, irq_handler, &channel);
+
+		for (u8 slave = 0; slave < 2; ++slave) {
+			auto &drive = drives[i * 2 + slave];
+			drive.channel = &channel;
+			drive.slave = slave;
+			identify(drive);
+		}
+	}
+}
+
+void print_drives() {
+	for (u32 i = 0; i < drive_count; ++i) {
+		auto &drive = drives[i];
+		if (!drive.present)
+			continue;
+		debug::print("ata: hd"s);
+		debug::print(i);
+		debug::print(": "s);
+		debug::print(Span<ascii>{drive.model, drive.model_length});
+		debug::print(", "s);
+		debug::print(drive.sector_count);
+		debug::print(" sectors, "s);
+		debug::print(drive.lba48 ? "LBA48"s : "LBA28"s);
+		debug::print(", sectors per block: "s);
+		debug::print(block_sectors(drive));
+		if (drive.dma)
+			debug::print(", DMA"s);
+		debug::print('\n');
+	}
+}
+
+// DMA requests in flight at once, for sequential reads and for random ones
+inline static constexpr u32 benchmark_sequential_depth = 4;
+inline static constexpr u32 benchmark_random_depth = 32;
+inline static constexpr u32 benchmark_chunk_size = disk_benchmark::sequential_sectors * sector_size;
+inline static constexpr u32 benchmark_segment_count = benchmark_chunk_size / disk_benchmark::segment_size;
+
+internal u8 *benchmark_buffer;
+internal Request benchmark_requests[benchmark_random_depth];
+internal Segment benchmark_segments[benchmark_random_depth][benchmark_segment_count];
+
+internal u64 next_benchmark_lba(Drive &drive, u64 lba, u32 count) {
+	lba += count;
+	return lba == drive.sector_count ? 0 : lba;
+}
+
+internal disk_benchmark::Result benchmark_pio(Drive &drive) {
+	return disk_benchmark::measure([&](disk_benchmark::Result &result, auto &&running) {
+		u64 lba = 0;
+		while (running()) {
+			u32 count = (u32)min<u64>(disk_benchmark::sequential_sectors, drive.sector_count - lba);
+			if (!read(drive, lba, count, benchmark_buffer)) {
+				result.failed = true;
+				result.failed_lba = lba;
+				return;
+			}
+			result.bytes += count * sector_size;
+			result.requests += 1;
+			lba = next_benchmark_lba(drive, lba, count);
+		}
+	});
+}
+
+// Keeps `depth` DMA requests queued, sequential ones of `sequential_sectors` or random pages.
+internal disk_benchmark::Result benchmark_dma(Drive &drive, u32 depth, bool random) {
+	return disk_benchmark::measure([&](disk_benchmark::Result &result, auto &&running) {
+		u64 lba = 0;
+		u32 random_state = 1;
+		u32 in_flight = 0;
+
+		auto submit_next = [&](u32 index) {
+			auto &request = benchmark_requests[index];
+			u32 count;
+			if (random) {
+				count = disk_benchmark::random_sectors;
+				lba = disk_benchmark::random_lba(random_state, drive.sector_count);
+			} else {
+				count = (u32)min<u64>(disk_benchmark::sequential_sectors, drive.sector_count - lba);
+			}
+			u8 *data = benchmark_buffer + index * (random ? disk_benchmark::segment_size : benchmark_chunk_size);
+			u32 remaining = count * sector_size;
+			u32 segment_count = 0;
+			while (remaining) {
+				u32 size = min(remaining, disk_benchmark::segment_size);
+				benchmark_segments[index][segment_count++] = {.data = data, .size = size};
+				data += size;
+				remaining -= size;
+			}
+			request = {};
+			request.drive = &drive;
+			request.lba = lba;
+			request.sector_count = count;
+			request.segments = {benchmark_segments[index], segment_count};
+			submit(request);
+			++in_flight;
+			if (!random)
+				lba = next_benchmark_lba(drive, lba, count);
+		};
+
+		for (u32 i = 0; i < depth; ++i)
+			submit_next(i);
+
+		while (in_flight) {
+			Request *request = async::receive(completions);
+			--in_flight;
+			if (!request->success) {
+				result.failed = true;
+				result.failed_lba = request->lba;
+			}
+			result.bytes += request->sector_count * sector_size;
+			result.requests += 1;
+			if (!result.failed && running())
+				submit_next((u32)(request - benchmark_requests));
+		}
+	});
+}
+
+internal void print_result(u32 drive_index, Span<ascii> test, disk_benchmark::Result const &result) {
+	debug::print("ata: hd"s);
+	debug::print(drive_index);
+	disk_benchmark::print(test, result);
+}
+
+void benchmark() {
+	// Big enough for either test: the random one uses a page per request
+	static_assert(benchmark_sequential_depth * benchmark_chunk_size >= benchmark_random_depth * disk_benchmark::segment_size);
+	if (!benchmark_buffer)
+		benchmark_buffer = (u8 *)memory::allocate(benchmark_sequential_depth * benchmark_chunk_size, disk_benchmark::segment_size);
+
+	for (u32 i = 0; i < drive_count; ++i) {
+		auto &drive = drives[i];
+		if (!drive.present)
+			continue;
+
+		print_result(i, "PIO sequential read"s, benchmark_pio(drive));
+		if (drive.dma) {
+			print_result(i, "DMA sequential read"s, benchmark_dma(drive, benchmark_sequential_depth, false));
+			if (drive.sector_count >= disk_benchmark::random_sectors)
+				print_result(i, "DMA random 4 KB read"s, benchmark_dma(drive, benchmark_random_depth, true));
+		}
+	}
+}
+
+}
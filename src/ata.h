@@ -0,0 +1,125 @@
+#pragma once
+#include "common.h"
+#include "sync.h"
+#include "async.h"
+#include "memory.h"
+#include "block_cache.h"
+
+// ATA (IDE) disks on the two legacy channels.
+//
+// PIO: data is moved with `rep insw` / `rep outsw`, a block of sectors at a time with READ/WRITE MULTIPLE
+// where the drive supports it. Completion is signaled by irq 14 / 15; the caller sleeps until then.
+//
+// DMA: if the IDE controller is a PCI bus master, `submit` queues a request and returns right away.
+// The controller moves the data while the cpu is free, and the request comes out of `completions`.
+namespace ata {
+
+struct Request;
+
+// Physical Region Descriptor: one contiguous piece of a DMA transfer.
+// It can't cross a 64 KB boundary, and the table of them can't either.
+struct PrdEntry {
+	u32 address;
+	u16 byte_count; // 0 means 64 KB
+	u16 flags;
+};
+
+inline static constexpr u16 prd_end_of_table = 1 << 15;
+inline static constexpr u32 prd_table_capacity = 64;
+
+inline static constexpr u32 sector_size = 512;
+
+// How long a command may take before we give up on the drive.
+inline static constexpr u32 command_timeout_milliseconds = 5000;
+
+struct Channel {
+	u16 io_base;
+	u16 control_base;
+	u8 irq;
+	u8 selected_drive = 0xff;
+
+	// Set by the irq handler, together with the status it read to acknowledge the interrupt.
+	bool volatile irq_pending = false;
+	u8 volatile irq_status = 0;
+	sync::WaitQueue irq_queue;
+
+	// Zero if the controller can't do DMA
+	u16 bus_master_base = 0;
+	PrdEntry *prd_table = 0;
+	// The DMA transfer in flight and the ones waiting for it. A PIO command holds the channel too.
+	Request *volatile active = 0;
+	Request *queue_first = 0;
+	Request *queue_last = 0;
+	bool volatile pio_active = false;
+};
+
+inline static constexpr u32 channel_count = 2;
+extern Channel channels[channel_count];
+
+struct Drive {
+	Channel *channel;
+	u8 slave;
+	bool present;
+	bool lba48;
+	u64 sector_count;
+	// Sectors per data block of READ/WRITE MULTIPLE, 0 if the drive does not support them.
+	u16 multiple_count;
+	bool dma;
+	ascii model[40];
+	u8 model_length;
+};
+
+// Primary master, primary slave, secondary master, secondary slave.
+inline static constexpr u32 drive_count = 4;
+extern Drive drives[drive_count];
+
+// Needs the timer, as commands time out, and pci to find the DMA controller.
+void init();
+
+// Both return false if the drive reported an error or did not respond in time.
+bool read(Drive &drive, u64 lba, u32 sector_count, void *buffer);
+bool write(Drive &drive, u64 lba, u32 sector_count, void const *buffer);
+bool flush(Drive &drive);
+
+// Both the address and the size of every segment have to be even.
+using Segment = memory::Segment;
+
+// Scatter-gather versions, the segments have to add up to at least `sector_count` sectors.
+bool read(Drive &drive, u64 lba, u32 sector_count, Span<Segment> segments);
+bool write(Drive &drive, u64 lba, u32 sector_count, Span<Segment> segments);
+
+struct Request {
+	Drive *drive;
+	u64 lba;
+	u32 sector_count; // At most 256, or 65536 on LBA48 drives
+	bool write;
+	Span<Segment> segments; // Has to add up to `sector_count` sectors
+
+	// Set before the request goes to `completions`
+	bool success;
+	u64 submit_timestamp;
+	u64 complete_timestamp;
+
+	Request *next;
+};
+
+inline static constexpr u32 completion_capacity = 64;
+
+// Finished DMA requests. Filled from the irq handlers, so no more than `completion_capacity`
+// requests may be submitted and not yet received.
+extern async::Channel<Request *, completion_capacity> completions;
+
+// Queues a DMA transfer and returns immediately. Returns false if the drive can't do DMA.
+// The request must stay alive until it comes out of `completions`.
+bool submit(Request &request);
+
+// The drive as seen by the block cache. PIO only, so that a cache miss doesn't need the completion queue.
+block_cache::Device block_device(Drive &drive);
+
+void print_drives();
+
+// Sustained sequential read throughput and cpu usage of every present drive, with PIO and with DMA,
+// and random 4 KB read IOPS with DMA. Does not write anything.
+void benchmark();
+
+}
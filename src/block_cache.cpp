@@ -0,0 +1,293 @@
+#include "block_cache.h"
+#include "debug.h"
+
+namespace block_cache {
+
+Stats stats;
+
+internal Block *blocks;
+internal u32 block_count;
+
+internal Block **buckets;
+internal u32 bucket_shift;
+
+// Most recently used first. Blocks that hold nothing are at the end.
+internal Block *lru_first;
+internal Block *lru_last;
+
+internal u32 hash(Device *device, u64 number) {
+	u32 value = (u32)number ^ (u32)(number >> 32) ^ ((u32)device >> 4);
+	return (value * 0x9e3779b1u) >> bucket_shift;
+}
+
+internal Block *lookup(Device *device, u64 number) {
+	for (auto block = buckets[hash(device, number)]; block; block = block->hash_next) {
+		if (block->device == device && block->number == number)
+			return block;
+	}
+	return 0;
+}
+
+internal void hash_insert(Block *block) {
+	auto &bucket = buckets[hash(block->device, block->number)];
+	block->hash_next = bucket;
+	bucket = block;
+}
+
+internal void hash_remove(Block *block) {
+	auto cursor = &buckets[hash(block->device, block->number)];
+	while (*cursor != block)
+		cursor = &(*cursor)->hash_next;
+	*cursor = block->hash_next;
+}
+
+internal void lru_remove(Block *block) {
+	if (block->lru_previous)
+		block->lru_previous->lru_next = block->lru_next;
+	else
+		lru_first = block->lru_next;
+	if (block->lru_next)
+		block->lru_next->lru_previous = block->lru_previous;
+	else
+		lru_last = block->lru_previous;
+}
+
+internal void lru_push_front(Block *block) {
+	block->lru_previous = 0;
+	block->lru_next = lru_first;
+	if (lru_first)
+		lru_first->lru_previous = block;
+	else
+		lru_last = block;
+	lru_first = block;
+}
+
+internal void lru_push_back(Block *block) {
+	block->lru_next = 0;
+	block->lru_previous = lru_last;
+	if (lru_last)
+		lru_last->lru_next = block;
+	else
+		lru_first = block;
+	lru_last = block;
+}
+
+void init(u32 count) {
+	block_count = count;
+	blocks = memory::allocate<Block>(count);
+
+	u32 bucket_count = 1;
+	bucket_shift = 32;
+	while (bucket_count < count) {
+		bucket_count *= 2;
+		bucket_shift -= 1;
+	}
+	buckets = memory::allocate<Block *>(bucket_count);
+	set_memory(buckets, 0, bucket_count * sizeof(Block *));
+
+	for (u32 i = 0; i < count; ++i) {
+		auto &block = blocks[i];
+		block = {};
+		block.data = (u8 *)memory::allocate(block_size, block_size);
+		lru_push_back(&block);
+	}
+}
+
+internal bool is_dirty(Block *block) {
+	return block && (block->flags & block_dirty);
+}
+
+// Writes the run of consecutive dirty blocks that contains `block`.
+internal bool write_run(Block *block) {
+	auto device = block->device;
+
+	u64 first = block->number;
+	while (first > 0 && block->number - first + 1 < max_read_ahead_blocks && is_dirty(lookup(device, first - 1)))
+		--first;
+
+	Block *run[max_read_ahead_blocks];
+	memory::Segment segments[max_read_ahead_blocks];
+	u32 count = 0;
+	for (u64 number = first; count < max_read_ahead_blocks; ++number) {
+		auto next = lookup(device, number);
+		if (!is_dirty(next))
+			break;
+		run[count] = next;
+		segments[count] = {.data = next->data, .size = block_size};
+		++count;
+	}
+
+	if (!device->write(device->context, first * sectors_per_block, count * sectors_per_block, {segments, count})) {
+		stats.errors += 1;
+		return false;
+	}
+	for (u32 i = 0; i < count; ++i)
+		run[i]->flags &= ~block_dirty;
+	stats.writebacks += count;
+	return true;
+}
+
+// Takes the least recently used block that isn't pinned and empties it. Null if all are pinned.
+internal Block *evict() {
+	for (auto block = lru_last; block; block = block->lru_previous) {
+		if (block->pin_count)
+			continue;
+		if (!block->device)
+			return block;
+		if (is_dirty(block) && !write_run(block))
+			continue;
+
+		if (block->flags & block_read_ahead) {
+			stats.read_ahead_wasted += 1;
+			// The stream did not get this far, read less ahead next time
+			block->device->read_ahead_blocks /= 2;
+		}
+		stats.evictions += 1;
+		hash_remove(block);
+		block->device = 0;
+		block->flags = 0;
+		return block;
+	}
+	return 0;
+}
+
+// Grows the read-ahead window of a sequential stream and drops it on random access.
+internal void update_read_ahead(Device &device, u64 number) {
+	if (number == device.next_block) {
+		if (device.read_ahead_blocks)
+			device.read_ahead_blocks = min(device.read_ahead_blocks * 2, max_read_ahead_blocks);
+		else
+			device.read_ahead_blocks = min_read_ahead_blocks;
+	} else {
+		device.read_ahead_blocks = 0;
+	}
+}
+
+Block *get(Device &device, u64 number) {
+	u64 device_blocks = device.sector_count / sectors_per_block;
+	bounds_check(number < device_blocks);
+
+	defer {
+		device.next_block = number + 1;
+	};
+
+	if (auto block = lookup(&device, number)) {
+		stats.hits += 1;
+		if (block->flags & block_read_ahead) {
+			block->flags &= ~block_read_ahead;
+			stats.read_ahead_hits += 1;
+		}
+		block->pin_count += 1;
+		lru_remove(block);
+		lru_push_front(block);
+		return block;
+	}
+
+	stats.misses += 1;
+	update_read_ahead(device, number);
+
+	// The block itself, then the read-ahead window, up to the first block that is already cached
+	Block *run[max_read_ahead_blocks];
+	memory::Segment segments[max_read_ahead_blocks];
+	u32 run_length = min(device.read_ahead_blocks + 1, max_read_ahead_blocks);
+	u32 count = 0;
+	for (u64 next = number; count < run_length && next < device_blocks; ++next) {
+		if (next != number && lookup(&device, next))
+			break;
+		auto block = evict();
+		if (!block)
+			break;
+		block->device = &device;
+		block->number = next;
+		block->flags = next == number ? 0 : block_read_ahead;
+		block->pin_count = 1;
+		hash_insert(block);
+		lru_remove(block);
+		lru_push_front(block);
+		run[count] = block;
+		segments[count] = {.data = block->data, .size = block_size};
+		++count;
+	}
+	if (!count) {
+		stats.errors += 1;
+		return 0;
+	}
+
+	bool success = device.read(device.context, number * sectors_per_block, count * sectors_per_block, {segments, count});
+	for (u32 i = 1; i < count; ++i)
+		run[i]->pin_count = 0;
+
+	if (!success) {
+		stats.errors += 1;
+		for (u32 i = 0; i < count; ++i) {
+			auto block = run[i];
+			hash_remove(block);
+			block->device = 0;
+			block->flags = 0;
+			block->pin_count = 0;
+			lru_remove(block);
+			lru_push_back(block);
+		}
+		return 0;
+	}
+
+	stats.read_ahead_blocks += count - 1;
+	return run[0];
+}
+
+void release(Block *block) {
+	assert(block->pin_count != 0);
+	block->pin_count -= 1;
+}
+
+void mark_dirty(Block *block) {
+	assert(block->pin_count != 0);
+	block->flags |= block_dirty;
+}
+
+bool flush() {
+	for (u32 i = 0; i < block_count; ++i) {
+		auto &block = blocks[i];
+		if (is_dirty(&block) && !write_run(&block))
+			return false;
+	}
+	return true;
+}
+
+async::Task<> writeback_task() {
+	while (1) {
+		co_await async::sleep(writeback_interval_milliseconds);
+		flush();
+	}
+}
+
+void print_stats() {
+	u32 lookups = stats.hits + stats.misses;
+	debug::print("Block cache: "s);
+	debug::print(block_count);
+	debug::print(" blocks of "s);
+	debug::print(block_size);
+	debug::print(" bytes\n  hits: "s);
+	debug::print(stats.hits);
+	debug::print(", misses: "s);
+	debug::print(stats.misses);
+	debug::print(", hit ratio: "s);
+	debug::print(percent(stats.hits, lookups));
+	debug::print("%\n  read-ahead: "s);
+	debug::print(stats.read_ahead_blocks);
+	debug::print(" blocks, used: "s);
+	debug::print(stats.read_ahead_hits);
+	debug::print(" ("s);
+	debug::print(percent(stats.read_ahead_hits, stats.read_ahead_blocks));
+	debug::print("%), evicted unused: "s);
+	debug::print(stats.read_ahead_wasted);
+	debug::print("\n  evictions: "s);
+	debug::print(stats.evictions);
+	debug::print(", blocks written back: "s);
+	debug::print(stats.writebacks);
+	debug::print(", errors: "s);
+	debug::print(stats.errors);
+	debug::print('\n');
+}
+
+}
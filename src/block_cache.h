@@ -0,0 +1,82 @@
+#pragma once
+#include "common.h"
+#include "memory.h"
+#include "async.h"
+
+// Cache of disk blocks, keyed by (device, block number).
+//
+// Blocks are found through a hash index and evicted in LRU order. Writes stay in the cache until
+// they are flushed, by `flush`, by eviction, or by `writeback_task` every `writeback_interval_milliseconds`.
+// Sequential access is detected per device, and then misses read ahead a window of blocks
+// in one device request. The window doubles while the stream goes on.
+namespace block_cache {
+
+inline static constexpr u32 block_size = 4096;
+inline static constexpr u32 sector_size = 512;
+inline static constexpr u32 sectors_per_block = block_size / sector_size;
+
+inline static constexpr u32 min_read_ahead_blocks = 4;
+inline static constexpr u32 max_read_ahead_blocks = 32;
+inline static constexpr u32 writeback_interval_milliseconds = 5000;
+
+// Something that stores sectors. Requests are at most `max_read_ahead_blocks` blocks long.
+struct Device {
+	bool (*read)(void *context, u64 lba, u32 sector_count, Span<memory::Segment> segments);
+	bool (*write)(void *context, u64 lba, u32 sector_count, Span<memory::Segment> segments);
+	void *context;
+	u64 sector_count;
+
+	// Sequential access detection
+	u64 next_block = 0;
+	u32 read_ahead_blocks = 0;
+};
+
+inline static constexpr u8 block_dirty = 1 << 0;
+// Brought in by read-ahead and not used yet
+inline static constexpr u8 block_read_ahead = 1 << 1;
+
+struct Block {
+	Device *device;
+	u64 number;
+	u8 *data;
+	u8 flags;
+	u32 pin_count;
+
+	Block *hash_next;
+	Block *lru_previous;
+	Block *lru_next;
+};
+
+struct Stats {
+	u32 hits;
+	u32 misses;
+	u32 read_ahead_blocks;
+	u32 read_ahead_hits;   // Read-ahead blocks that were used later
+	u32 read_ahead_wasted; // Read-ahead blocks that were evicted without being used
+	u32 evictions;
+	u32 writebacks;
+	u32 errors;
+};
+
+extern Stats stats;
+
+// Allocates `block_count` blocks from the kernel allocator.
+void init(u32 block_count);
+
+// Returns the block pinned, with its data read from the device, or null if the read failed.
+// Every `get` needs a `release`.
+Block *get(Device &device, u64 number);
+void release(Block *block);
+
+// The block has to be pinned.
+void mark_dirty(Block *block);
+
+// Writes dirty blocks back. Runs of consecutive blocks go in one request.
+bool flush();
+
+// Flushes periodically.
+async::Task<> writeback_task();
+
+void print_stats();
+
+}
@@ -1,22 +1,76 @@
 [bits 16]
 org 0x7c00
-kernel_offset equ 0x1000 ; The same one we used when linking the kernel
-port_com1     equ 0x3f8
 
-boot_main_16:
-    mov [boot_disk], dl
+%include "handoff.inc"
+
+; The whole boot loader is `boot_sectors` sectors long. The first one is loaded by the BIOS
+; and loads the rest, so the interesting part doesn't have to fit in 510 bytes.
+boot_sectors      equ 4
+kernel_lba        equ boot_sectors ; The kernel comes right after us in os.bin
+bounce_segment    equ 0x1000 ; Real mode BIOS can't read above 1 MB, so sectors go here first
+bounce_address    equ bounce_segment * 16
+max_chunk_sectors equ 64 ; 32 KB, does not cross a 64 KB boundary of the bounce buffer
+port_com1         equ 0x3f8
+
+%ifdef COMPRESSED_KERNEL
+; The image is the decompression stub followed by the compressed kernel. It is loaded out of
+; the way of the kernel and the stub decompresses straight to kernel_address.
+load_address      equ 0x1000000
+%else
+load_address      equ kernel_address
+%endif
+
+%ifndef KERNEL_SECTORS
+%error "KERNEL_SECTORS has to be defined to the size of kernel.bin in sectors, see Makefile"
+%endif
 
-    mov ax, cs
+boot_main_16:
+    cli
+    xor ax, ax
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
+    mov sp, 0x7c00 ; grows down, away from the loader
+    sti
+    jmp 0:.cs_loaded ; some BIOSes jump to 0x07c0:0
+.cs_loaded:
+    mov [boot_disk], dl
+
+    mov di, handoff_address
+    mov cx, handoff_size
+    xor al, al
+    cld
+    rep stosb
+
+    rdtsc
+    mov [handoff_address + handoff.start_timestamp], eax
+    mov [handoff_address + handoff.start_timestamp + 4], edx
+
+    ; Sector 2 and onward of track 0 are ours
+    mov ax, 0x0200 + boot_sectors - 1 ; read sectors command, sector count
+    mov cx, 0x0002 ; cylinder 0, sector 2
+    xor dh, dh ; head 0
+    mov dl, [boot_disk]
+    mov bx, stage_2
+    int 0x13
+    jc .error
+    jmp stage_2
+.error:
+    mov ax, 0x0e00 + '!'
+    int 0x10
+.halt:
+    hlt
+    jmp .halt
 
-    mov bp, 0x8000 ; this is an address far away from 0x7c00 so that we don't get overwritten
-    mov sp, bp ; if the stack is empty then sp points to bp
+; In this sector, so reading stage 2 doesn't overwrite it
+boot_disk: db 0
 
+; Fill with 510 zeros minus the size of the previous code
+times 510-($-$$) db 0
+; Magic number
+dw 0xaa55
 
+stage_2:
     mov bx, message_disk_id
     call bios_print_string
     mov bl, [boot_disk]
@@ -39,53 +93,41 @@ boot_main_16:
         jmp .ext_check_end
 .ext_not_supported:
         mov byte [has_disk_extensions], 0
+        call read_geometry
         mov bx, message_no
 .ext_check_end:
     call bios_print_string
     mov bx, message_new_line
     call bios_print_string
 
-
-
+    call enable_a20
 
     mov bx, message_reading_disk
     call bios_print_string
 
+    rdtsc
+    mov [handoff_address + handoff.load_start_timestamp], eax
+    mov [handoff_address + handoff.load_start_timestamp + 4], edx
 
-    cmp byte [has_disk_extensions], 0
-    je .read_disk_no_ext
-
-
-.read_disk_with_ext:
-    push dword 0x0; upper 16-bits of 48-bit starting LBA
-    push dword 0x1; lower 32-bits of 48-bit starting LBA
-    push 0; segment
-    push kernel_offset; offset
-    push 127; number of sectors to transfer (max 127 on some BIOSes)
-    push 0x1000; always 0 + size of packet
-    mov si, 0
-    mov ds, si
-    mov si, sp
-    mov ah, 0x42
-    mov dl, [boot_disk]
-    int 0x13
-    jc .disk_error
-    jmp .disk_success
-
-.read_disk_no_ext:
-    mov ah, 0x02 ; read sectors command
-    mov al, 54 ; sector count
-    mov ch, 0 ; cylinder (0+)
-    mov cl, 2 ; sector (1+)
-    mov dh, 0 ; head (0+)
-    mov bx, 0
-    mov es, bx
-    mov bx, kernel_offset
-    mov dl, [boot_disk]
-    int 0x13
+    ; Stream the kernel in chunks: BIOS reads into the bounce buffer,
+    ; then an unreal mode copy moves the chunk to load_address and beyond.
+.next_chunk:
+    cmp dword [sectors_remaining], 0
+    je .disk_success
+    call read_chunk
     jc .disk_error
+    call enter_unreal_mode
+    call copy_chunk
+    movzx eax, word [chunk_sectors]
+    add [next_lba], eax
+    sub [sectors_remaining], eax
+    jmp .next_chunk
 
 .disk_success:
+        rdtsc
+        mov [handoff_address + handoff.load_end_timestamp], eax
+        mov [handoff_address + handoff.load_end_timestamp + 4], edx
+
         mov bx, message_done
         call bios_print_string
         jmp .disk_done
@@ -96,41 +138,137 @@ boot_main_16:
         call bios_print_hex_8
         mov bx, message_new_line
         call bios_print_string
+        jmp $
 .disk_done:
 
-    ; I experimented a bit and found out that 54 is the maximum number of sector i can read at once.
-    ; When reading more, kernel_main is just not called or a disk error occurs, and idk why.
-    ; Setting 'es' to 'kernel_offset >> 4' seem to have no effect.
-    ; Looks like the execution stops at 'int 0x13' and neither successful nor error path is executed
-    ;mov bx, kernel_offset; destination
-    ;mov dh, 54 ; read n sectors
-    ;mov cl, 2 ; start sector (starting from 1, 1 is boot)
-    ;mov dl, [boot_disk]
-    ;call bios_disk_load
-
-
-
-    ;mov word [disk_address_packet.destination_segment], 0x100
-    ;mov word [disk_address_packet.destination_offset], 0
-    ;mov word [disk_address_packet.start_block], 1
-    ;mov dl, [boot_disk]
-    ;mov si, disk_address_packet
-    ;mov bx, 0
-    ;mov ds, bx
-    ;mov cx, 54
-    ;mov ah, 0x42
-    ;int 0x13
-    ;jnc .disk_done
-    ;mov bx, disk_error_message
-    ;call bios_print_string
-    ;mov bl, ah ; ah = error code, dl = disk drive that dropped the error
-    ;call bios_print_hex_8 ; check out the code at http://stanislavs.org/helppc/int_13-1.html
-    ;jmp $
-;.disk_done:
+    mov dword [handoff_address + handoff.magic], 'BOOT'
+    mov al, [boot_disk]
+    mov [handoff_address + handoff.boot_disk], al
+    mov al, [has_disk_extensions]
+    mov [handoff_address + handoff.has_disk_extensions], al
+    mov dword [handoff_address + handoff.kernel_sectors], KERNEL_SECTORS
 
     call switch_to_protected_mode
     jmp $ ; this will actually never be executed
 
+; Only needed without disk extensions, to split reads at track boundaries.
+; Keeps the 1.44 MB floppy geometry if the BIOS can't tell.
+read_geometry:
+    push es
+    mov ah, 0x08
+    mov dl, [boot_disk]
+    xor di, di
+    mov es, di
+    int 0x13
+    pop es
+    jc .done
+    and cx, 0x3f
+    mov [sectors_per_track], cx
+    movzx dx, dh
+    inc dx
+    mov [head_count], dx
+.done:
+    ret
+
+enable_a20:
+    mov ax, 0x2401
+    int 0x15
+    ; Fast A20, in case the BIOS doesn't know how
+    in al, 0x92
+    or al, 2
+    and al, 0xfe ; bit 0 resets the machine
+    out 0x92, al
+    ret
+
+; Reads up to max_chunk_sectors sectors starting at [next_lba] into the bounce buffer.
+; Sets [chunk_sectors] to the number of sectors read. Carry is set on error, ah = error code.
+read_chunk:
+    mov eax, [sectors_remaining]
+    cmp eax, max_chunk_sectors
+    jbe .count_ok
+    mov eax, max_chunk_sectors
+.count_ok:
+    mov [chunk_sectors], ax
+
+    cmp byte [has_disk_extensions], 0
+    je .chs
+
+    mov [disk_address_packet.count], ax
+    mov eax, [next_lba]
+    mov [disk_address_packet.lba], eax
+    mov si, disk_address_packet
+    mov ah, 0x42
+    mov dl, [boot_disk]
+    int 0x13
+    ret
+
+.chs:
+    mov eax, [next_lba]
+    xor edx, edx
+    movzx ebx, word [sectors_per_track]
+    div ebx ; eax = track, edx = sector on the track (0+)
+    mov cx, dx
+    inc cx ; sector (1+)
+
+    ; A CHS read can't cross a track
+    mov bx, [sectors_per_track]
+    sub bx, dx
+    cmp bx, [chunk_sectors]
+    jae .fits_track
+    mov [chunk_sectors], bx
+.fits_track:
+
+    xor edx, edx
+    movzx ebx, word [head_count]
+    div ebx ; eax = cylinder, edx = head
+    mov dh, dl ; head
+    mov ch, al ; cylinder, bits 0-7
+    shl ah, 6
+    or cl, ah ; cylinder, bits 8-9
+
+    push es
+    mov bx, bounce_segment
+    mov es, bx
+    xor bx, bx
+    mov al, [chunk_sectors]
+    mov ah, 0x02 ; read sectors command
+    mov dl, [boot_disk]
+    int 0x13
+    pop es
+    ret
+
+; Loads ds and es with 4 GB limits and comes back to real mode. The limits stay,
+; so 32 bit addresses work in real mode. Done before every copy in case the BIOS reset them.
+enter_unreal_mode:
+    cli
+    push ds
+    push es
+    lgdt [gdt_descriptor]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp $ + 2
+    mov bx, data_segment
+    mov ds, bx
+    mov es, bx
+    and al, 0xfe
+    mov cr0, eax
+    pop es
+    pop ds
+    sti
+    ret
+
+; Copies [chunk_sectors] sectors from the bounce buffer to [load_cursor] and advances it.
+copy_chunk:
+    mov esi, bounce_address
+    mov edi, [load_cursor]
+    movzx ecx, word [chunk_sectors]
+    shl ecx, 7 ; 128 dwords per sector
+    cld
+    a32 rep movsd
+    mov [load_cursor], edi
+    ret
+
 ; bx - pointer to null terminated string
 bios_print_string:
     pusha
@@ -173,15 +311,6 @@ bios_print_hex_8:
     call bios_print_hex_4
     ret
 
-; bx - value to print
-bios_print_hex_16:
-    push bx
-    mov bl, bh
-    call bios_print_hex_8
-    pop bx
-    call bios_print_hex_8
-    ret
-
 gdt_start: ; don't remove the labels, they're needed to compute sizes and jumps
     ; the GDT starts with a null 8-byte
     dd 0x0 ; 4 byte
@@ -265,14 +394,36 @@ boot_main_32: ; we are now using 32-bit instructions
     mov ebp, 0x90000 ; 6. update the stack right at the top of the free space
     mov esp, ebp
 
+    rdtsc
+    mov [handoff_address + handoff.protected_mode_timestamp], eax
+    mov [handoff_address + handoff.protected_mode_timestamp + 4], edx
+
     mov ebx, message_entering_kernel
     call print_string
-    call kernel_offset
-    jmp $
+%ifdef COMPRESSED_KERNEL
+    jmp load_address
+%else
+    xor eax, eax ; we are not a multiboot loader
+    mov ecx, [kernel_address + multiboot_entry_offset]
+    jmp ecx
+%endif
 
 
-boot_disk: db 0
 has_disk_extensions: db 0
+sectors_per_track: dw 18
+head_count: dw 2
+chunk_sectors: dw 0
+next_lba: dd kernel_lba
+sectors_remaining: dd KERNEL_SECTORS
+load_cursor: dd load_address
+
+disk_address_packet:
+    db 0x10 ; size of packet
+    db 0
+.count:   dw 0
+.offset:  dw 0
+.segment: dw bounce_segment
+.lba:     dq 0
 
 message_disk_error: db "Disk error ", 0
 message_reading_disk: db "Reading disk. ", 0
@@ -284,7 +435,5 @@ message_yes: db "yes", 0
 message_no: db "no", 0
 message_new_line: db 0xa, 0xd, 0
 
-; Fill with 510 zeros minus the size of the previous code
-times 510-($-$$) db 0
-; Magic number
-dw 0xaa55
+; Pad to a whole number of sectors. Fails to assemble if stage 2 outgrows them.
+times boot_sectors * 512 - ($-$$) db 0
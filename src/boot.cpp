@@ -0,0 +1,190 @@
+#include "boot.h"
+#include "debug.h"
+#include "cpu.h"
+
+// Set by entry.asm
+extern "C" u32 boot_multiboot_magic;
+extern "C" u32 boot_multiboot_info;
+extern "C" u64 boot_entry_timestamp;
+extern "C" [[noreturn]] void boot_warm_entry();
+
+namespace boot {
+
+Handoff *handoff() {
+	if (boot_multiboot_magic == multiboot_loader_magic)
+		return 0;
+	auto result = at_address<Handoff>(handoff_address);
+	if (result->magic != handoff_magic)
+		return 0;
+	return result;
+}
+
+MultibootInfo *multiboot_info() {
+	if (boot_multiboot_magic != multiboot_loader_magic)
+		return 0;
+	return (MultibootInfo *)boot_multiboot_info;
+}
+
+u64 entry_timestamp() {
+	return boot_entry_timestamp;
+}
+
+PERSISTENT internal u32 warm_restarts;
+PERSISTENT internal u64 warm_restart_timestamp;
+
+u32 warm_restart_count() {
+	return warm_restarts;
+}
+
+void warm_restart() {
+	++warm_restarts;
+	warm_restart_timestamp = cpu::read_timestamp();
+	boot_warm_entry();
+}
+
+void print_info() {
+	if (warm_restarts) {
+		debug_print("Warm restart "s);
+		debug_print(warm_restarts);
+		debug_print(", request to kernel entry: "s);
+		debug_print(boot_entry_timestamp - warm_restart_timestamp);
+		debug_print(" cycles\n"s);
+		return;
+	}
+	if (auto info = handoff()) {
+		debug_print("Loaded by boot sector from disk "s);
+		debug_print(info->boot_disk);
+		debug_print(info->has_disk_extensions ? " using LBA, "s : " using CHS, "s);
+		debug_print(info->kernel_sectors);
+		debug_print(" sectors\nBoot sector to kernel entry: "s);
+		debug_print(boot_entry_timestamp - info->start_timestamp);
+		debug_print(" cycles, disk load: "s);
+		debug_print(info->load_end_timestamp - info->load_start_timestamp);
+		debug_print(" cycles\n"s);
+		if (info->uncompressed_size) {
+			debug_print("Compressed kernel: "s);
+			debug_print(info->kernel_sectors * 512);
+			debug_print(" -> "s);
+			debug_print(info->uncompressed_size);
+			debug_print(" bytes, decompression: "s);
+			debug_print(info->decompress_end_timestamp - info->decompress_start_timestamp);
+			debug_print(" cycles, load + decompression: "s);
+			debug_print(info->decompress_end_timestamp - info->load_start_timestamp);
+			debug_print(" cycles\n"s);
+		}
+	} else if (auto info = multiboot_info()) {
+		debug_print("Loaded by a multiboot loader"s);
+		if (info->flags & multiboot_info_memory) {
+			debug_print(", "s);
+			debug_print(info->memory_upper);
+			debug_print(" KB above 1 MB"s);
+		}
+		debug_print('\n');
+	} else {
+		debug_print("Loaded by an unknown loader\n"s);
+	}
+	// Everything before the kernel: firmware, the loader and the disk
+	debug_print("Cycles since reset at kernel entry: "s);
+	debug_print(boot_entry_timestamp);
+	debug_print('\n');
+}
+
+Timeline timeline;
+
+internal constexpr Array<Span<ascii>, Phase_count> phase_names = [] {
+	Array<Span<ascii>, Phase_count> result = {};
+	result.data[Phase_firmware]       = "firmware"s;
+	result.data[Phase_boot_sector]    = "boot_sector"s;
+	result.data[Phase_disk_load]      = "disk_load"s;
+	result.data[Phase_protected_mode] = "protected_mode"s;
+	result.data[Phase_decompression]  = "decompression"s;
+	result.data[Phase_kernel_entry]   = "kernel_entry"s;
+	result.data[Phase_interrupts]     = "interrupts"s;
+	result.data[Phase_acpi]           = "acpi"s;
+	result.data[Phase_timer]          = "timer"s;
+	result.data[Phase_keyboard]       = "keyboard"s;
+	result.data[Phase_pci]            = "pci"s;
+	result.data[Phase_ata]            = "ata"s;
+	result.data[Phase_virtio]         = "virtio"s;
+	result.data[Phase_network]        = "network"s;
+	result.data[Phase_kernel_main]    = "kernel_main"s;
+	return result;
+}();
+
+void init_timeline() {
+	if (warm_restarts) {
+		// The loader's timestamps are from the cold boot
+		timeline.start = warm_restart_timestamp;
+	} else if (auto info = handoff()) {
+		timeline.timestamps[Phase_firmware] = info->start_timestamp;
+		timeline.timestamps[Phase_boot_sector] = info->load_start_timestamp;
+		timeline.timestamps[Phase_disk_load] = info->load_end_timestamp;
+		timeline.timestamps[Phase_protected_mode] = info->protected_mode_timestamp;
+		if (info->uncompressed_size)
+			timeline.timestamps[Phase_decompression] = info->decompress_end_timestamp;
+	}
+	timeline.timestamps[Phase_kernel_entry] = boot_entry_timestamp;
+}
+
+void mark(Phase phase) {
+	timeline.timestamps[phase] = cpu::read_timestamp();
+}
+
+// Calls `fn(phase, cycles)` for every recorded phase.
+template <class Fn>
+internal void for_each_phase(Fn &&fn) {
+	u64 previous = timeline.start;
+	for (u32 i = 0; i < Phase_count; ++i) {
+		u64 timestamp = timeline.timestamps[i];
+		if (!timestamp)
+			continue;
+		fn((Phase)i, timestamp - previous);
+		previous = timestamp;
+	}
+}
+
+internal u64 last_timestamp() {
+	for (u32 i = Phase_count; i--;) {
+		if (timeline.timestamps[i])
+			return timeline.timestamps[i];
+	}
+	return timeline.start;
+}
+
+u64 timeline_total() {
+	return last_timestamp() - timeline.start;
+}
+
+void print_timeline() {
+	u64 total = timeline_total();
+
+	debug::print("Boot timeline, cycles:\n"s);
+	for_each_phase([&](Phase phase, u64 cycles) {
+		debug::print("  "s);
+		debug::print(phase_names[phase]);
+		debug::print(": "s);
+		debug::print(cycles);
+		if (total) {
+			debug::print(" ("s);
+			debug::print(percent(cycles, total));
+			debug::print("%)"s);
+		}
+		debug::print('\n');
+	});
+	debug::print("  total: "s);
+	debug::print(total);
+	debug::print('\n');
+
+	debug::print("boot-timeline"s);
+	for_each_phase([&](Phase phase, u64 cycles) {
+		debug::print(' ');
+		debug::print(phase_names[phase]);
+		debug::print('=');
+		debug::print(cycles);
+	});
+	debug::print(" total="s);
+	debug::print(total);
+	debug::print('\n');
+}
+
+}
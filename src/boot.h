@@ -0,0 +1,113 @@
+#pragma once
+#include "common.h"
+
+// Variables in this section keep their value over warm restarts. They are zero after a cold boot.
+#define PERSISTENT [[gnu::section(".persistent")]]
+
+namespace boot {
+
+// Left at a fixed address by our boot sector. Has to match `handoff` in handoff.inc.
+struct PACKED Handoff {
+	u32 magic;
+	u8 boot_disk;
+	u8 has_disk_extensions;
+	u16 reserved;
+	u32 kernel_sectors;
+	u64 start_timestamp;
+	u64 load_start_timestamp;
+	u64 load_end_timestamp;
+	u64 protected_mode_timestamp;
+	// Only set when the kernel was compressed, by lz4_stub.asm
+	u64 decompress_start_timestamp;
+	u64 decompress_end_timestamp;
+	u32 uncompressed_size;
+};
+
+inline static constexpr u32 handoff_address = 0x500;
+inline static constexpr u32 handoff_magic = 'B' | ('O' << 8) | ('O' << 16) | ('T' << 24);
+
+inline static constexpr u32 multiboot_loader_magic = 0x2badb002;
+
+struct PACKED MultibootInfo {
+	u32 flags;
+	u32 memory_lower; // KB below 1 MB
+	u32 memory_upper; // KB above 1 MB
+	u32 boot_device;
+	u32 command_line;
+	u32 module_count;
+	u32 modules;
+	u32 symbols[4];
+	u32 memory_map_length; // In bytes
+	u32 memory_map;        // Address of the first MultibootMemoryRange
+	// The rest is not used yet
+};
+
+inline static constexpr u32 multiboot_info_memory     = 1 << 0;
+inline static constexpr u32 multiboot_info_memory_map = 1 << 6;
+
+// Every range the firmware knows of, usable RAM or not
+struct PACKED MultibootMemoryRange {
+	u32 size; // Of the rest of the entry, which may be longer than this
+	u64 address;
+	u64 length;
+	u32 type;
+};
+
+// Null if we were not loaded by our boot sector
+Handoff *handoff();
+// Null if we were not loaded by a multiboot loader
+MultibootInfo *multiboot_info();
+
+// Timestamp counter value at the first instruction of the kernel
+u64 entry_timestamp();
+
+// How many times kernel_main was entered again without a reset, see power::warm_restart.
+u32 warm_restart_count();
+
+// Runs kernel_main again from the start, with .data as the loader left it and .bss cleared.
+// Interrupts have to be off and devices must not be doing DMA.
+[[noreturn]] void warm_restart();
+
+void print_info();
+
+// Points of the boot we take timestamps at, in order. A phase ends at its own point and starts
+// at the previous recorded one, or at reset for the first one.
+enum Phase : u8 {
+	Phase_firmware,       // BIOS, up to the first instruction of our boot sector
+	Phase_boot_sector,    // up to the start of the kernel load
+	Phase_disk_load,
+	Phase_protected_mode,
+	Phase_decompression,  // only with a compressed kernel
+	Phase_kernel_entry,
+	Phase_interrupts,     // with cpu feature detection, paging and user mode
+	Phase_acpi,
+	Phase_timer,
+	Phase_keyboard,
+	Phase_pci,
+	Phase_ata,
+	Phase_virtio,
+	Phase_network,
+	Phase_kernel_main,    // the rest of kernel_main, up to running tasks
+	Phase_count,
+};
+
+struct Timeline {
+	// Reset, or the warm restart request. Phases before kernel entry are not there after a warm restart.
+	u64 start;
+	u64 timestamps[Phase_count]; // Zero if the point was not reached
+};
+
+extern Timeline timeline;
+
+// Takes the timestamps the loader left. Has to be called before anything touches the handoff area.
+void init_timeline();
+
+void mark(Phase phase);
+
+// Cycles from the start of the timeline to the last point reached
+u64 timeline_total();
+
+// Phase breakdown, and a single 'boot-timeline name=cycles ...' line for scripts, see Makefile.
+void print_timeline();
+
+}
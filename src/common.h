@@ -47,9 +47,24 @@ inline constexpr u16 floor(u16 value, u16 step) { return value / step * step; }
 
 inline constexpr u16 ceil(u16 value, u16 step) { return (value + step - 1) / step * step; }
 
+template <class T>
+inline constexpr T min(T a, T b) { return a < b ? a : b; }
+
+template <class T>
+inline constexpr T max(T a, T b) { return a > b ? a : b; }
+
 template <class T>
 inline constexpr bool is_power_of_2(T v) { return (v != 0) && ((v & (v - 1)) == 0); }
 
+// A pointer to a fixed physical address. gcc 12 takes one in the first 4 KB for an offset from null and
+// rejects any access through it, so the address is hidden from it.
+template <class T>
+forceinline inline T *at_address(umm address) {
+	auto result = (T *)address;
+	asm("" : "+r" (result));
+	return result;
+}
+
 inline constexpr umm byte_count(ascii const *string) { auto start = string; while (*string++); return string - start; }
 inline constexpr umm char_count(ascii const *string) { auto start = string; while (*string++); return string - start; }
 inline constexpr umm unit_count(ascii const *string) { auto start = string; while (*string++); return string - start; }
@@ -78,13 +93,19 @@ inline constexpr void copy_memory_by_1_byte(void *destination, void const *sourc
 	}
 }
 
-inline constexpr void copy_memory(void *destination, void const *source, umm byte_count) { copy_memory_by_1_byte(destination, source, byte_count); }
 
 inline constexpr void set_memory_by_1_byte(void *destination, u8 value, umm byte_count) {
 	u8 *destination_cursor = (u8 *)destination;
 	while (byte_count--) *destination_cursor++ = value;
 }
 
+// Bound at boot to the best implementation for the cpu, see routines.h. The regions of a copy may overlap.
+extern void (*copy_memory_function)(void *destination, void const *source, umm byte_count);
+extern void (*set_memory_function)(void *destination, u8 value, umm byte_count);
+
+inline void copy_memory(void *destination, void const *source, umm byte_count) { copy_memory_function(destination, source, byte_count); }
+inline void set_memory(void *destination, u8 value, umm byte_count) { set_memory_function(destination, value, byte_count); }
+
 inline bool memory_equals(void const *source_a_, void const *source_b_, umm byte_count) {
 	auto source_a = (u8 *)source_a_;
 	auto source_b = (u8 *)source_b_;
@@ -168,6 +189,37 @@ inline Span<T> as_span(StaticList<T, capacity> &list) {
 }
 
 
+// Single producer / single consumer queue. On a single cpu the producer may be an irq handler
+// as long as the consumer doesn't touch `tail` and the producer doesn't touch `head`.
+template <class T, umm _capacity>
+struct RingBuffer {
+	inline static constexpr umm capacity = _capacity;
+	static_assert(is_power_of_2(capacity));
+
+	inline bool push(T const &value) {
+		if (full())
+			return false;
+		data[tail % capacity] = value;
+		tail = tail + 1;
+		return true;
+	}
+	inline bool pop(T &value) {
+		if (empty())
+			return false;
+		value = data[head % capacity];
+		head = head + 1;
+		return true;
+	}
+
+	inline umm count() const { return tail - head; }
+	inline bool empty() const { return head == tail; }
+	inline bool full() const { return tail - head == capacity; }
+
+	T data[capacity];
+	umm volatile head = 0;
+	umm volatile tail = 0;
+};
+
 template <class T, umm count_>
 struct Array {
 	inline static constexpr umm count = count_;
@@ -177,6 +229,10 @@ struct Array {
 		bounds_check(index < count);
 		return data[index];
 	}
+	forceinline T const &operator[](umm index) const {
+		bounds_check(index < count);
+		return data[index];
+	}
 };
 
 
@@ -231,6 +287,47 @@ inline umm append(StaticStringBuilder &builder, FormattedInt format) {
 	return append(builder, dest, (umm)(buffer + 64 - dest));
 }
 
+// The kernel is not linked with libgcc, so u64 division has to be done by hand.
+// Divides by a 32 bit value with two 64:32 `div`s, which can't overflow.
+inline u64 divide(u64 value, u32 divisor, u32 &remainder) {
+	u32 high = (u32)(value >> 32);
+	u32 low = (u32)value;
+	u32 quotient_high = high / divisor;
+	high %= divisor;
+	u32 quotient_low;
+	asm("divl %4" : "=a" (quotient_low), "=d" (remainder) : "a" (low), "d" (high), "rm" (divisor));
+	return ((u64)quotient_high << 32) | quotient_low;
+}
+
+inline u64 divide(u64 value, u32 divisor) {
+	u32 remainder;
+	return divide(value, divisor, remainder);
+}
+
+// `part * 100 / whole`. Both are scaled down until `whole` fits the 32 bit divisor.
+inline u32 percent(u64 part, u64 whole) {
+	if (!whole)
+		return 0;
+	while (whole > 0xffffffff) {
+		part >>= 1;
+		whole >>= 1;
+	}
+	return (u32)divide(part * 100, (u32)whole);
+}
+
+inline umm append(StaticStringBuilder &builder, u64 value) {
+	ascii buffer[32];
+	ascii *dest = buffer + 31;
+
+	do {
+		u32 digit;
+		value = divide(value, 10, digit);
+		*dest-- = integer_digits[digit];
+	} while (value);
+	++dest;
+	return append(builder, dest, (umm)(buffer + 32 - dest));
+}
+
 inline umm append(StaticStringBuilder &builder, u8  value) { return append(builder, format_int(value)); }
 inline umm append(StaticStringBuilder &builder, u16 value) { return append(builder, format_int(value)); }
 inline umm append(StaticStringBuilder &builder, u32 value) { return append(builder, format_int(value)); }
@@ -0,0 +1,86 @@
+#pragma once
+
+// We don't have a standard library, but the compiler looks up these names in namespace std
+// when it transforms a coroutine, so this is a minimal freestanding <coroutine>.
+namespace std {
+
+template <class Return, class... Args>
+struct coroutine_traits {
+	using promise_type = typename Return::promise_type;
+};
+
+template <class Promise = void>
+struct coroutine_handle;
+
+template <>
+struct coroutine_handle<void> {
+	constexpr coroutine_handle() noexcept = default;
+	constexpr coroutine_handle(decltype(nullptr)) noexcept {}
+
+	static constexpr coroutine_handle from_address(void *address) noexcept {
+		coroutine_handle result;
+		result.frame = address;
+		return result;
+	}
+
+	constexpr void *address() const noexcept { return frame; }
+	constexpr explicit operator bool() const noexcept { return frame != nullptr; }
+
+	bool done() const noexcept { return __builtin_coro_done(frame); }
+	void operator()() const { resume(); }
+	void resume() const { __builtin_coro_resume(frame); }
+	void destroy() const { __builtin_coro_destroy(frame); }
+
+protected:
+	void *frame = nullptr;
+};
+
+template <class Promise>
+struct coroutine_handle : coroutine_handle<> {
+	constexpr coroutine_handle() noexcept = default;
+	constexpr coroutine_handle(decltype(nullptr)) noexcept {}
+
+	static coroutine_handle from_promise(Promise &promise) noexcept {
+		coroutine_handle result;
+		result.frame = __builtin_coro_promise((char *)&promise, __alignof(Promise), true);
+		return result;
+	}
+
+	static constexpr coroutine_handle from_address(void *address) noexcept {
+		coroutine_handle result;
+		result.frame = address;
+		return result;
+	}
+
+	Promise &promise() const {
+		return *(Promise *)__builtin_coro_promise(frame, __alignof(Promise), false);
+	}
+};
+
+// A coroutine frame starts with resume and destroy function pointers,
+// so a frame that only has those two can be resumed without doing anything.
+struct noop_coroutine_frame {
+	static void noop(void *) {}
+	void (*resume)(void *) = noop;
+	void (*destroy)(void *) = noop;
+};
+
+inline noop_coroutine_frame noop_frame;
+
+inline coroutine_handle<> noop_coroutine() noexcept {
+	return coroutine_handle<>::from_address(&noop_frame);
+}
+
+struct suspend_always {
+	constexpr bool await_ready() const noexcept { return false; }
+	constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+	constexpr void await_resume() const noexcept {}
+};
+
+struct suspend_never {
+	constexpr bool await_ready() const noexcept { return true; }
+	constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+	constexpr void await_resume() const noexcept {}
+};
+
+}
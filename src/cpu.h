@@ -0,0 +1,162 @@
+#pragma once
+#include "common.h"
+
+namespace cpu {
+
+inline static constexpr u32 eflags_interrupt = 1 << 9;
+
+forceinline inline void pause() {
+	asm volatile("pause");
+}
+
+forceinline inline void halt() {
+	asm volatile("hlt" : : : "memory");
+}
+
+forceinline inline void enable_interrupts() {
+	asm volatile("sti" : : : "memory");
+}
+
+forceinline inline void disable_interrupts() {
+	asm volatile("cli" : : : "memory");
+}
+
+// `sti` delays interrupt delivery by one instruction, so an interrupt that
+// arrives between the two can't be missed: it will wake us up from `hlt`.
+forceinline inline void enable_interrupts_and_halt() {
+	asm volatile("sti\n\thlt" : : : "memory");
+}
+
+// The interrupt shadow of `sti` covers `mwait` the same way. Needs a `monitor` first, but any
+// interrupt ends the wait whether or not the monitored line was written.
+forceinline inline void enable_interrupts_and_mwait() {
+	asm volatile("sti\n\tmwait" : : "a" (0), "c" (0) : "memory");
+}
+
+forceinline inline void monitor(void const *address) {
+	asm volatile("monitor" : : "a" (address), "c" (0), "d" (0));
+}
+
+forceinline inline u32 get_flags() {
+	u32 flags;
+	asm volatile("pushf\n\tpop %0" : "=r" (flags));
+	return flags;
+}
+
+forceinline inline u32 save_flags_and_disable_interrupts() {
+	u32 flags;
+	asm volatile("pushf\n\tpop %0\n\tcli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+forceinline inline void restore_flags(u32 flags) {
+	asm volatile("push %0\n\tpopf" : : "r" (flags) : "memory", "cc");
+}
+
+forceinline inline bool interrupts_enabled() {
+	return get_flags() & eflags_interrupt;
+}
+
+forceinline inline u64 read_timestamp() {
+	u32 low, high;
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	return ((u64)high << 32) | low;
+}
+
+inline static constexpr u32 cr0_monitor_coprocessor = 1 << 1;
+inline static constexpr u32 cr0_emulation           = 1 << 2;
+inline static constexpr u32 cr0_task_switched       = 1 << 3;
+inline static constexpr u32 cr0_numeric_error       = 1 << 5;
+inline static constexpr u32 cr0_write_protect       = 1 << 16;
+inline static constexpr u32 cr0_paging              = 1u << 31;
+
+inline static constexpr u32 cr4_pse        = 1 << 4;
+inline static constexpr u32 cr4_pge        = 1 << 7;
+inline static constexpr u32 cr4_osfxsr     = 1 << 9;
+inline static constexpr u32 cr4_osxmmexcpt = 1 << 10;
+
+forceinline inline u32 read_cr0() {
+	u32 value;
+	asm volatile("mov %%cr0, %0" : "=r" (value));
+	return value;
+}
+
+forceinline inline void write_cr0(u32 value) {
+	asm volatile("mov %0, %%cr0" : : "r" (value) : "memory");
+}
+
+forceinline inline u32 read_cr4() {
+	u32 value;
+	asm volatile("mov %%cr4, %0" : "=r" (value));
+	return value;
+}
+
+forceinline inline void write_cr4(u32 value) {
+	asm volatile("mov %0, %%cr4" : : "r" (value) : "memory");
+}
+
+// The address of the last page fault
+forceinline inline u32 read_cr2() {
+	u32 value;
+	asm volatile("mov %%cr2, %0" : "=r" (value));
+	return value;
+}
+
+forceinline inline u32 read_cr3() {
+	u32 value;
+	asm volatile("mov %%cr3, %0" : "=r" (value));
+	return value;
+}
+
+// Flushes every TLB entry but the global ones.
+forceinline inline void write_cr3(u32 value) {
+	asm volatile("mov %0, %%cr3" : : "r" (value) : "memory");
+}
+
+forceinline inline void invalidate_page(void const *address) {
+	asm volatile("invlpg (%0)" : : "r" (address) : "memory");
+}
+
+// Clears cr0.TS, so the next x87 / SSE instruction doesn't raise #NM.
+forceinline inline void clear_task_switched() {
+	asm volatile("clts" : : : "memory");
+}
+
+forceinline inline u64 read_msr(u32 index) {
+	u32 low, high;
+	asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (index));
+	return ((u64)high << 32) | low;
+}
+
+forceinline inline void write_msr(u32 index, u64 value) {
+	asm volatile("wrmsr" : : "c" (index), "a" ((u32)value), "d" ((u32)(value >> 32)) : "memory");
+}
+
+// Waits for earlier stores, write combined ones included, to leave the cpu. A locked instruction does
+// what sfence does on every cpu, with or without SSE.
+forceinline inline void store_fence() {
+	asm volatile("lock orl $0, (%%esp)" : : : "memory", "cc");
+}
+
+struct CpuidResult {
+	u32 eax;
+	u32 ebx;
+	u32 ecx;
+	u32 edx;
+};
+
+forceinline inline CpuidResult cpuid(u32 leaf, u32 subleaf = 0) {
+	CpuidResult result;
+	asm volatile("cpuid" : "=a" (result.eax), "=b" (result.ebx), "=c" (result.ecx), "=d" (result.edx) : "a" (leaf), "c" (subleaf));
+	return result;
+}
+
+// Disables interrupts for the lifetime of the guard and restores previous state on exit.
+struct InterruptGuard {
+	forceinline InterruptGuard() : flags(save_flags_and_disable_interrupts()) {}
+	forceinline ~InterruptGuard() { restore_flags(flags); }
+	InterruptGuard(InterruptGuard const &) = delete;
+	u32 flags;
+};
+
+}
@@ -0,0 +1,122 @@
+#include "cpuid.h"
+#include "cpu.h"
+#include "debug.h"
+
+namespace cpuid {
+
+Info info;
+
+internal bool bit(u32 value, u32 index) {
+	return (value >> index) & 1;
+}
+
+struct Feature {
+	Span<ascii> name;
+	bool Info::*flag;
+};
+
+internal constexpr Feature features[] = {
+	{"fpu"s,           &Info::fpu},
+	{"tsc"s,           &Info::tsc},
+	{"invariant_tsc"s, &Info::invariant_tsc},
+	{"apic"s,          &Info::apic},
+	{"x2apic"s,        &Info::x2apic},
+	{"pse"s,           &Info::pse},
+	{"pae"s,           &Info::pae},
+	{"pat"s,           &Info::pat},
+	{"pge"s,           &Info::pge},
+	{"nx"s,            &Info::nx},
+	{"sysenter"s,      &Info::sysenter},
+	{"clflush"s,       &Info::clflush},
+	{"mmx"s,           &Info::mmx},
+	{"fxsr"s,          &Info::fxsr},
+	{"sse"s,           &Info::sse},
+	{"sse2"s,          &Info::sse2},
+	{"sse3"s,          &Info::sse3},
+	{"ssse3"s,         &Info::ssse3},
+	{"sse4_1"s,        &Info::sse4_1},
+	{"sse4_2"s,        &Info::sse4_2},
+	{"avx"s,           &Info::avx},
+	{"popcnt"s,        &Info::popcnt},
+	{"monitor"s,       &Info::monitor},
+	{"erms"s,          &Info::erms},
+};
+
+void init() {
+	auto leaf_0 = cpu::cpuid(0);
+	info.max_leaf = leaf_0.eax;
+	// The vendor string is in ebx, edx, ecx order
+	copy_memory(info.vendor + 0, &leaf_0.ebx, 4);
+	copy_memory(info.vendor + 4, &leaf_0.edx, 4);
+	copy_memory(info.vendor + 8, &leaf_0.ecx, 4);
+	info.vendor[12] = 0;
+
+	if (info.max_leaf >= 1) {
+		auto leaf_1 = cpu::cpuid(1);
+		u32 family = (leaf_1.eax >> 8) & 0xf;
+		u32 model = (leaf_1.eax >> 4) & 0xf;
+		info.family = family == 0xf ? family + ((leaf_1.eax >> 20) & 0xff) : family;
+		info.model = family == 0x6 || family == 0xf ? model | (((leaf_1.eax >> 16) & 0xf) << 4) : model;
+		info.stepping = leaf_1.eax & 0xf;
+
+		info.fpu      = bit(leaf_1.edx, 0);
+		info.pse      = bit(leaf_1.edx, 3);
+		info.tsc      = bit(leaf_1.edx, 4);
+		info.pae      = bit(leaf_1.edx, 6);
+		info.apic     = bit(leaf_1.edx, 9);
+		info.sysenter = bit(leaf_1.edx, 11);
+		info.pge      = bit(leaf_1.edx, 13);
+		info.pat      = bit(leaf_1.edx, 16);
+		info.clflush  = bit(leaf_1.edx, 19);
+		info.mmx      = bit(leaf_1.edx, 23);
+		info.fxsr     = bit(leaf_1.edx, 24);
+		info.sse      = bit(leaf_1.edx, 25);
+		info.sse2     = bit(leaf_1.edx, 26);
+
+		info.sse3     = bit(leaf_1.ecx, 0);
+		info.monitor  = bit(leaf_1.ecx, 3);
+		info.ssse3    = bit(leaf_1.ecx, 9);
+		info.sse4_1   = bit(leaf_1.ecx, 19);
+		info.sse4_2   = bit(leaf_1.ecx, 20);
+		info.x2apic   = bit(leaf_1.ecx, 21);
+		info.popcnt   = bit(leaf_1.ecx, 23);
+		info.avx      = bit(leaf_1.ecx, 28);
+
+		// The first Pentium Pros report sysenter without having it
+		if (info.family == 6 && info.model < 3 && info.stepping < 3)
+			info.sysenter = false;
+	}
+	if (info.max_leaf >= 7)
+		info.erms = bit(cpu::cpuid(7, 0).ebx, 9);
+
+	info.max_extended_leaf = cpu::cpuid(0x80000000).eax;
+	// Cpus without extended leaves return whatever the highest basic leaf has
+	if (info.max_extended_leaf < 0x80000000)
+		info.max_extended_leaf = 0;
+	if (info.max_extended_leaf >= 0x80000001)
+		info.nx = bit(cpu::cpuid(0x80000001).edx, 20);
+	if (info.max_extended_leaf >= 0x80000007)
+		info.invariant_tsc = bit(cpu::cpuid(0x80000007).edx, 8);
+}
+
+void print_info() {
+	debug::print("cpu: "s);
+	debug::print(Span<ascii>{info.vendor, 12});
+	debug::print(" family "s);
+	debug::print(format_int(info.family, 16));
+	debug::print(" model "s);
+	debug::print(format_int(info.model, 16));
+	debug::print(" stepping "s);
+	debug::print(info.stepping);
+	debug::print('\n');
+	debug::print("cpu features:"s);
+	for (auto &feature : features) {
+		if (info.*feature.flag) {
+			debug::print(' ');
+			debug::print(feature.name);
+		}
+	}
+	debug::print('\n');
+}
+
+}
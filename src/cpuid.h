@@ -0,0 +1,47 @@
+#pragma once
+#include "common.h"
+
+// What the cpu is and what it can do, read once at boot. Code that depends on a feature checks `info`
+// rather than running cpuid itself.
+namespace cpuid {
+
+struct Info {
+	ascii vendor[13]; // Null terminated, like "GenuineIntel"
+	u32 family;       // With the extended family and model folded in
+	u32 model;
+	u32 stepping;
+	u32 max_leaf;
+	u32 max_extended_leaf;
+
+	bool fpu;
+	bool tsc;
+	bool invariant_tsc; // Runs at the same rate in every power state
+	bool apic;
+	bool x2apic;
+	bool pse;           // 4 MB pages
+	bool pae;
+	bool pat;
+	bool pge;           // Global pages
+	bool nx;
+	bool sysenter;
+	bool clflush;
+	bool mmx;
+	bool fxsr;
+	bool sse;
+	bool sse2;
+	bool sse3;
+	bool ssse3;
+	bool sse4_1;
+	bool sse4_2;        // Has the crc32 instruction
+	bool avx;
+	bool popcnt;
+	bool monitor;       // monitor / mwait
+	bool erms;          // Fast `rep movsb` / `rep stosb`
+};
+
+extern Info info;
+
+void init();
+void print_info();
+
+}
@@ -0,0 +1,33 @@
+#include "disk_benchmark.h"
+#include "debug.h"
+
+namespace disk_benchmark {
+
+void print(Span<ascii> test, Result const &result) {
+	debug::print(' ');
+	debug::print(test);
+	if (result.failed) {
+		debug::print(" failed at sector "s);
+		debug::print(result.failed_lba);
+		debug::print('\n');
+		return;
+	}
+	u64 busy_cycles = result.cycles - result.idle_cycles;
+	u32 kilobytes_per_second = (u32)(divide(result.bytes * timer::frequency, result.ticks) / 1024);
+	debug::print(": "s);
+	debug::print(kilobytes_per_second / 1024);
+	debug::print('.');
+	u32 hundredths = (kilobytes_per_second % 1024) * 100 / 1024;
+	if (hundredths < 10)
+		debug::print('0');
+	debug::print(hundredths);
+	debug::print(" MB/s, "s);
+	debug::print(divide((u64)result.requests * timer::frequency, result.ticks));
+	debug::print(" IOPS, cpu busy "s);
+	debug::print(percent(busy_cycles, result.cycles));
+	debug::print("%, "s);
+	debug::print(divide(busy_cycles, max((u32)(result.bytes / 512), 1u)));
+	debug::print(" busy cycles per sector\n"s);
+}
+
+}
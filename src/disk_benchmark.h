@@ -0,0 +1,62 @@
+#pragma once
+#include "common.h"
+#include "timer.h"
+#include "cpu.h"
+#include "idle.h"
+
+// Measurement and reporting shared by the disk drivers' benchmarks, so their numbers can be compared.
+namespace disk_benchmark {
+
+inline static constexpr u32 duration_milliseconds = 1000;
+
+// Sequential reads are this long, split into `segment_size` pieces to go through scatter-gather.
+inline static constexpr u32 sequential_sectors = 128;
+inline static constexpr u32 segment_size = 4096;
+// Random reads are one page at a page aligned sector.
+inline static constexpr u32 random_sectors = segment_size / 512;
+
+struct Result {
+	u64 bytes;
+	u32 requests;
+	u64 cycles;
+	u64 idle_cycles;
+	u32 ticks;
+	bool failed;
+	u64 failed_lba;
+};
+
+// Runs `step(result, running)` and measures it. `running()` turns false after `duration_milliseconds`.
+template <class Step>
+Result measure(Step &&step) {
+	Result result = {};
+	u32 duration = timer::milliseconds_to_ticks(duration_milliseconds);
+	u32 start_tick = timer::tick;
+	u64 start_cycles = cpu::read_timestamp();
+	u64 start_idle = idle::idle_cycles();
+	step(result, [&] { return timer::tick - start_tick < duration; });
+	result.cycles = cpu::read_timestamp() - start_cycles;
+	result.idle_cycles = idle::idle_cycles() - start_idle;
+	result.ticks = timer::tick - start_tick;
+	return result;
+}
+
+// xorshift32, `state` must not be zero.
+inline u32 random(u32 &state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// A random page aligned lba for `random_sectors` sectors on a disk of `sector_count` sectors, which has
+// to hold at least one page.
+inline u64 random_lba(u32 &state, u64 sector_count) {
+	assert(sector_count >= random_sectors);
+	u32 page_count = (u32)min<u64>(sector_count / random_sectors, 0xffffffff);
+	return (u64)(random(state) % page_count) * random_sectors;
+}
+
+// Prints " <test>: MB/s, IOPS, cpu usage" and a new line, after whatever the caller printed to name the disk.
+void print(Span<ascii> test, Result const &result);
+
+}
@@ -0,0 +1,460 @@
+#include "e1000.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "cpu.h"
+#include "pci.h"
+#include "timer.h"
+
+namespace e1000 {
+
+Nic nics[max_nic_count];
+u32 nic_count;
+
+async::Channel<Packet, receive_capacity> received;
+
+inline static constexpr u16 vendor_id = 0x8086;
+// 82540EM is what qemu emulates, 82545EM is the same as far as we care
+inline static constexpr u16 device_ids[] = {0x100e, 0x100f};
+
+inline static constexpr u32 register_control            = 0x0000;
+inline static constexpr u32 register_status             = 0x0008;
+inline static constexpr u32 register_interrupt_cause    = 0x00c0; // Reading it clears it
+inline static constexpr u32 register_interrupt_throttle = 0x00c4; // In 256 ns units
+inline static constexpr u32 register_interrupt_mask_set = 0x00d0;
+inline static constexpr u32 register_interrupt_mask_clear = 0x00d8;
+inline static constexpr u32 register_rx_control         = 0x0100;
+inline static constexpr u32 register_tx_control         = 0x0400;
+inline static constexpr u32 register_tx_inter_packet_gap = 0x0410;
+inline static constexpr u32 register_rx_base_low        = 0x2800;
+inline static constexpr u32 register_rx_base_high       = 0x2804;
+inline static constexpr u32 register_rx_length          = 0x2808;
+inline static constexpr u32 register_rx_head           = 0x2810;
+inline static constexpr u32 register_rx_tail           = 0x2818;
+inline static constexpr u32 register_rx_delay           = 0x2820;
+inline static constexpr u32 register_tx_base_low        = 0x3800;
+inline static constexpr u32 register_tx_base_high       = 0x3804;
+inline static constexpr u32 register_tx_length          = 0x3808;
+inline static constexpr u32 register_tx_head            = 0x3810;
+inline static constexpr u32 register_tx_tail            = 0x3818;
+inline static constexpr u32 register_multicast_table    = 0x5200; // 128 registers
+inline static constexpr u32 register_receive_address_low  = 0x5400;
+inline static constexpr u32 register_receive_address_high = 0x5404;
+
+inline static constexpr u32 control_auto_speed  = 1 << 5;
+inline static constexpr u32 control_set_link_up = 1 << 6;
+inline static constexpr u32 control_reset       = 1 << 26;
+
+inline static constexpr u32 status_link_up = 1 << 1;
+
+inline static constexpr u32 interrupt_tx_written   = 1 << 0;
+inline static constexpr u32 interrupt_link_change  = 1 << 2;
+inline static constexpr u32 interrupt_rx_low       = 1 << 4; // Fewer than a quarter of the descriptors left
+inline static constexpr u32 interrupt_rx_overrun   = 1 << 6;
+inline static constexpr u32 interrupt_rx_timer     = 1 << 7;
+inline static constexpr u32 interrupt_rx = interrupt_rx_low | interrupt_rx_overrun | interrupt_rx_timer;
+
+inline static constexpr u32 rx_enable          = 1 << 1;
+inline static constexpr u32 rx_accept_broadcast = 1 << 15;
+inline static constexpr u32 rx_strip_checksum  = 1 << 26;
+// Buffer size bits left at zero: 2048 bytes
+static_assert(buffer_size == 2048);
+
+inline static constexpr u32 tx_enable     = 1 << 1;
+inline static constexpr u32 tx_pad_short  = 1 << 3;
+inline static constexpr u32 tx_collision_threshold = 0x10 << 4;
+inline static constexpr u32 tx_collision_distance  = 0x40 << 12; // Full duplex
+// The values the manual recommends for copper
+inline static constexpr u32 tx_inter_packet_gap = 10 | (8 << 10) | (6 << 20);
+
+inline static constexpr u8 rx_status_done          = 1 << 0;
+inline static constexpr u8 rx_status_end_of_packet = 1 << 1;
+
+inline static constexpr u8 tx_command_end_of_packet  = 1 << 0;
+inline static constexpr u8 tx_command_insert_checksum = 1 << 1;
+inline static constexpr u8 tx_command_report_status  = 1 << 3;
+inline static constexpr u8 tx_status_done = 1 << 0;
+
+inline static constexpr u32 throttle_interval = 1'000'000'000 / (max_interrupts_per_second * 256);
+
+// Reset takes microseconds, this is plenty
+inline static constexpr u32 max_reset_poll_count = 1 << 20;
+
+internal u32 read(Nic &nic, u32 offset) {
+	return *(u32 volatile *)(nic.registers + offset);
+}
+
+internal void write(Nic &nic, u32 offset, u32 value) {
+	*(u32 volatile *)(nic.registers + offset) = value;
+}
+
+internal u16 next_rx(u16 index) {
+	return (index + 1) % rx_ring_size;
+}
+
+internal u16 next_tx(u16 index) {
+	return (index + 1) % tx_ring_size;
+}
+
+internal bool tx_has_room(Nic &nic) {
+	return next_tx(nic.tx_tail) != nic.tx_clean;
+}
+
+// Interrupts have to be disabled.
+internal void give_back(Nic &nic, u8 *buffer) {
+	assert(nic.free_buffer_count < buffers_per_nic);
+	nic.free_buffers[nic.free_buffer_count++] = buffer;
+}
+
+// Hands free buffers to the card. It keeps one descriptor empty: head == tail means it has none.
+// Interrupts have to be disabled.
+internal void refill_rx(Nic &nic) {
+	u16 tail = nic.rx_tail;
+	while (next_rx(tail) != nic.rx_next && nic.free_buffer_count) {
+		u8 *buffer = nic.free_buffers[--nic.free_buffer_count];
+		auto &descriptor = nic.rx_ring[tail];
+		descriptor.address = (u32)buffer;
+		descriptor.status = 0;
+		nic.rx_buffers[tail] = buffer;
+		tail = next_rx(tail);
+	}
+	if (tail != nic.rx_tail) {
+		nic.rx_tail = tail;
+		// Descriptors have to be written before the card can see them
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		write(nic, register_rx_tail, tail);
+	}
+}
+
+// Hands up every frame the card has written. Interrupts have to be disabled.
+internal void receive(Nic &nic) {
+	while (nic.rx_next != nic.rx_tail) {
+		auto &descriptor = nic.rx_ring[nic.rx_next];
+		u8 status = __atomic_load_n(&descriptor.status, __ATOMIC_ACQUIRE);
+		if (!(status & rx_status_done))
+			break;
+
+		u8 *buffer = nic.rx_buffers[nic.rx_next];
+		nic.rx_next = next_rx(nic.rx_next);
+
+		// Frames are never split, buffers are as big as the largest frame without long packets enabled
+		Packet packet = {.nic = &nic, .data = buffer, .length = descriptor.length};
+		if (!(status & rx_status_end_of_packet) || descriptor.errors || !async::push(received, packet)) {
+			nic.stats.receive_dropped += 1;
+			give_back(nic, buffer);
+			continue;
+		}
+		nic.stats.received += 1;
+	}
+	refill_rx(nic);
+}
+
+// Takes back the buffers of frames the card has sent. Interrupts have to be disabled.
+internal void reclaim_tx(Nic &nic) {
+	while (nic.tx_clean != nic.tx_tail) {
+		auto &descriptor = nic.tx_ring[nic.tx_clean];
+		if (!(__atomic_load_n(&descriptor.status, __ATOMIC_ACQUIRE) & tx_status_done))
+			break;
+		give_back(nic, nic.tx_buffers[nic.tx_clean]);
+		nic.tx_clean = next_tx(nic.tx_clean);
+	}
+}
+
+internal void irq_handler(Registers &registers, void *context) {
+	(void)registers;
+	auto &nic = *(Nic *)context;
+
+	// Zero if the interrupt came from somebody else on a shared line
+	u32 cause = read(nic, register_interrupt_cause);
+	if (!cause)
+		return;
+	nic.stats.interrupts += 1;
+
+	if (cause & interrupt_rx)
+		receive(nic);
+	if (cause & interrupt_tx_written)
+		reclaim_tx(nic);
+	if (cause & interrupt_link_change)
+		nic.link_up = read(nic, register_status) & status_link_up;
+	sync::wake_all(nic.wait_queue);
+}
+
+u8 *allocate_buffer(Nic &nic) {
+	cpu::InterruptGuard guard;
+	if (!nic.free_buffer_count)
+		return 0;
+	return nic.free_buffers[--nic.free_buffer_count];
+}
+
+void release(Nic &nic, u8 *buffer) {
+	cpu::InterruptGuard guard;
+	give_back(nic, buffer);
+	// The card may have run dry waiting for this one
+	refill_rx(nic);
+}
+
+bool send(Nic &nic, u8 *buffer, u16 length) {
+	assert(length <= buffer_size);
+	cpu::InterruptGuard guard;
+	reclaim_tx(nic);
+
+	if (!tx_has_room(nic)) {
+		nic.stats.send_full += 1;
+		give_back(nic, buffer);
+		return false;
+	}
+
+	auto &descriptor = nic.tx_ring[nic.tx_tail];
+	descriptor.address = (u32)buffer;
+	descriptor.length = length;
+	descriptor.checksum_offset = 0;
+	descriptor.command = tx_command_end_of_packet | tx_command_insert_checksum | tx_command_report_status;
+	descriptor.status = 0;
+	descriptor.checksum_start = 0;
+	descriptor.special = 0;
+	nic.tx_buffers[nic.tx_tail] = buffer;
+	nic.tx_tail = next_tx(nic.tx_tail);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	write(nic, register_tx_tail, nic.tx_tail);
+	nic.stats.sent += 1;
+	return true;
+}
+
+template <class Descriptor>
+internal Descriptor *allocate_ring(u32 size) {
+	// The card wants 16 byte alignment; 128 keeps every ring in whole cache lines
+	auto ring = (Descriptor *)memory::allocate(size * sizeof(Descriptor), 128);
+	set_memory(ring, 0, size * sizeof(Descriptor));
+	return ring;
+}
+
+internal void init_nic(pci::Device &pci_device) {
+	auto &bar = pci_device.bars[0];
+	if (!bar.size || (bar.flags & pci::bar_io) || bar.address > 0xffffffff)
+		return;
+	// Legacy interrupts only, and the firmware has to have routed them
+	if (!pci_device.interrupt_pin || pci_device.interrupt_line >= interrupt::irq_count)
+		return;
+	if (nic_count == max_nic_count) {
+		debug::print("e1000: nic table is full\n"s);
+		return;
+	}
+
+	pci::enable(pci_device, true);
+
+	auto &nic = nics[nic_count];
+	nic.registers = (u8 volatile *)(umm)bar.address;
+	nic.irq = interrupt::irq_0 + pci_device.interrupt_line;
+
+	write(nic, register_interrupt_mask_clear, 0xffffffff);
+	write(nic, register_control, read(nic, register_control) | control_reset);
+	for (u32 i = 0; read(nic, register_control) & control_reset; ++i) {
+		if (i == max_reset_poll_count) {
+			debug::print("e1000: reset timed out\n"s);
+			return;
+		}
+		cpu::pause();
+	}
+	write(nic, register_interrupt_mask_clear, 0xffffffff);
+	read(nic, register_interrupt_cause);
+	write(nic, register_control, read(nic, register_control) | control_set_link_up | control_auto_speed);
+
+	// Loaded from the EEPROM by the reset
+	u32 address_low = read(nic, register_receive_address_low);
+	u32 address_high = read(nic, register_receive_address_high);
+	for (u32 i = 0; i < 4; ++i)
+		nic.mac[i] = (u8)(address_low >> (i * 8));
+	nic.mac[4] = (u8)address_high;
+	nic.mac[5] = (u8)(address_high >> 8);
+
+	for (u32 i = 0; i < 128; ++i)
+		write(nic, register_multicast_table + i * 4, 0);
+
+	auto buffers = (u8 *)memory::allocate(buffers_per_nic * buffer_size, buffer_size);
+	nic.free_buffers = memory::allocate<u8 *>(buffers_per_nic);
+	for (u32 i = 0; i < buffers_per_nic; ++i)
+		nic.free_buffers[i] = buffers + i * buffer_size;
+	nic.free_buffer_count = buffers_per_nic;
+
+	nic.rx_ring = allocate_ring<RxDescriptor>(rx_ring_size);
+	write(nic, register_rx_base_low, (u32)nic.rx_ring);
+	write(nic, register_rx_base_high, 0);
+	write(nic, register_rx_length, rx_ring_size * sizeof(RxDescriptor));
+	write(nic, register_rx_head, 0);
+	write(nic, register_rx_tail, 0);
+	// No delay on top of the throttling
+	write(nic, register_rx_delay, 0);
+	refill_rx(nic);
+
+	nic.tx_ring = allocate_ring<TxDescriptor>(tx_ring_size);
+	write(nic, register_tx_base_low, (u32)nic.tx_ring);
+	write(nic, register_tx_base_high, 0);
+	write(nic, register_tx_length, tx_ring_size * sizeof(TxDescriptor));
+	write(nic, register_tx_head, 0);
+	write(nic, register_tx_tail, 0);
+	write(nic, register_tx_inter_packet_gap, tx_inter_packet_gap);
+	write(nic, register_tx_control, tx_enable | tx_pad_short | tx_collision_threshold | tx_collision_distance);
+
+	write(nic, register_rx_control, rx_enable | rx_accept_broadcast | rx_strip_checksum);
+	write(nic, register_interrupt_throttle, throttle_interval);
+
+	nic.link_up = read(nic, register_status) & status_link_up;
+	++nic_count;
+
+	// PCI interrupt lines can be shared, hence add_handler
+	interrupt::add_handler(nic.irq, irq_handler, &nic);
+	write(nic, register_interrupt_mask_set, interrupt_rx | interrupt_tx_written | interrupt_link_change);
+}
+
+void init() {
+	for (auto device_id : device_ids) {
+		for (auto device = pci::find({.vendor_id = vendor_id, .device_id = device_id}); device;
+			 device = pci::find({.vendor_id = vendor_id, .device_id = device_id}, device))
+		{
+			init_nic(*device);
+		}
+	}
+}
+
+internal void print_mac(u8 const *mac) {
+	for (u32 i = 0; i < 6; ++i) {
+		if (i)
+			debug::print(':');
+		if (mac[i] < 0x10)
+			debug::print('0');
+		debug::print(format_int(mac[i], 16));
+	}
+}
+
+void print_nics() {
+	for (u32 i = 0; i < nic_count; ++i) {
+		auto &nic = nics[i];
+		debug::print("e1000: nic"s);
+		debug::print(i);
+		debug::print(": "s);
+		print_mac(nic.mac);
+		debug::print(", irq "s);
+		debug::print((u8)(nic.irq - interrupt::irq_0));
+		debug::print(nic.link_up ? ", link up\n"s : ", link down\n"s);
+	}
+}
+
+// `part / whole` with two decimals
+internal void print_ratio(u32 part, u32 whole) {
+	if (!whole) {
+		debug::print('-');
+		return;
+	}
+	u32 hundredths = (u32)divide((u64)part * 100, whole);
+	debug::print(hundredths / 100);
+	debug::print('.');
+	if (hundredths % 100 < 10)
+		debug::print('0');
+	debug::print(hundredths % 100);
+}
+
+async::Task<> receive_task() {
+	while (1)
+		release(co_await async::receive_async(received));
+}
+
+inline static constexpr u32 report_interval_milliseconds = 1000;
+
+async::Task<> report_task() {
+	Stats last[max_nic_count] = {};
+	while (1) {
+		co_await async::sleep(report_interval_milliseconds);
+		for (u32 i = 0; i < nic_count; ++i) {
+			auto &stats = nics[i].stats;
+			u32 count = stats.received - last[i].received;
+			if (count) {
+				u32 interrupts = stats.interrupts - last[i].interrupts;
+				debug::print("e1000: nic"s);
+				debug::print(i);
+				debug::print(" received "s);
+				debug::print(count);
+				debug::print(" packets/s, dropped "s);
+				debug::print(stats.receive_dropped - last[i].receive_dropped);
+				debug::print(", "s);
+				print_ratio(interrupts, count);
+				debug::print(" interrupts per packet\n"s);
+			}
+			last[i] = stats;
+		}
+	}
+}
+
+inline static constexpr u32 benchmark_milliseconds = 1000;
+// Smallest frame without the checksum
+inline static constexpr u16 benchmark_frame_size = 60;
+// Local experimental ethertype
+inline static constexpr u16 benchmark_ethertype = 0x88b5;
+
+internal void fill_frame(Nic &nic, u8 *frame, u32 sequence) {
+	set_memory_by_1_byte(frame, 0, benchmark_frame_size);
+	set_memory_by_1_byte(frame, 0xff, 6); // Broadcast
+	copy_memory_by_1_byte(frame + 6, nic.mac, 6);
+	frame[12] = (u8)(benchmark_ethertype >> 8);
+	frame[13] = (u8)benchmark_ethertype;
+	copy_memory_by_1_byte(frame + 14, &sequence, sizeof(sequence));
+}
+
+void benchmark() {
+	if (!nic_count) {
+		debug::print("e1000: no nic to benchmark\n"s);
+		return;
+	}
+	auto &sender = nics[0];
+
+	Stats before[max_nic_count];
+	for (u32 i = 0; i < nic_count; ++i)
+		before[i] = nics[i].stats;
+
+	u32 duration = timer::milliseconds_to_ticks(benchmark_milliseconds);
+	u32 start_tick = timer::tick;
+	auto running = [&] { return timer::tick - start_tick < duration; };
+
+	// The receive task does not run while we're in here, so we recycle what comes in ourselves
+	u32 sequence = 0;
+	while (running()) {
+		Packet packet = {};
+		while (async::try_receive(received, packet))
+			release(packet);
+
+		if (tx_has_room(sender)) {
+			if (auto frame = allocate_buffer(sender)) {
+				fill_frame(sender, frame, sequence);
+				send(sender, frame, benchmark_frame_size);
+				++sequence;
+				continue;
+			}
+		}
+		// Out of buffers or descriptors, the next interrupt brings some back
+		sync::wait(sender.wait_queue, [&] {
+			return !received.buffer.empty() || (sender.free_buffer_count && tx_has_room(sender)) || !running();
+		});
+	}
+	u32 ticks = timer::tick - start_tick;
+
+	for (u32 i = 0; i < nic_count; ++i) {
+		auto &stats = nics[i].stats;
+		u32 sent = stats.sent - before[i].sent;
+		u32 received_count = stats.received - before[i].received;
+		u32 interrupts = stats.interrupts - before[i].interrupts;
+		debug::print("e1000: nic"s);
+		debug::print(i);
+		debug::print(" sent "s);
+		debug::print(divide((u64)sent * timer::frequency, ticks));
+		debug::print(" packets/s (ring full "s);
+		debug::print(stats.send_full - before[i].send_full);
+		debug::print("), received "s);
+		debug::print(divide((u64)received_count * timer::frequency, ticks));
+		debug::print(" packets/s (dropped "s);
+		debug::print(stats.receive_dropped - before[i].receive_dropped);
+		debug::print("), "s);
+		print_ratio(interrupts, sent + received_count);
+		debug::print(" interrupts per packet\n"s);
+	}
+}
+
+}
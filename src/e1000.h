@@ -0,0 +1,119 @@
+#pragma once
+#include "common.h"
+#include "sync.h"
+#include "async.h"
+
+// Intel 8254x gigabit ethernet controllers (qemu's default `-device e1000`).
+//
+// Both descriptor rings and all packet buffers are allocated once at init. Buffers go around without
+// being copied: the card writes a frame into one, it comes out of `received` as a Packet pointing at
+// that buffer, and `release` gives it back. Sending is the same the other way: fill a buffer from
+// `allocate_buffer`, `send` it, and the driver takes it back after the card has read it.
+//
+// The interrupt throttling register lets the card raise at most `max_interrupts_per_second`;
+// everything that happened in between is handled by the next one.
+namespace e1000 {
+
+inline static constexpr u32 buffer_size = 2048;
+inline static constexpr u32 buffers_per_nic = 256;
+// Multiples of 8, as ring sizes are set in 128 byte units
+inline static constexpr u32 rx_ring_size = 128;
+inline static constexpr u32 tx_ring_size = 128;
+inline static constexpr u32 max_interrupts_per_second = 8000;
+
+struct RxDescriptor {
+	u64 address;
+	u16 length;
+	u16 checksum;
+	u8 status;
+	u8 errors;
+	u16 special;
+};
+
+struct TxDescriptor {
+	u64 address;
+	u16 length;
+	u8 checksum_offset;
+	u8 command;
+	u8 status;
+	u8 checksum_start;
+	u16 special;
+};
+
+struct Stats {
+	u32 interrupts;
+	u32 received;         // Handed up through `received`
+	u32 receive_dropped;  // Bad frames, or `received` was full
+	u32 sent;
+	u32 send_full;        // `send` found the ring full
+};
+
+struct Nic {
+	u8 volatile *registers;
+	u8 irq;
+	u8 mac[6];
+	bool volatile link_up;
+
+	RxDescriptor *rx_ring;
+	u8 *rx_buffers[rx_ring_size];
+	u16 rx_next; // The oldest descriptor the card has
+	u16 rx_tail; // One past the newest one. The card owns [rx_next, rx_tail).
+
+	TxDescriptor *tx_ring;
+	u8 *tx_buffers[tx_ring_size];
+	u16 tx_clean; // The oldest descriptor not taken back yet
+	u16 tx_tail;
+
+	// Buffers that are neither with the card nor handed out
+	u8 **free_buffers;
+	u32 free_buffer_count;
+
+	// Woken up by every interrupt
+	sync::WaitQueue wait_queue;
+
+	Stats stats;
+};
+
+inline static constexpr u32 max_nic_count = 4;
+extern Nic nics[max_nic_count];
+extern u32 nic_count;
+
+// Needs pci.
+void init();
+
+struct Packet {
+	Nic *nic;
+	u8 *data; // A whole ethernet frame, without the checksum
+	u16 length;
+};
+
+inline static constexpr u32 receive_capacity = 256;
+
+// Frames from every card. Filled from the irq handler; frames that don't fit are dropped.
+extern async::Channel<Packet, receive_capacity> received;
+
+// A buffer of `buffer_size` bytes to send from, or null if they are all in use.
+u8 *allocate_buffer(Nic &nic);
+
+// Gives a received or allocated buffer back to the driver.
+void release(Nic &nic, u8 *buffer);
+
+inline void release(Packet packet) {
+	release(*packet.nic, packet.data);
+}
+
+// Queues `length` bytes of `buffer` for transmission, the card adds the checksum.
+// The buffer belongs to the driver afterwards, even if the ring is full and this returns false.
+bool send(Nic &nic, u8 *buffer, u16 length);
+
+void print_nics();
+
+// Releases everything that is received, and once a second prints the receive rate of cards that got something.
+async::Task<> receive_task();
+async::Task<> report_task();
+
+// Sends minimum size broadcast frames from the first card for a second and reports packets per second
+// and interrupts per packet. With two cards on a loopback hub the second one receives them all.
+void benchmark();
+
+}
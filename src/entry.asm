@@ -0,0 +1,164 @@
+[bits 32]
+[extern kernel_main]
+[extern kernel_start]
+[extern kernel_load_end]
+[extern kernel_data_start]
+[extern kernel_bss_start]
+[extern kernel_bss_end]
+[extern kernel_persistent_start]
+[extern kernel_persistent_end]
+[extern kernel_data_copy]
+[extern kernel_end]
+
+; Multiboot (version 1) header. kernel.bin is a flat binary, so the address fields
+; tell the loader where to put it. Both GRUB and qemu's -kernel understand this.
+multiboot_magic       equ 0x1badb002
+multiboot_page_align  equ 1 << 0
+multiboot_memory_info equ 1 << 1
+multiboot_addresses   equ 1 << 16
+multiboot_flags       equ multiboot_page_align | multiboot_memory_info | multiboot_addresses
+
+; What a multiboot loader puts in eax
+multiboot_loader_magic equ 0x2badb002
+
+kernel_code_segment equ 0x08
+kernel_data_segment equ 0x10
+
+kernel_stack_size equ 16 * 1024
+
+section .multiboot align=4
+multiboot_header:
+	dd multiboot_magic
+	dd multiboot_flags
+	dd -(multiboot_magic + multiboot_flags)
+	dd multiboot_header ; header_addr
+	dd kernel_start     ; load_addr
+	dd kernel_load_end  ; load_end_addr
+	dd kernel_end       ; bss_end_addr
+	dd multiboot_entry  ; entry_addr. Our boot sector reads it from here too.
+
+section .text.entry
+global multiboot_entry
+; Entered in protected mode with paging off, either from our boot sector (eax = 0)
+; or from a multiboot loader (eax = multiboot_loader_magic, ebx = multiboot info).
+multiboot_entry:
+	cli
+	mov [boot_multiboot_magic], eax
+	mov [boot_multiboot_info], ebx
+	rdtsc
+	mov [boot_entry_timestamp], eax
+	mov [boot_entry_timestamp + 4], edx
+
+	; Memory that survives warm restarts is garbage after a reset
+	cld
+	xor eax, eax
+	mov edi, kernel_persistent_start
+	mov ecx, kernel_persistent_end
+	sub ecx, edi
+	shr ecx, 2
+	rep stosd
+
+	; Keep .data for warm restarts. The multiboot values and the entry timestamp stored above are
+	; copied along on purpose, so every warm restart sees the multiboot values of the cold boot.
+	; boot_warm_entry then stores its own entry timestamp over the copied one.
+	mov esi, kernel_data_start
+	mov edi, kernel_data_copy
+	mov ecx, kernel_load_end
+	sub ecx, esi
+	shr ecx, 2
+	rep movsd
+
+	jmp start_kernel
+
+global boot_warm_entry
+; Jumped to by power::warm_restart, with interrupts off and devices quiet. Puts .data back the way
+; the loader left it and runs kernel_main again, without going through the firmware or the disk.
+boot_warm_entry:
+	cli
+	rdtsc
+	mov ebx, eax
+	mov ebp, edx
+
+	; The page directory is in .bss, which is about to be cleared. Everything is identity mapped, so
+	; the next instruction runs at the same address either way.
+	mov eax, cr0
+	and eax, 0x7fffffff
+	mov cr0, eax
+
+	cld
+	mov esi, kernel_data_copy
+	mov edi, kernel_data_start
+	mov ecx, kernel_load_end
+	sub ecx, edi
+	shr ecx, 2
+	rep movsd
+
+	; The copy has the one from the cold boot
+	mov [boot_entry_timestamp], ebx
+	mov [boot_entry_timestamp + 4], ebp
+
+start_kernel:
+	; A multiboot loader leaves us with its own GDT, so load ours.
+	lgdt [gdt_descriptor]
+	jmp kernel_code_segment:.reload_segments
+.reload_segments:
+	mov ax, kernel_data_segment
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; kernel.bin does not contain .bss, and our boot sector does not clear it.
+	cld
+	xor eax, eax
+	mov edi, kernel_bss_start
+	mov ecx, kernel_bss_end
+	sub ecx, edi
+	shr ecx, 2
+	rep stosd
+
+	mov esp, kernel_stack_top
+	mov ebp, esp
+	call kernel_main
+.halt:
+	cli
+	hlt
+	jmp .halt
+
+section .data
+align 8
+global gdt
+gdt:
+	dq 0
+	; code segment: base 0, limit 4 GB, ring 0, readable
+	dw 0xffff, 0
+	db 0, 10011010b, 11001111b, 0
+	; data segment: base 0, limit 4 GB, ring 0, writable
+	dw 0xffff, 0
+	db 0, 10010010b, 11001111b, 0
+	; user code and data segments, the same but ring 3. sysenter / sysexit expect all four in this order.
+	dw 0xffff, 0
+	db 0, 11111010b, 11001111b, 0
+	dw 0xffff, 0
+	db 0, 11110010b, 11001111b, 0
+	; task state segment, filled in by user::init
+	dq 0
+gdt_end:
+
+gdt_descriptor:
+	dw gdt_end - gdt - 1
+	dd gdt
+
+global boot_multiboot_magic
+global boot_multiboot_info
+global boot_entry_timestamp
+boot_multiboot_magic: dd 0
+boot_multiboot_info: dd 0
+boot_entry_timestamp: dq 0
+
+section .bss
+align 16
+kernel_stack:
+	resb kernel_stack_size
+kernel_stack_top:
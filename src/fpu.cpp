@@ -0,0 +1,156 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "cpuid.h"
+#include "debug.h"
+#include "interrupt.h"
+
+namespace fpu {
+
+inline static constexpr u8 vector_device_not_available = 7;
+// Every exception masked, round to nearest
+inline static constexpr u32 default_mxcsr = 0x1f80;
+// A section in a task and one in the irq handler that interrupted it
+inline static constexpr u32 max_kernel_depth = 2;
+
+Stats stats;
+
+internal Context *current;
+// Whose registers are loaded, null if nobody's
+internal Context *owner;
+internal u32 kernel_depth;
+// The registers of the sections that nested ones interrupted
+internal Context kernel_saves[max_kernel_depth - 1];
+
+internal void save(Context &context) {
+	if (cpuid::info.fxsr)
+		asm volatile("fxsave %0" : "=m" (context.area));
+	else
+		asm volatile("fnsave %0" : "=m" (context.area));
+	++stats.saves;
+}
+
+internal void restore(Context &context) {
+	if (cpuid::info.fxsr)
+		asm volatile("fxrstor %0" : : "m" (context.area));
+	else
+		asm volatile("frstor %0" : : "m" (context.area));
+	++stats.restores;
+}
+
+internal void reset_registers() {
+	asm volatile("fninit");
+	if (cpuid::info.sse) {
+		u32 mxcsr = default_mxcsr;
+		asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+	}
+}
+
+internal void set_task_switched() {
+	cpu::write_cr0(cpu::read_cr0() | cpu::cr0_task_switched);
+}
+
+// Raised by the first x87 / SSE instruction after cr0.TS was set, only for code that has a context.
+internal void device_not_available(Registers &registers, void *context) {
+	(void)registers;
+	(void)context;
+
+	++stats.traps;
+	// Kernel code has to be between kernel_begin and kernel_end, which clear TS
+	assert(current && !kernel_depth);
+	cpu::clear_task_switched();
+	if (owner == current)
+		return;
+	if (owner)
+		save(*owner);
+	if (current->used) {
+		restore(*current);
+	} else {
+		reset_registers();
+		current->used = true;
+	}
+	owner = current;
+}
+
+void init() {
+	interrupt::set_handler(vector_device_not_available, device_not_available);
+	if (!cpuid::info.fpu)
+		return;
+
+	// No emulation, so x87 instructions run, and errors are reported through #MF rather than the pic
+	u32 cr0 = cpu::read_cr0();
+	cr0 = (cr0 & ~(cpu::cr0_emulation | cpu::cr0_task_switched)) | cpu::cr0_monitor_coprocessor | cpu::cr0_numeric_error;
+	cpu::write_cr0(cr0);
+
+	if (cpuid::info.fxsr) {
+		u32 cr4 = cpu::read_cr4() | cpu::cr4_osfxsr;
+		if (cpuid::info.sse)
+			cr4 |= cpu::cr4_osxmmexcpt;
+		cpu::write_cr4(cr4);
+	}
+
+	reset_registers();
+	set_task_switched();
+}
+
+void switch_to(Context *context) {
+	cpu::InterruptGuard guard;
+	current = context;
+	if (context && owner == context)
+		cpu::clear_task_switched();
+	else
+		set_task_switched();
+}
+
+void release(Context *context) {
+	cpu::InterruptGuard guard;
+	if (owner == context)
+		owner = 0;
+	context->used = false;
+}
+
+void kernel_begin() {
+	cpu::InterruptGuard guard;
+	assert(cpuid::info.fpu);
+	assert(kernel_depth < max_kernel_depth);
+
+	cpu::clear_task_switched();
+	if (kernel_depth) {
+		save(kernel_saves[kernel_depth - 1]);
+	} else if (owner) {
+		// It gets them back through #NM
+		save(*owner);
+		owner = 0;
+	}
+	++kernel_depth;
+	++stats.kernel_sections;
+	reset_registers();
+}
+
+void kernel_end() {
+	cpu::InterruptGuard guard;
+	assert(kernel_depth);
+
+	--kernel_depth;
+	if (kernel_depth)
+		restore(kernel_saves[kernel_depth - 1]);
+	else
+		set_task_switched();
+}
+
+void print_info() {
+	if (!cpuid::info.fpu) {
+		debug::print("fpu: none\n"s);
+		return;
+	}
+	debug::print(cpuid::info.fxsr ? "fpu: fxsave, "s : "fpu: fnsave, "s);
+	debug::print(stats.traps);
+	debug::print(" #NM, "s);
+	debug::print(stats.saves);
+	debug::print(" saves, "s);
+	debug::print(stats.restores);
+	debug::print(" restores, "s);
+	debug::print(stats.kernel_sections);
+	debug::print(" kernel sections\n"s);
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "common.h"
+
+// x87 and SSE state, switched lazily.
+//
+// The registers belong to one Context at a time, or to nobody. Switching contexts only sets cr0.TS;
+// the registers are saved and loaded in the #NM handler when the new context actually uses them.
+// Interrupts don't touch the registers at all, unless a handler uses them itself.
+//
+// Tasks are coroutines on the kernel stack: nothing of them is in registers across a suspension, so they
+// don't get a context. Kernel code, tasks and irq handlers alike, puts its vector code between
+// `kernel_begin` and `kernel_end`, which must not span a co_await. Contexts are for code that keeps
+// FPU state while it isn't running, i.e. user mode.
+namespace fpu {
+
+// The fxsave layout, or the fnsave one on cpus without fxsr.
+struct alignas(16) Context {
+	u8 area[512];
+	bool used; // False until the owner first uses the registers, which then start out from `fninit`
+};
+
+// Turns on the x87 unit and, if there is one, SSE. Needs cpuid and interrupt.
+void init();
+
+// The context of the code that runs from now on, null for the kernel. Saves nothing yet.
+void switch_to(Context *context);
+
+// Forgets the registers of the context, also if they are still loaded, so its next use starts out from
+// `fninit` again.
+void release(Context *context);
+
+// Kernel code may use x87 / SSE registers between these. They start out cleared. Whoever had them
+// before gets them back afterwards, an irq handler may nest one section in another.
+void kernel_begin();
+void kernel_end();
+
+struct KernelGuard {
+	forceinline KernelGuard() { kernel_begin(); }
+	forceinline ~KernelGuard() { kernel_end(); }
+	KernelGuard(KernelGuard const &) = delete;
+};
+
+struct Stats {
+	u32 traps;       // #NM
+	u32 saves;
+	u32 restores;
+	u32 kernel_sections;
+};
+
+extern Stats stats;
+
+void print_info();
+
+}
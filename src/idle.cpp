@@ -0,0 +1,141 @@
+#include "idle.h"
+#include "cpu.h"
+#include "cpuid.h"
+#include "debug.h"
+
+namespace idle {
+
+// e^(-1 / seconds in the period) in 16.16, the weight the average keeps every second
+inline static constexpr u32 load_decay[LoadPeriod_count] = {64453, 65318, 65463};
+
+internal bool use_mwait;
+// What `monitor` watches. Nothing writes to it: every wake up is an interrupt.
+alignas(64) internal u8 monitor_line[64];
+
+internal u64 start_timestamp;
+internal u64 idle_total;
+// Zero while not halted
+internal u64 halt_start;
+internal u32 halt_count;
+
+internal Deferred *deferred_first;
+internal Deferred *deferred_last;
+internal u32 deferred_run_count;
+
+u32 load_average[LoadPeriod_count];
+u32 last_load;
+internal u64 last_sample_timestamp;
+internal u64 last_sample_idle;
+
+void queue(Deferred &deferred) {
+	cpu::InterruptGuard guard;
+	if (deferred.queued)
+		return;
+	deferred.queued = true;
+	deferred.next = 0;
+	if (deferred_last) {
+		deferred_last->next = &deferred;
+	} else {
+		deferred_first = &deferred;
+	}
+	deferred_last = &deferred;
+}
+
+// Everything queued so far; what gets queued while it runs waits for the next call.
+internal void run_deferred() {
+	auto deferred = deferred_first;
+	deferred_first = deferred_last = 0;
+
+	cpu::enable_interrupts();
+	while (deferred) {
+		auto next = deferred->next;
+		deferred->queued = false;
+		deferred->function(deferred->context);
+		++deferred_run_count;
+		deferred = next;
+	}
+	cpu::disable_interrupts();
+}
+
+void sleep() {
+	if (deferred_first) {
+		run_deferred();
+		return;
+	}
+
+	halt_start = cpu::read_timestamp();
+	if (use_mwait) {
+		cpu::monitor(monitor_line);
+		cpu::enable_interrupts_and_mwait();
+	} else {
+		cpu::enable_interrupts_and_halt();
+	}
+	cpu::disable_interrupts();
+	idle_total += cpu::read_timestamp() - halt_start;
+	halt_start = 0;
+	++halt_count;
+}
+
+void init() {
+	start_timestamp = cpu::read_timestamp();
+	last_sample_timestamp = start_timestamp;
+	last_sample_idle = idle_total;
+
+	use_mwait = cpuid::info.monitor;
+}
+
+u64 idle_cycles() {
+	cpu::InterruptGuard guard;
+	u64 result = idle_total;
+	if (halt_start)
+		result += cpu::read_timestamp() - halt_start;
+	return result;
+}
+
+void sample_load() {
+	u64 now = cpu::read_timestamp();
+	u64 idle = idle_total;
+	// Usually the timer interrupt itself ended a halt, and `sleep` hasn't counted it yet
+	if (halt_start)
+		idle += now - halt_start;
+
+	u64 elapsed = now - last_sample_timestamp;
+	u64 busy = elapsed - min(idle - last_sample_idle, elapsed);
+	last_sample_timestamp = now;
+	last_sample_idle = idle;
+	if (!elapsed)
+		return;
+
+	while (elapsed > 0xffffffff) {
+		busy >>= 1;
+		elapsed >>= 1;
+	}
+	last_load = (u32)divide(busy << 16, (u32)elapsed);
+	for (u32 i = 0; i < LoadPeriod_count; ++i)
+		load_average[i] = (u32)(((u64)load_average[i] * load_decay[i] + (u64)last_load * (load_one - load_decay[i])) >> 16);
+}
+
+void print_stats() {
+	u64 elapsed = cpu::read_timestamp() - start_timestamp;
+	u64 idle = idle_cycles();
+
+	debug::print(use_mwait ? "idle: mwait, busy "s : "idle: hlt, busy "s);
+	debug::print(percent(elapsed - min(idle, elapsed), elapsed));
+	debug::print("% of "s);
+	debug::print(elapsed);
+	debug::print(" cycles, "s);
+	debug::print(halt_count);
+	debug::print(" halts, "s);
+	debug::print(deferred_run_count);
+	debug::print(" deferred runs\nload: last second "s);
+	debug::print(percent(last_load, load_one));
+	debug::print("%, 1 min "s);
+	debug::print(percent(load_average[LoadPeriod_1_minute], load_one));
+	debug::print("%, 5 min "s);
+	debug::print(percent(load_average[LoadPeriod_5_minutes], load_one));
+	debug::print("%, 15 min "s);
+	debug::print(percent(load_average[LoadPeriod_15_minutes], load_one));
+	debug::print("%\n"s);
+}
+
+}
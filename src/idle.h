@@ -0,0 +1,56 @@
+#pragma once
+#include "common.h"
+
+// What the cpu does when there is nothing to do, and how much of the time that is.
+//
+// Waiting code (sync::wait, and through it the task executor) calls `sleep` once what it waits for
+// is not there. Work given to `queue` runs first; only when there is none left does the cpu halt,
+// with `sti; mwait` if cpuid reports monitor / mwait and `sti; hlt` otherwise.
+//
+// Every timestamp counter cycle is idle (halted, including the irq handler that ended the halt) or busy.
+// There is one cpu.
+namespace idle {
+
+struct Deferred {
+	void (*function)(void *context);
+	void *context;
+	Deferred *next;
+	bool volatile queued;
+};
+
+// Runs `deferred.function(deferred.context)` before the cpu goes idle next, with interrupts enabled.
+// Does nothing if it is queued already; it can queue itself again once it runs. Irq safe.
+void queue(Deferred &deferred);
+
+// Called with interrupts disabled, returns with them disabled. Runs the deferred work if there is any,
+// halts until the next interrupt otherwise. The caller has to check again what it's waiting for.
+void sleep();
+
+// Picks hlt or mwait. Needs cpuid; sleeping before this uses hlt.
+void init();
+
+// Idle cycles since boot, including a halt that is in progress.
+u64 idle_cycles();
+
+// The busy fraction of the cpu as 16.16 fixed point, so 65536 is always busy.
+inline static constexpr u32 load_one = 1 << 16;
+
+enum LoadPeriod : u8 {
+	LoadPeriod_1_minute,
+	LoadPeriod_5_minutes,
+	LoadPeriod_15_minutes,
+	LoadPeriod_count,
+};
+
+// Utilization sampled once a second and averaged exponentially, like Unix load averages.
+// Those count runnable tasks instead, which don't exist here.
+extern u32 load_average[LoadPeriod_count];
+// The last second only
+extern u32 last_load;
+
+// Called by the timer once a second, with interrupts disabled.
+void sample_load();
+
+void print_stats();
+
+}
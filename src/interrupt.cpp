@@ -1,6 +1,7 @@
 #include "interrupt.h"
 #include "port.h"
 #include "debug.h"
+#include "cpu.h"
 
 namespace idt {
 
@@ -31,11 +32,12 @@ struct PACKED Register {
 inline static constexpr u32 gate_count = 256;
 Gate gates[gate_count];
 
-void set_gate(u8 n, u32 handler) {
+// Gates that user mode may `int` to have privilege level 3
+void set_gate(u8 n, u32 handler, bool user = false) {
 	gates[n].low_offset = handler & 0xffff;
 	gates[n].sel = KERNEL_CS;
 	gates[n].always0 = 0;
-	gates[n].flags = 0x8E;
+	gates[n].flags = user ? 0xEE : 0x8E;
 	gates[n].high_offset = (handler >> 16) & 0xffff;
 }
 
@@ -54,60 +56,22 @@ void load() {
 
 namespace interrupt {
 
-Handler handlers[256];
-
-/* ISRs reserved for CPU exceptions */
-extern "C" void isr0();
-extern "C" void isr1();
-extern "C" void isr2();
-extern "C" void isr3();
-extern "C" void isr4();
-extern "C" void isr5();
-extern "C" void isr6();
-extern "C" void isr7();
-extern "C" void isr8();
-extern "C" void isr9();
-extern "C" void isr10();
-extern "C" void isr11();
-extern "C" void isr12();
-extern "C" void isr13();
-extern "C" void isr14();
-extern "C" void isr15();
-extern "C" void isr16();
-extern "C" void isr17();
-extern "C" void isr18();
-extern "C" void isr19();
-extern "C" void isr20();
-extern "C" void isr21();
-extern "C" void isr22();
-extern "C" void isr23();
-extern "C" void isr24();
-extern "C" void isr25();
-extern "C" void isr26();
-extern "C" void isr27();
-extern "C" void isr28();
-extern "C" void isr29();
-extern "C" void isr30();
-extern "C" void isr31();
-extern "C" void isr126();
-extern "C" void isr127();
-
-extern "C" void irq0();
-extern "C" void irq1();
-extern "C" void irq2();
-extern "C" void irq3();
-extern "C" void irq4();
-extern "C" void irq5();
-extern "C" void irq6();
-extern "C" void irq7();
-extern "C" void irq8();
-extern "C" void irq9();
-extern "C" void irq10();
-extern "C" void irq11();
-extern "C" void irq12();
-extern "C" void irq13();
-extern "C" void irq14();
-extern "C" void irq15();
+struct HandlerEntry {
+	Handler handler;
+	void *context;
+	HandlerEntry *next;
+};
+
+// The first handler of every vector is stored inline, so the common case of one handler per vector
+// costs no extra pointer chase. Handlers added on top of that come from `chained_entries`.
+internal HandlerEntry handlers[256];
+internal StaticList<HandlerEntry, 32> chained_entries;
+
+u32 spurious_irq_count;
+
+// Addresses of isr0..isr31 and irq0..irq15 stubs
+extern "C" u32 interrupt_stubs[48];
+extern "C" u8 syscall_interrupt_stub[];
 
 inline static constexpr u8 icw1_icw4       = 0x01; // ICW4 (not) needed
 inline static constexpr u8 icw1_single     = 0x02; // Single (cascade) mode
@@ -146,66 +110,95 @@ void remap_pic(int master_offset, int slave_offset) {
 	port::write_u8(port::pic_slave_data, a2);
 }
 
+// Bit set means the line is masked
+internal u16 irq_mask = 0xffff;
+
+internal void write_irq_mask() {
+	port::write_u8(port::pic_master_data, (u8)irq_mask);
+	port::write_u8(port::pic_slave_data, (u8)(irq_mask >> 8));
+}
+
+void mask_irq(u8 irq) {
+	cpu::InterruptGuard guard;
+	irq_mask |= 1 << irq;
+	write_irq_mask();
+}
+
+void unmask_irq(u8 irq) {
+	cpu::InterruptGuard guard;
+	irq_mask &= ~(1 << irq);
+	write_irq_mask();
+}
+
 void init() {
-	idt::set_gate(0, (u32)isr0);
-	idt::set_gate(1, (u32)isr1);
-	idt::set_gate(2, (u32)isr2);
-	idt::set_gate(3, (u32)isr3);
-	idt::set_gate(4, (u32)isr4);
-	idt::set_gate(5, (u32)isr5);
-	idt::set_gate(6, (u32)isr6);
-	idt::set_gate(7, (u32)isr7);
-	idt::set_gate(8, (u32)isr8);
-	idt::set_gate(9, (u32)isr9);
-	idt::set_gate(10, (u32)isr10);
-	idt::set_gate(11, (u32)isr11);
-	idt::set_gate(12, (u32)isr12);
-	idt::set_gate(13, (u32)isr13);
-	idt::set_gate(14, (u32)isr14);
-	idt::set_gate(15, (u32)isr15);
-	idt::set_gate(16, (u32)isr16);
-	idt::set_gate(17, (u32)isr17);
-	idt::set_gate(18, (u32)isr18);
-	idt::set_gate(19, (u32)isr19);
-	idt::set_gate(20, (u32)isr20);
-	idt::set_gate(21, (u32)isr21);
-	idt::set_gate(22, (u32)isr22);
-	idt::set_gate(23, (u32)isr23);
-	idt::set_gate(24, (u32)isr24);
-	idt::set_gate(25, (u32)isr25);
-	idt::set_gate(26, (u32)isr26);
-	idt::set_gate(27, (u32)isr27);
-	idt::set_gate(28, (u32)isr28);
-	idt::set_gate(29, (u32)isr29);
-	idt::set_gate(30, (u32)isr30);
-	idt::set_gate(31, (u32)isr31);
-
-    // Remap the PIC
-	remap_pic(32, 40);
-
-    // Install the IRQs
-    idt::set_gate(32, (u32)irq0);
-    idt::set_gate(33, (u32)irq1);
-    idt::set_gate(34, (u32)irq2);
-    idt::set_gate(35, (u32)irq3);
-    idt::set_gate(36, (u32)irq4);
-    idt::set_gate(37, (u32)irq5);
-    idt::set_gate(38, (u32)irq6);
-    idt::set_gate(39, (u32)irq7);
-    idt::set_gate(40, (u32)irq8);
-    idt::set_gate(41, (u32)irq9);
-    idt::set_gate(42, (u32)irq10);
-    idt::set_gate(43, (u32)irq11);
-    idt::set_gate(44, (u32)irq12);
-    idt::set_gate(45, (u32)irq13);
-    idt::set_gate(46, (u32)irq14);
-    idt::set_gate(47, (u32)irq15);
+	for (u32 i = 0; i < 48; ++i) {
+		idt::set_gate(i, interrupt_stubs[i]);
+	}
+	idt::set_gate(vector_syscall, (u32)syscall_interrupt_stub, true);
+
+	remap_pic(irq_0, irq_8);
+
+	// Lines without handlers stay masked, so they can't interrupt us for nothing.
+	irq_mask = 0xffff & ~(1 << irq_cascade);
+	write_irq_mask();
 
 	idt::load();
 }
 
-void set_handler(u8 n, Handler handler) {
-    handlers[n] = handler;
+internal bool is_irq(u8 n) {
+	return irq_0 <= n && n < irq_0 + irq_count;
+}
+
+void set_handler(u8 n, Handler handler, void *context) {
+	{
+		cpu::InterruptGuard guard;
+		handlers[n] = {handler, context, 0};
+	}
+	if (is_irq(n))
+		unmask_irq(n - irq_0);
+}
+
+void add_handler(u8 n, Handler handler, void *context) {
+	if (!handlers[n].handler) {
+		set_handler(n, handler, context);
+		return;
+	}
+
+	auto &entry = chained_entries.add({handler, context, 0});
+
+	cpu::InterruptGuard guard;
+	auto last = &handlers[n];
+	while (last->next)
+		last = last->next;
+	last->next = &entry;
+}
+
+internal bool dispatch(Registers &registers) {
+	auto entry = &handlers[registers.int_no];
+	if (!entry->handler)
+		return false;
+	do {
+		entry->handler(registers, entry->context);
+		entry = entry->next;
+	} while (entry);
+	return true;
+}
+
+// OCW3 to read the in-service register
+inline static constexpr u8 pic_read_isr = 0x0b;
+
+// Irq 7 and 15 are raised by the pics when a line drops before it is acknowledged.
+// Real ones are marked in the in-service register.
+internal bool is_spurious(u8 irq) {
+	if (irq == 7) {
+		port::write_u8(port::pic_master_command, pic_read_isr);
+		return !(port::read_u8(port::pic_master_command) & 0x80);
+	}
+	if (irq == 15) {
+		port::write_u8(port::pic_slave_command, pic_read_isr);
+		return !(port::read_u8(port::pic_slave_command) & 0x80);
+	}
+	return false;
 }
 
 /* To print the message which defines every exception */
@@ -231,7 +224,7 @@ constexpr Span<ascii> interrupt_messages[256] = {
 	"Coprocessor Fault"s,
 	"Alignment Check"s,
 	"Machine Check"s,
-	"Reserved"s,
+	"SIMD Floating Point"s,
 	"Reserved"s,
 	"Reserved"s,
 	"Reserved"s,
@@ -248,7 +241,11 @@ constexpr Span<ascii> interrupt_messages[256] = {
 };
 
 extern "C" void isr_handler(Registers &registers) {
-	(void)registers;
+	auto start = cpu::read_timestamp();
+	bool handled = dispatch(registers);
+	record_stats(registers, start, cpu::read_timestamp());
+	if (handled)
+		return;
 
 	debug_print("received interrupt: "s);
 	debug_print(registers.int_no);
@@ -270,15 +267,23 @@ extern "C" void isr_handler(Registers &registers) {
 }
 
 extern "C" void irq_handler(Registers &registers) {
-    /* Handle the interrupt in a more modular way */
-    if (handlers[registers.int_no] != 0) {
-        handlers[registers.int_no](registers);
-    }
-
-    /* After every interrupt we need to send an EOI to the PICs
-     * or they will not send another interrupt again */
-    if (registers.int_no >= 40)
-		port::write_u8(port::pic_slave_command, 0x20);
-	port::write_u8(port::pic_master_command, 0x20);
+	u8 irq = registers.int_no - irq_0;
+	if (is_spurious(irq)) {
+		spurious_irq_count = spurious_irq_count + 1;
+		// The master pic did see the cascade line though.
+		if (irq == 15)
+			port::write_u8(port::pic_master_command, port::pic_end_of_interrupt);
+		return;
+	}
+
+	auto start = cpu::read_timestamp();
+	dispatch(registers);
+	record_stats(registers, start, cpu::read_timestamp());
+
+	/* After every interrupt we need to send an EOI to the PICs
+	 * or they will not send another interrupt again */
+	if (registers.int_no >= irq_8)
+		port::write_u8(port::pic_slave_command, port::pic_end_of_interrupt);
+	port::write_u8(port::pic_master_command, port::pic_end_of_interrupt);
 }
 }
@@ -4,6 +4,7 @@
 /* Struct which aggregates many registers */
 struct Registers {
 	u32 ds; /* Data segment selector */
+	u32 entry_timestamp_low, entry_timestamp_high; /* Read by the stub right after pusha */
 	u32 edi, esi, ebp, useless_esp, ebx, edx, ecx, eax; /* Pushed by pusha. */
 	u32 int_no, err_code; /* Interrupt number and error code (if applicable) */
 	u32 eip, cs, eflags, esp, ss; /* Pushed by the processor automatically */
@@ -11,7 +12,8 @@ struct Registers {
 
 namespace interrupt {
 
-using Handler = void (*)(Registers &);
+// `context` is whatever was passed to set_handler / add_handler.
+using Handler = void (*)(Registers &registers, void *context);
 
 inline static constexpr u8 irq_0  = 32;
 inline static constexpr u8 irq_1  = 33;
@@ -30,8 +32,51 @@ inline static constexpr u8 irq_13 = 45;
 inline static constexpr u8 irq_14 = 46;
 inline static constexpr u8 irq_15 = 47;
 
+inline static constexpr u8 irq_count = 16;
+inline static constexpr u8 irq_cascade = 2;
+
+// The one vector user mode can raise, for system calls. Goes through isr_handler like the exceptions.
+inline static constexpr u8 vector_syscall = 0x80;
+
 void init();
 
-void set_handler(u8 n, Handler handler);
+// Replaces all handlers of the vector. Unmasks the irq line if the vector is an irq.
+void set_handler(u8 n, Handler handler, void *context = 0);
+
+// Chains another handler to the vector, for irq lines shared by several devices.
+// All handlers of a vector are called in the order they were added.
+void add_handler(u8 n, Handler handler, void *context = 0);
+
+void mask_irq(u8 irq);
+void unmask_irq(u8 irq);
+
+// Interrupts on irq 7 and 15 that the pic did not actually raise.
+extern u32 spurious_irq_count;
+
+// Per vector statistics, kept for every vector that has a stub.
+// Latency is measured from stub entry to the start of the handler, duration is the time spent in handlers.
+// Both are in timestamp counter cycles, in log2 buckets: bucket `i` holds values in [2^i, 2^(i+1)).
+inline static constexpr u32 stats_vector_count = 48;
+inline static constexpr u32 stats_bucket_count = 32;
+// Statistics are kept per cpu, but there's only the boot cpu for now.
+inline static constexpr u32 stats_cpu_count = 1;
+
+struct Histogram {
+	u32 buckets[stats_bucket_count];
+	u32 max;
+};
+
+struct VectorStats {
+	u32 count;
+	Histogram latency;
+	Histogram duration;
+};
+
+extern VectorStats stats[stats_cpu_count][stats_vector_count];
+
+void record_stats(Registers &registers, u64 handler_start, u64 handler_end);
+void reset_stats();
+// Prints count, rate, p50, p99 and max of every vector that fired since the last reset.
+void dump_stats();
 
 }
@@ -0,0 +1,110 @@
+#include "interrupt.h"
+#include "cpu.h"
+#include "debug.h"
+#include "timer.h"
+
+namespace interrupt {
+
+VectorStats stats[stats_cpu_count][stats_vector_count];
+
+internal u32 reset_tick;
+
+internal u32 current_cpu() {
+	return 0;
+}
+
+internal u32 log2(u32 value) {
+	return value ? 31 - __builtin_clz(value) : 0;
+}
+
+internal void add(Histogram &histogram, u64 cycles) {
+	u32 value = cycles > 0xffffffff ? 0xffffffff : (u32)cycles;
+	histogram.buckets[log2(value)] += 1;
+	if (value > histogram.max)
+		histogram.max = value;
+}
+
+void record_stats(Registers &registers, u64 handler_start, u64 handler_end) {
+	if (registers.int_no >= stats_vector_count)
+		return;
+
+	u64 entry = ((u64)registers.entry_timestamp_high << 32) | registers.entry_timestamp_low;
+
+	auto &vector = stats[current_cpu()][registers.int_no];
+	vector.count += 1;
+	add(vector.latency, handler_start - entry);
+	add(vector.duration, handler_end - handler_start);
+}
+
+void reset_stats() {
+	cpu::InterruptGuard guard;
+	set_memory(stats, 0, sizeof(stats));
+	spurious_irq_count = 0;
+	reset_tick = timer::tick;
+}
+
+// Upper bound of the bucket that contains the `per_mille` percentile.
+internal u32 percentile(Histogram const &histogram, u32 count, u32 per_mille) {
+	u32 rank = (count * per_mille + 999) / 1000;
+	u32 seen = 0;
+	for (u32 i = 0; i < stats_bucket_count; ++i) {
+		seen += histogram.buckets[i];
+		if (seen >= rank)
+			return i == 31 ? 0xffffffff : (2u << i) - 1;
+	}
+	return histogram.max;
+}
+
+internal void print_histogram(Span<ascii> name, Histogram const &histogram, u32 count) {
+	debug::print(name);
+	debug::print(" p50 <"s);
+	debug::print(percentile(histogram, count, 500));
+	debug::print(" p99 <"s);
+	debug::print(percentile(histogram, count, 990));
+	debug::print(" max "s);
+	debug::print(histogram.max);
+}
+
+void dump_stats() {
+	u32 elapsed_ticks = timer::tick - reset_tick;
+
+	debug::print("Interrupt stats over "s);
+	debug::print(elapsed_ticks);
+	debug::print(" ticks, cycles:\n"s);
+	for (u32 cpu_index = 0; cpu_index < stats_cpu_count; ++cpu_index) {
+		for (u32 i = 0; i < stats_vector_count; ++i) {
+			VectorStats vector;
+			{
+				cpu::InterruptGuard guard;
+				vector = stats[cpu_index][i];
+			}
+			if (!vector.count)
+				continue;
+
+			debug::print("cpu "s);
+			debug::print(cpu_index);
+			debug::print(" vector "s);
+			debug::print(i);
+			if (i >= irq_0) {
+				debug::print(" (irq "s);
+				debug::print(i - irq_0);
+				debug::print(')');
+			}
+			debug::print(": count "s);
+			debug::print(vector.count);
+			if (elapsed_ticks && timer::frequency) {
+				debug::print(", rate "s);
+				debug::print(divide((u64)vector.count * timer::frequency, elapsed_ticks));
+				debug::print("/s"s);
+			}
+			print_histogram(", latency"s, vector.latency, vector.count);
+			print_histogram(", duration"s, vector.duration, vector.count);
+			debug::print('\n');
+		}
+	}
+	debug::print("spurious irqs: "s);
+	debug::print(spurious_irq_count);
+	debug::print('\n');
+}
+
+}
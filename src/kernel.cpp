@@ -2,13 +2,33 @@
 #include "port.h"
 #include "debug.h"
 #include "acpi.h"
+#include "aml.h"
 #include "interrupt.h"
 #include "keyboard.h"
+#include "timer.h"
+#include "cpu.h"
+#include "memory.h"
+#include "async.h"
+#include "boot.h"
+#include "pci.h"
+#include "ata.h"
+#include "virtio_blk.h"
+#include "e1000.h"
+#include "block_cache.h"
+#include "power.h"
+#include "idle.h"
+#include "fpu.h"
+#include "cpuid.h"
+#include "routines.h"
+#include "paging.h"
+#include "user.h"
 
 #define VGA_SIZE_X 80
 #define VGA_SIZE_Y 25
 
 #define VGA_MEMORY ((char *)0xb8000)
+// The whole color text window, 0xb8000 to 0xc0000
+#define VGA_WINDOW_SIZE 0x8000
 
 static u16 out_cursor;
 static u16 in_cursor;
@@ -109,53 +129,6 @@ void clear_screen() {
 	}
 	out_cursor = 0;
 }
-namespace timer {
-
-u32 tick = 0;
-
-void callback(Registers &registers) {
-	(void)registers;
-
-    tick++;
-    debug_print("Tick: "s);
-    debug_print(tick);
-    debug_print("\n"s);
-}
-
-void init(u32 frequency) {
-    /* Install the function we just wrote */
-    interrupt::set_handler(interrupt::irq_0, callback);
-
-    /* Get the PIT value: hardware clock at 1193180 Hz */
-    u32 divisor = 1193180 / frequency;
-    u8 low  = (u8)(divisor & 0xFF);
-    u8 high = (u8)((divisor >> 8) & 0xFF);
-    /* Send the command */
-    port::write_u8(0x43, 0x36); /* Command port */
-    port::write_u8(0x40, low);
-    port::write_u8(0x40, high);
-}
-
-}
-
-u8 *allocator_end = (u8 *)0x10000;
-
-void *allocate(umm size, umm align = 8) {
-	assert(align >= sizeof(umm) && is_power_of_2(align));
-
-	if ((umm)allocator_end | (align - 1)) {
-		allocator_end = (u8 *)(((umm)allocator_end & ~(align - 1)) + align);
-	}
-	auto result = allocator_end;
-	allocator_end += size;
-	return result;
-}
-
-template <class T>
-T *allocate(umm count) {
-	return (T *)allocate(count * sizeof(T), false);
-}
-
 struct StringBuilder {
 	struct Block : StaticList<u8, 4096> {
 	};
@@ -212,7 +185,10 @@ void assertion_failed(Span<ascii> cause, Span<ascii> expression, Span<ascii> fil
 		debug_print(as_span(call));
 		debug_print('\n');
 	}
-	while (1) {}
+	while (1) {
+		cpu::disable_interrupts();
+		cpu::halt();
+	}
 }
 
 void on_character_input(ascii character) {
@@ -221,7 +197,103 @@ void on_character_input(ascii character) {
 	set_vga_cursor(in_cursor);
 }
 
-internal Array<ascii, 256> character_add_shift;
+internal constexpr Array<ascii, 256> character_add_shift = [] {
+	Array<ascii, 256> result;
+	for (int i = 0; i < (int)result.count; ++i) {
+		result.data[i] = i;
+	}
+	for (int i = 'a'; i <= 'z'; ++i) {
+		result.data[i] = i - 'a' + 'A';
+	}
+	result.data['0'] = ')';
+	result.data['1'] = '!';
+	result.data['2'] = '@';
+	result.data['3'] = '#';
+	result.data['4'] = '$';
+	result.data['5'] = '%';
+	result.data['6'] = '^';
+	result.data['7'] = '&';
+	result.data['8'] = '*';
+	result.data['9'] = '(';
+	result.data['`'] = '~';
+	result.data['-'] = '_';
+	result.data['='] = '+';
+	result.data['['] = '{';
+	result.data[']'] = '}';
+	result.data[';'] = ':';
+	result.data['\''] = '"';
+	result.data[','] = '<';
+	result.data['.'] = '>';
+	result.data['/'] = '?';
+	result.data['\\'] = '|';
+	return result;
+}();
+
+inline static constexpr u32 cache_block_count = 256;
+inline static constexpr u32 disk_scan_blocks = 1024;
+inline static constexpr u32 restart_loop_count = 16;
+inline static constexpr u32 vga_benchmark_milliseconds = 500;
+
+internal block_cache::Device disk_devices[ata::drive_count + virtio_blk::max_device_count];
+
+// Reads the start of the first disk through the block cache twice, to see read-ahead and hits at work.
+internal void scan_disk() {
+	for (auto &device : disk_devices) {
+		if (!device.read)
+			continue;
+		u64 block_count = min<u64>(disk_scan_blocks, device.sector_count / block_cache::sectors_per_block);
+		for (u32 pass = 0; pass < 2; ++pass) {
+			for (u64 number = 0; number < block_count; ++number) {
+				auto block = block_cache::get(device, number);
+				if (!block)
+					break;
+				block_cache::release(block);
+			}
+		}
+		break;
+	}
+	block_cache::print_stats();
+}
+
+// Copies the screen onto itself for a while, uncached and then write combining, which is how it stays.
+internal void vga_benchmark() {
+	struct Mode {
+		Span<ascii> name;
+		u32 flags;
+	};
+	static constexpr Mode modes[] = {
+		{"uncached"s, paging::flag_uncached},
+		{"write combining"s, paging::flag_write_combining},
+	};
+	static u8 screen[VGA_SIZE_X*VGA_SIZE_Y*2];
+	copy_memory(screen, VGA_MEMORY, sizeof(screen));
+
+	u32 duration = timer::milliseconds_to_ticks(vga_benchmark_milliseconds);
+	for (auto &mode : modes) {
+		if (!paging::protect((umm)VGA_MEMORY, VGA_WINDOW_SIZE, paging::flag_writable | mode.flags)) {
+			debug::print("vga: paging is off, nothing to compare\n"s);
+			return;
+		}
+		u32 blits = 0;
+		u32 start_tick = timer::tick;
+		u64 start = cpu::read_timestamp();
+		while (timer::tick - start_tick < duration) {
+			copy_memory(VGA_MEMORY, screen, sizeof(screen));
+			++blits;
+		}
+		cpu::store_fence();
+		u64 cycles = cpu::read_timestamp() - start;
+		u32 ticks = timer::tick - start_tick;
+
+		debug::print("vga: "s);
+		debug::print(mode.name);
+		debug::print(", "s);
+		debug::print(divide(cycles, blits));
+		debug::print(" cycles per screen, "s);
+		debug::print(divide(((u64)blits * sizeof(screen) * timer::frequency) >> 10, ticks));
+		debug::print(" KB/s\n"s);
+	}
+}
 
 void kernel_key_event(KeyboardEvent event) {
 	trace;
@@ -236,10 +308,50 @@ void kernel_key_event(KeyboardEvent event) {
 	if (event.down) {
 		switch (event.key) {
 			case Key_escape: {
-				acpi::power_off();
-				break;
+				power::shutdown();
 			}
 			case 'r': {
+				if (event.modifiers & Modifier_shift)
+					power::reset();
+				power::warm_restart();
+			}
+			case Key_f1: {
+				interrupt::dump_stats();
+				break;
+			}
+			case Key_f2: {
+				interrupt::reset_stats();
+				break;
+			}
+			case Key_f3: {
+				ata::benchmark();
+				virtio_blk::benchmark();
+				break;
+			}
+			case Key_f4: {
+				scan_disk();
+				break;
+			}
+			case Key_f5: {
+				e1000::benchmark();
+				break;
+			}
+			case Key_f6: {
+				power::start_restart_loop(restart_loop_count);
+			}
+			case Key_f7: {
+				idle::print_stats();
+				fpu::print_info();
+				paging::print_info();
+				memory::print_page_stats();
+				break;
+			}
+			case Key_f8: {
+				vga_benchmark();
+				break;
+			}
+			case Key_f9: {
+				user::benchmark();
 				break;
 			}
 		}
@@ -263,7 +375,7 @@ void kernel_key_event(KeyboardEvent event) {
 		 || character == '\n'
 		 || character == ' ')
 		{
-			if (key_held(Key_left_shift) || key_held(Key_right_shift)) {
+			if (event.modifiers & Modifier_shift) {
 				character = character_add_shift[character];
 			}
 			on_character_input((ascii)character);
@@ -271,7 +383,14 @@ void kernel_key_event(KeyboardEvent event) {
 	}
 }
 
+async::Task<> keyboard_task() {
+	while (1) {
+		kernel_key_event(co_await next_key_event());
+	}
+}
+
 extern "C" void kernel_main() {
+	boot::init_timeline();
 	trace;
 	int x = 6;
 	(void)x;
@@ -281,66 +400,72 @@ extern "C" void kernel_main() {
 	debug_print((u32)255);
 	debug_print(" is 255\n"s);
 
-	acpi::init();
+	boot::print_info();
+
+	cpuid::init();
+	cpuid::print_info();
+	idle::init();
 
+	// Before acpi, so the table checksums already go through the routines picked for the cpu
 	interrupt::init();
+	fpu::init();
+	paging::init();
+	paging::map_write_combining((umm)VGA_MEMORY, VGA_WINDOW_SIZE);
+	routines::init();
+	user::init();
+	boot::mark(boot::Phase_interrupts);
+	fpu::print_info();
+	paging::print_info();
 
-	asm volatile("sti");
+	acpi::init();
+	boot::mark(boot::Phase_acpi);
+	acpi::print_tables();
+	aml::print_stats();
 
-    //timer::init(50);
+	asm volatile("sti");
 
+	timer::init(timer::default_frequency);
+	boot::mark(boot::Phase_timer);
 
 	init_keyboard();
+	boot::mark(boot::Phase_keyboard);
 
-	{
-		decltype(::character_add_shift) character_add_shift;
-		for (int i = 0; i < (int)character_add_shift.count; ++i) {
-			character_add_shift[i] = i;
-		}
+	pci::init();
+	boot::mark(boot::Phase_pci);
+	pci::print_devices();
 
-		for (int i = 'a'; i <= 'z'; ++i) {
-			character_add_shift[i] = i - 'a' + 'A';
-		}
+	ata::init();
+	boot::mark(boot::Phase_ata);
+	ata::print_drives();
 
-		for (int i = 'a'; i <= 'z'; ++i) {
-			character_add_shift[i] = i - 'a' + 'A';
-		}
-		character_add_shift['0'] = ')';
-		character_add_shift['1'] = '!';
-		character_add_shift['2'] = '@';
-		character_add_shift['3'] = '#';
-		character_add_shift['4'] = '$';
-		character_add_shift['5'] = '%';
-		character_add_shift['6'] = '^';
-		character_add_shift['7'] = '&';
-		character_add_shift['8'] = '*';
-		character_add_shift['9'] = '(';
-		character_add_shift['`'] = '~';
-		character_add_shift['-'] = '_';
-		character_add_shift['='] = '+';
-		character_add_shift['['] = '{';
-		character_add_shift[']'] = '}';
-		character_add_shift[';'] = ':';
-		character_add_shift['\''] = '"';
-		character_add_shift[','] = '<';
-		character_add_shift['.'] = '>';
-		character_add_shift['/'] = '?';
-		character_add_shift['\\'] = '|';
-
-		::character_add_shift = character_add_shift;
+	virtio_blk::init();
+	boot::mark(boot::Phase_virtio);
+	virtio_blk::print_devices();
+
+	e1000::init();
+	boot::mark(boot::Phase_network);
+	e1000::print_nics();
+
+	block_cache::init(cache_block_count);
+	for (u32 i = 0; i < ata::drive_count; ++i) {
+		if (ata::drives[i].present)
+			disk_devices[i] = ata::block_device(ata::drives[i]);
 	}
+	for (u32 i = 0; i < virtio_blk::device_count; ++i)
+		disk_devices[ata::drive_count + i] = virtio_blk::block_device(virtio_blk::devices[i]);
+
 
 	in_cursor = VGA_SIZE_X*(VGA_SIZE_Y-1);
 	set_vga_cursor(in_cursor);
 
 
 	clear_screen();
-	print("Hello mister!\nPress escape to halt the cpu\nPress R to restart\n"s);
+	print("Hello mister!\nPress escape to shut down\nPress R to restart the kernel, shift + R to reset the machine\nPress F1 to print interrupt stats, F2 to reset them\nPress F3 to benchmark disks, F4 to scan one through the block cache\nPress F5 to benchmark the network, F6 to time warm restarts\nPress F7 to print cpu load, fpu and paging use, F8 to benchmark the screen\nPress F9 to time system calls from user mode\n"s);
 
 	static constexpr Span<ascii> string_to_allocate = "This is an allocated string\n"s;
 
 	Span<ascii> allocated_string;
-	allocated_string.data = (ascii *)allocate(string_to_allocate.count);
+	allocated_string.data = (ascii *)memory::allocate(string_to_allocate.count);
 	allocated_string.count = string_to_allocate.count;
 	copy_memory(allocated_string.data, string_to_allocate.data, string_to_allocate.count);
 
@@ -349,8 +474,19 @@ extern "C" void kernel_main() {
 	print(" bytes\n"s);
 
 	print(allocated_string);
-	while (1) {
-	}
+
+	// Null pointers fault from here on. acpi read the BIOS data area in this page already.
+	paging::unmap(0, paging::page_size);
+
+	boot::mark(boot::Phase_kernel_main);
+	boot::print_timeline();
+	power::continue_restart_loop();
+
+	async::spawn(keyboard_task());
+	async::spawn(block_cache::writeback_task());
+	async::spawn(e1000::receive_task());
+	async::spawn(e1000::report_task());
+	async::run();
 }
 
 #if 0
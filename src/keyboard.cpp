@@ -3,13 +3,6 @@
 #include "interrupt.h"
 #include "debug.h"
 
-void kernel_key_event(KeyboardEvent event);
-
-internal StaticList<u8, 6> scan_code_sequence;
-
-internal Array<Key, 256> scan_code_to_key_unescaped;
-internal Array<Key, 256> scan_code_to_key_escaped_with_e0;
-
 Span<ascii> key_to_string(Key key) {
 	trace;
 #define K(key, value) case Key_##key:return#key##s;
@@ -20,75 +13,35 @@ Span<ascii> key_to_string(Key key) {
 	return "unknown"s;
 }
 
-internal KeyboardEvent sequence_to_event() {
-	trace;
-	KeyboardEvent event;
-	switch (scan_code_sequence.count) {
-		case 1: {
-			auto scan_code = scan_code_sequence.data[0];
-			if (scan_code < 0x80) {
-				event.down = true;
-			} else {
-				event.down = false;
-				scan_code -= 0x80;
-			}
-			event.key = scan_code_to_key_unescaped[scan_code];
-			break;
-		}
-		case 2: {
-			switch (scan_code_sequence.data[0]) {
-				case 0xe0: {
-					auto scan_code = scan_code_sequence.data[1];
-					if (scan_code < 0x80) {
-						event.down = true;
-					} else {
-						event.down = false;
-						scan_code -= 0x80;
-					}
-					event.key = scan_code_to_key_escaped_with_e0[scan_code];
-					break;
-				}
-			}
-			break;
-		}
-		case 6: {
-			event.key = Key_break;
-			event.down = true;
-			break;
-		}
-	}
-	return event;
-}
-
-internal Array<bool, 256> key_state;
-
-internal void callback(Registers &registers) {
-	trace;
-	(void)registers;
-
-    /* The PIC leaves us the scan_code in port 0x60 */
-	u8 scan_code = port::read_u8(0x60);
-
-    debug_print("Scancode: "s);
-    debug_print(scan_code);
-    debug_print('\n');
+// Everything needed to decode one scan code set. Built at compile time.
+//
+// Bytes that only modify the meaning of the next one (0xe0, 0xe1, and 0xf0 in set 2)
+// are marked in `prefixes` and OR-ed into the decoder state, so decoding a byte is
+// two table lookups and no switch over sequences.
+struct ScanCodeSet {
+	// Page 0 is for plain codes, page 1 is for codes after 0xe0.
+	Key keys[2][256];
+	u8 prefixes[256];
+	// Set 1 marks releases with the top bit of the code, set 2 with the 0xf0 prefix.
+	u8 release_mask;
+	// Pause has no release code, just a fixed sequence after 0xe1.
+	u8 pause_length;
+};
 
-	scan_code_sequence.add(scan_code);
+enum : u8 {
+	Prefix_e0      = 0x1,
+	Prefix_release = 0x2,
+	Prefix_pause   = 0x4,
+};
 
-	auto event = sequence_to_event();
+inline static constexpr ScanCodeSet scan_code_set_1 = [] {
+	ScanCodeSet result = {};
+	result.prefixes[0xe0] = Prefix_e0;
+	result.prefixes[0xe1] = Prefix_pause;
+	result.release_mask = 0x80;
+	result.pause_length = 5; // 1d 45 e1 9d c5
 
-	if (event.key) {
-		key_state[event.key] = event.down;
-		kernel_key_event(event);
-		scan_code_sequence.clear();
-	}
-}
-
-void init_keyboard() {
-	trace;
-	interrupt::set_handler(interrupt::irq_1, callback);
-
-#define C(sc, key) scan_code_to_key_unescaped[sc] = key
+#define C(sc, key) result.keys[0][sc] = key
 	C(0x00, Key_null);
 	C(0x01, Key_escape);
 	C(0x02, '1');
@@ -179,14 +132,15 @@ void init_keyboard() {
 	C(0x57, Key_f11);
 	C(0x58, Key_f12);
 #undef C
-#define C(sc, key) scan_code_to_key_escaped_with_e0[sc] = key
+
+	// 0xe0 0x2a and 0xe0 0x36 are fake shifts sent around some keys (print screen, for example),
+	// they are left as Key_null and ignored.
+#define C(sc, key) result.keys[1][sc] = key
 	C(0x1c, Key_num_enter);
 	C(0x1d, Key_right_control);
-	C(0x2a, Key_left_shift);
 	C(0x35, Key_num_slash);
-	C(0x36, Key_right_shift);
 	C(0x37, Key_print_screen);
-	C(0x38, Key_menu);
+	C(0x38, Key_right_alt);
 	C(0x46, Key_break);
 	C(0x47, Key_home);
 	C(0x48, Key_up);
@@ -200,12 +154,257 @@ void init_keyboard() {
 	C(0x53, Key_delete);
 	C(0x5b, Key_left_windows);
 	C(0x5c, Key_right_windows);
-	C(0x5d, Key_right_alt);
+	C(0x5d, Key_menu);
+#undef C
+	return result;
+}();
+
+inline static constexpr ScanCodeSet scan_code_set_2 = [] {
+	ScanCodeSet result = {};
+	result.prefixes[0xe0] = Prefix_e0;
+	result.prefixes[0xe1] = Prefix_pause;
+	result.prefixes[0xf0] = Prefix_release;
+	result.release_mask = 0;
+	result.pause_length = 7; // 14 77 e1 f0 14 f0 77
+
+#define C(sc, key) result.keys[0][sc] = key
+	C(0x01, Key_f9);
+	C(0x03, Key_f5);
+	C(0x04, Key_f3);
+	C(0x05, Key_f1);
+	C(0x06, Key_f2);
+	C(0x07, Key_f12);
+	C(0x09, Key_f10);
+	C(0x0a, Key_f8);
+	C(0x0b, Key_f6);
+	C(0x0c, Key_f4);
+	C(0x0d, '\t');
+	C(0x0e, '`');
+	C(0x11, Key_left_alt);
+	C(0x12, Key_left_shift);
+	C(0x14, Key_left_control);
+	C(0x15, 'q');
+	C(0x16, '1');
+	C(0x1a, 'z');
+	C(0x1b, 's');
+	C(0x1c, 'a');
+	C(0x1d, 'w');
+	C(0x1e, '2');
+	C(0x21, 'c');
+	C(0x22, 'x');
+	C(0x23, 'd');
+	C(0x24, 'e');
+	C(0x25, '4');
+	C(0x26, '3');
+	C(0x29, ' ');
+	C(0x2a, 'v');
+	C(0x2b, 'f');
+	C(0x2c, 't');
+	C(0x2d, 'r');
+	C(0x2e, '5');
+	C(0x31, 'n');
+	C(0x32, 'b');
+	C(0x33, 'h');
+	C(0x34, 'g');
+	C(0x35, 'y');
+	C(0x36, '6');
+	C(0x3a, 'm');
+	C(0x3b, 'j');
+	C(0x3c, 'u');
+	C(0x3d, '7');
+	C(0x3e, '8');
+	C(0x41, ',');
+	C(0x42, 'k');
+	C(0x43, 'i');
+	C(0x44, 'o');
+	C(0x45, '0');
+	C(0x46, '9');
+	C(0x49, '.');
+	C(0x4a, '/');
+	C(0x4b, 'l');
+	C(0x4c, ';');
+	C(0x4d, 'p');
+	C(0x4e, '-');
+	C(0x52, '\'');
+	C(0x54, '[');
+	C(0x55, '=');
+	C(0x58, Key_caps_lock);
+	C(0x59, Key_right_shift);
+	C(0x5a, '\n');
+	C(0x5b, ']');
+	C(0x5d, '\\');
+	C(0x66, '\b');
+	C(0x69, Key_num_1);
+	C(0x6b, Key_num_4);
+	C(0x6c, Key_num_7);
+	C(0x70, Key_num_0);
+	C(0x71, Key_num_delete);
+	C(0x72, Key_num_2);
+	C(0x73, Key_num_5);
+	C(0x74, Key_num_6);
+	C(0x75, Key_num_8);
+	C(0x76, Key_escape);
+	C(0x77, Key_num_lock);
+	C(0x78, Key_f11);
+	C(0x79, Key_num_plus);
+	C(0x7a, Key_num_3);
+	C(0x7b, Key_num_minus);
+	C(0x7c, '*');
+	C(0x7d, Key_num_9);
+	C(0x7e, Key_scroll_lock);
+	C(0x83, Key_f7);
 #undef C
+
+	// 0xe0 0x12 and 0xe0 0x59 are fake shifts, same as in set 1.
+#define C(sc, key) result.keys[1][sc] = key
+	C(0x11, Key_right_alt);
+	C(0x14, Key_right_control);
+	C(0x1f, Key_left_windows);
+	C(0x27, Key_right_windows);
+	C(0x2f, Key_menu);
+	C(0x4a, Key_num_slash);
+	C(0x5a, Key_num_enter);
+	C(0x69, Key_end);
+	C(0x6b, Key_left);
+	C(0x6c, Key_home);
+	C(0x70, Key_insert);
+	C(0x71, Key_delete);
+	C(0x72, Key_down);
+	C(0x74, Key_right);
+	C(0x75, Key_up);
+	C(0x7a, Key_page_down);
+	C(0x7c, Key_print_screen);
+	C(0x7d, Key_page_up);
+	C(0x7e, Key_break);
+#undef C
+	return result;
+}();
+
+inline static constexpr Array<u8, 256> key_to_modifier = [] {
+	Array<u8, 256> result = {};
+	result.data[Key_left_shift]    = Modifier_left_shift;
+	result.data[Key_right_shift]   = Modifier_right_shift;
+	result.data[Key_left_control]  = Modifier_left_control;
+	result.data[Key_right_control] = Modifier_right_control;
+	result.data[Key_left_alt]      = Modifier_left_alt;
+	result.data[Key_right_alt]     = Modifier_right_alt;
+	result.data[Key_left_windows]  = Modifier_left_windows;
+	result.data[Key_right_windows] = Modifier_right_windows;
+	return result;
+}();
+
+internal ScanCodeSet const *scan_code_set = &scan_code_set_1;
+
+// Prefix bits seen so far
+internal u8 decoder_state;
+internal u8 pause_bytes_remaining;
+
+internal u32 key_state[256 / 32];
+internal u8 modifier_state;
+
+internal async::Channel<KeyboardEvent, key_event_capacity> events;
+
+internal void emit(Key key, bool down) {
+	u32 bit = 1 << (key & 31);
+	key_state[key >> 5] = (key_state[key >> 5] & ~bit) | (down ? bit : 0);
+
+	u8 modifier = key_to_modifier.data[key];
+	modifier_state = (modifier_state & ~modifier) | (down ? modifier : 0);
+
+	KeyboardEvent event;
+	event.key = key;
+	event.down = down;
+	event.modifiers = modifier_state;
+	if (!async::push(events, event)) {
+		debug_print("Keyboard event queue is full, dropping event\n"s);
+	}
 }
 
+internal void decode(u8 byte) {
+	auto &set = *scan_code_set;
 
-bool key_held(Key key) {
+	if (pause_bytes_remaining) {
+		if (--pause_bytes_remaining == 0) {
+			emit(Key_break, true);
+			emit(Key_break, false);
+		}
+		return;
+	}
+
+	if (auto prefix = set.prefixes[byte]) {
+		decoder_state |= prefix;
+		if (prefix & Prefix_pause) {
+			pause_bytes_remaining = set.pause_length;
+			decoder_state = 0;
+		}
+		return;
+	}
+
+	bool release = (decoder_state & Prefix_release) || (byte & set.release_mask);
+	Key key = set.keys[decoder_state & Prefix_e0][byte & ~set.release_mask];
+	decoder_state = 0;
+
+	if (key)
+		emit(key, !release);
+}
+
+internal void callback(Registers &registers, void *context) {
+	(void)registers;
+	(void)context;
+
+	/* The PIC leaves us the scan_code in port 0x60 */
+	decode(port::read_u8(port::ps2_data));
+}
+
+inline static constexpr u8 ps2_status_output_full = 0x1;
+inline static constexpr u8 ps2_status_input_full  = 0x2;
+inline static constexpr u8 ps2_read_configuration = 0x20;
+inline static constexpr u8 ps2_configuration_translation = 0x40;
+
+internal bool read_configuration(u8 &configuration) {
+	for (u32 i = 0; i < 100000; ++i) {
+		if (!(port::read_u8(port::ps2_command) & ps2_status_input_full))
+			break;
+	}
+	port::write_u8(port::ps2_command, ps2_read_configuration);
+	for (u32 i = 0; i < 100000; ++i) {
+		if (port::read_u8(port::ps2_command) & ps2_status_output_full) {
+			configuration = port::read_u8(port::ps2_data);
+			return true;
+		}
+	}
+	return false;
+}
+
+void init_keyboard() {
 	trace;
-	return key_state[key];
+
+	// The keyboard speaks set 2. The controller translates that to set 1 unless translation is off.
+	u8 configuration;
+	if (read_configuration(configuration) && !(configuration & ps2_configuration_translation)) {
+		scan_code_set = &scan_code_set_2;
+		debug_print("Keyboard uses scan code set 2\n"s);
+	}
+
+	interrupt::set_handler(interrupt::irq_1, callback);
+}
+
+KeyboardEvent wait_key_event() {
+	return async::receive(events);
+}
+
+bool try_get_key_event(KeyboardEvent &event) {
+	return async::try_receive(events, event);
+}
+
+async::ReceiveAwaiter<KeyboardEvent, key_event_capacity> next_key_event() {
+	return async::receive_async(events);
+}
+
+bool key_held(Key key) {
+	return key_state[key >> 5] & (1 << (key & 31));
+}
+
+u8 keyboard_modifiers() {
+	return modifier_state;
 }
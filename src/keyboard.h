@@ -1,5 +1,6 @@
 #pragma once
 #include "common.h"
+#include "async.h"
 
 #define ALL_KEYS \
 K(null, 0) \
@@ -116,12 +117,40 @@ enum : Key {
 };
 #undef K
 
+enum : u8 {
+	Modifier_left_shift    = 0x01,
+	Modifier_right_shift   = 0x02,
+	Modifier_left_control  = 0x04,
+	Modifier_right_control = 0x08,
+	Modifier_left_alt      = 0x10,
+	Modifier_right_alt     = 0x20,
+	Modifier_left_windows  = 0x40,
+	Modifier_right_windows = 0x80,
+
+	Modifier_shift   = Modifier_left_shift   | Modifier_right_shift,
+	Modifier_control = Modifier_left_control | Modifier_right_control,
+	Modifier_alt     = Modifier_left_alt     | Modifier_right_alt,
+	Modifier_windows = Modifier_left_windows | Modifier_right_windows,
+};
+
 struct KeyboardEvent {
 	Key key = 0;
 	bool down;
+	// Modifiers held right after this event
+	u8 modifiers;
 };
 
 void init_keyboard();
+
+// Sleeps until a key is pressed or released.
+KeyboardEvent wait_key_event();
+bool try_get_key_event(KeyboardEvent &event);
+
+inline static constexpr umm key_event_capacity = 64;
+
+// Same as wait_key_event, for tasks.
+async::ReceiveAwaiter<KeyboardEvent, key_event_capacity> next_key_event();
 Span<ascii> key_to_string(Key key);
 
 bool key_held(Key key);
+u8 keyboard_modifiers();
@@ -0,0 +1,108 @@
+[bits 32]
+; Decompresses the kernel that follows this stub to kernel_address and jumps to it.
+;
+; The boot sector loads the stub and the compressed kernel wherever it likes and jumps here,
+; so everything is position independent. The kernel is in the LZ4 legacy frame format
+; ('lz4 -l'): a magic number, then blocks of [u32 compressed size][LZ4 block].
+; The Makefile appends a zero size to mark the end.
+
+%include "handoff.inc"
+
+lz4_legacy_magic equ 0x184c2102
+
+lz4_stub_main:
+	cld
+	rdtsc
+	mov [handoff_address + handoff.decompress_start_timestamp], eax
+	mov [handoff_address + handoff.decompress_start_timestamp + 4], edx
+
+	call .get_address
+.get_address:
+	pop esi
+	add esi, compressed_kernel - .get_address
+
+	lodsd
+	cmp eax, lz4_legacy_magic
+	jne .error
+
+	mov edi, kernel_address
+.next_block:
+	lodsd ; compressed size of the block
+	test eax, eax
+	jz .done
+	lea edx, [esi + eax]
+	call decompress_block
+	mov esi, edx
+	jmp .next_block
+
+.done:
+	sub edi, kernel_address
+	mov [handoff_address + handoff.uncompressed_size], edi
+
+	rdtsc
+	mov [handoff_address + handoff.decompress_end_timestamp], eax
+	mov [handoff_address + handoff.decompress_end_timestamp + 4], edx
+
+	xor eax, eax ; we are not a multiboot loader
+	mov ecx, [kernel_address + multiboot_entry_offset]
+	jmp ecx
+
+.error:
+	mov byte [0xb8000], '!'
+	mov byte [0xb8001], 0x4f
+.halt:
+	cli
+	hlt
+	jmp .halt
+
+; Decompresses one LZ4 block.
+; esi - compressed data, edx - end of compressed data, edi - destination (advanced)
+; Clobbers eax, ebx, ecx, esi
+decompress_block:
+.sequence:
+	movzx ebx, byte [esi] ; token: literal length in the high nibble, match length in the low one
+	inc esi
+
+	mov ecx, ebx
+	shr ecx, 4
+	cmp ecx, 15
+	jne .copy_literals
+.literal_length:
+	movzx eax, byte [esi]
+	inc esi
+	add ecx, eax
+	cmp al, 255
+	je .literal_length
+.copy_literals:
+	rep movsb
+
+	; The last sequence has only literals
+	cmp esi, edx
+	jae .done
+
+	movzx eax, word [esi] ; match offset
+	add esi, 2
+
+	and ebx, 0xf
+	mov ecx, ebx
+	cmp ecx, 15
+	jne .copy_match
+.match_length:
+	movzx ebx, byte [esi]
+	inc esi
+	add ecx, ebx
+	cmp bl, 255
+	je .match_length
+.copy_match:
+	add ecx, 4 ; minimum match length
+	push esi
+	mov esi, edi
+	sub esi, eax
+	; Matches may overlap their output, which movsb handles since it copies byte by byte.
+	rep movsb
+	pop esi
+	jmp .sequence
+.done:
+	ret
+
+compressed_kernel:
@@ -0,0 +1,164 @@
+#include "memory.h"
+#include "cpu.h"
+#include "debug.h"
+#include "idle.h"
+#include "routines.h"
+
+namespace memory {
+
+internal u8 *heap_end = kernel_end;
+
+void *allocate(umm size, umm align) {
+	assert(align >= sizeof(umm) && is_power_of_2(align));
+
+	cpu::InterruptGuard guard;
+	heap_end = (u8 *)(((umm)heap_end + align - 1) & ~(align - 1));
+	auto result = heap_end;
+	heap_end += size;
+	return result;
+}
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+inline static constexpr umm size_class_count = 13;
+static_assert((min_block_size << (size_class_count - 1)) == max_block_size);
+
+internal FreeBlock *free_lists[size_class_count];
+
+internal umm size_class(umm size) {
+	umm result = 0;
+	while ((min_block_size << result) < size)
+		++result;
+	return result;
+}
+
+void *allocate_block(umm size) {
+	assert(size <= max_block_size);
+	auto index = size_class(size);
+
+	cpu::InterruptGuard guard;
+	if (auto block = free_lists[index]) {
+		free_lists[index] = block->next;
+		return block;
+	}
+	return allocate(min_block_size << index, min_block_size);
+}
+
+void free_block(void *block, umm size) {
+	if (!block)
+		return;
+	auto index = size_class(size);
+
+	cpu::InterruptGuard guard;
+	auto free = (FreeBlock *)block;
+	free->next = free_lists[index];
+	free_lists[index] = free;
+}
+
+umm heap_size() {
+	return heap_end - kernel_end;
+}
+
+// Pages zeroed by one run of the idle work, so that it doesn't hold up the cpu waking up for long
+inline static constexpr u32 zeroed_batch = 8;
+
+PageStats page_stats;
+
+internal void zero_pages(void *context);
+
+internal FreeBlock *free_pages;
+internal FreeBlock *zeroed_pages;
+internal idle::Deferred zero_pages_work = {zero_pages, 0, 0, false};
+
+internal void push(FreeBlock *&list, void *page) {
+	auto free = (FreeBlock *)page;
+	free->next = list;
+	list = free;
+}
+
+internal void *pop(FreeBlock *&list) {
+	auto page = list;
+	if (page)
+		list = page->next;
+	return page;
+}
+
+internal void zero_pages_when_idle() {
+	if (page_stats.zeroed_count < zeroed_pool_target)
+		idle::queue(zero_pages_work);
+}
+
+// Runs with interrupts enabled; only the lists need them off. The pages won't be touched soon, so they are
+// zeroed past the caches where the cpu can.
+internal void zero_pages(void *context) {
+	(void)context;
+	for (u32 i = 0; i < zeroed_batch; ++i) {
+		void *page;
+		{
+			cpu::InterruptGuard guard;
+			if (page_stats.zeroed_count >= zeroed_pool_target)
+				return;
+			page = pop(free_pages);
+			if (page)
+				--page_stats.free_count;
+			else
+				page = allocate(page_size, page_size);
+		}
+		routines::zero_uncached(page, page_size);
+
+		cpu::InterruptGuard guard;
+		push(zeroed_pages, page);
+		++page_stats.zeroed_count;
+		++page_stats.zeroed_when_idle;
+	}
+	zero_pages_when_idle();
+}
+
+void *allocate_page(bool zeroed) {
+	cpu::InterruptGuard guard;
+	defer { zero_pages_when_idle(); };
+	if (zeroed) {
+		if (auto page = pop(zeroed_pages)) {
+			--page_stats.zeroed_count;
+			++page_stats.zeroed_hits;
+			return page;
+		}
+		++page_stats.zeroed_misses;
+	}
+	void *page = pop(free_pages);
+	if (page)
+		--page_stats.free_count;
+	else if (!zeroed && (page = pop(zeroed_pages)))
+		--page_stats.zeroed_count;
+	else
+		page = allocate(page_size, page_size);
+	if (zeroed)
+		set_memory(page, 0, page_size);
+	return page;
+}
+
+void free_page(void *page) {
+	cpu::InterruptGuard guard;
+	push(free_pages, page);
+	++page_stats.free_count;
+	zero_pages_when_idle();
+}
+
+void print_page_stats() {
+	u32 requests = page_stats.zeroed_hits + page_stats.zeroed_misses;
+	debug::print("pages: "s);
+	debug::print(page_stats.zeroed_count);
+	debug::print(" zeroed, "s);
+	debug::print(page_stats.free_count);
+	debug::print(" free, zeroed pool hit ratio "s);
+	debug::print(percent(page_stats.zeroed_hits, requests));
+	debug::print("% of "s);
+	debug::print(requests);
+	debug::print(", "s);
+	debug::print(page_stats.zeroed_when_idle);
+	debug::print(" zeroed when idle\n"s);
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+
+// Defined in script.ld
+extern "C" u8 kernel_end[];
+
+namespace memory {
+
+// Bump allocator. Memory is never returned.
+void *allocate(umm size, umm align = 8);
+
+template <class T>
+T *allocate(umm count) {
+	return (T *)allocate(count * sizeof(T), alignof(T) < sizeof(umm) ? sizeof(umm) : alignof(T));
+}
+
+// Blocks that come and go, like coroutine frames, are recycled through power of two size class free lists.
+inline static constexpr umm min_block_size = 16;
+inline static constexpr umm max_block_size = 64 * 1024;
+
+void *allocate_block(umm size);
+void free_block(void *block, umm size);
+
+umm heap_size();
+
+// Page frames, for page tables and demand zero memory. Freed ones are kept for reuse, and deferred idle
+// work zeroes some of them ahead of time, so a request for a zeroed page usually doesn't have to zero it
+// on the spot. The heap grows when there are no free pages left.
+inline static constexpr umm page_size = 4096;
+// Zeroed pages the idle work keeps ready
+inline static constexpr u32 zeroed_pool_target = 64;
+
+// Aligned to page_size. Irq safe.
+void *allocate_page(bool zeroed);
+void free_page(void *page);
+
+struct PageStats {
+	u32 zeroed_hits;       // Requests for zeroed pages that the pool had one for
+	u32 zeroed_misses;     // ... that zeroed one right away
+	u32 zeroed_when_idle;
+	u32 free_count;        // Not zeroed
+	u32 zeroed_count;
+};
+
+extern PageStats page_stats;
+
+void print_page_stats();
+
+// A piece of a scatter-gather list. Addresses are physical, which for now is the same thing as virtual.
+struct Segment {
+	void *data;
+	u32 size;
+};
+
+}
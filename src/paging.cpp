@@ -0,0 +1,482 @@
+#include "paging.h"
+#include "cpu.h"
+#include "cpuid.h"
+#include "debug.h"
+#include "boot.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "user.h"
+
+namespace paging {
+
+inline static constexpr u8 vector_page_fault = 14;
+
+inline static constexpr u32 entry_count = 1024;
+inline static constexpr u32 entry_present = 1 << 0;
+inline static constexpr u32 entry_large   = 1 << 7;  // In a directory entry, where flag_pat would be
+inline static constexpr u32 large_pat     = 1 << 12;
+inline static constexpr u32 address_mask       = 0xfffff000;
+inline static constexpr u32 large_address_mask = 0xffc00000;
+
+// Page fault error code
+inline static constexpr u32 fault_present  = 1 << 0; // Clear if the page wasn't mapped
+inline static constexpr u32 fault_write    = 1 << 1;
+inline static constexpr u32 fault_user     = 1 << 2;
+inline static constexpr u32 fault_reserved = 1 << 3;
+inline static constexpr u32 fault_fetch    = 1 << 4;
+
+inline static constexpr u32 msr_pat = 0x277;
+inline static constexpr u64 pat_write_combining = 0x01;
+inline static constexpr u64 pat_write_through   = 0x04;
+inline static constexpr u64 pat_write_back      = 0x06;
+inline static constexpr u64 pat_uncached_minus  = 0x07;
+inline static constexpr u64 pat_uncached        = 0x00;
+inline static constexpr u64 pat_value =
+	(pat_write_back      <<  0) | (pat_write_through <<  8) | (pat_uncached_minus << 16) | (pat_uncached << 24) |
+	(pat_write_combining << 32) | (pat_write_through << 40) | (pat_uncached_minus << 48) | (pat_uncached << 56);
+
+inline static constexpr u32 max_region_count = 32;
+
+// Above this many pages, flushing everything is cheaper than invlpg for each
+inline static constexpr umm max_page_flushes = 32;
+
+bool enabled;
+bool write_combining;
+Stats stats;
+umm lazy_window_start;
+umm lazy_window_size;
+
+alignas(page_size) internal u32 directory[entry_count];
+// flag_global if the cpu has global pages, which survive cr3 reloads
+internal u32 global_pages;
+struct Region {
+	umm start;
+	umm size;
+	u32 flags;
+};
+
+internal StaticList<Region, max_region_count> regions;
+internal umm lazy_window_used;
+
+internal u32 large_entry(umm physical_address, u32 flags) {
+	u32 entry = (u32)physical_address | (flags & ~flag_pat) | entry_present | entry_large;
+	if (flags & flag_pat)
+		entry |= large_pat;
+	return entry;
+}
+
+internal u32 flags_of_large(u32 entry) {
+	u32 flags = entry & flags_mask & ~flag_pat;
+	if (entry & large_pat)
+		flags |= flag_pat;
+	return flags;
+}
+
+internal bool is_table(u32 entry) {
+	return (entry & entry_present) && !(entry & entry_large);
+}
+
+// Before the directory entry is overwritten with a 4 MB page or nothing.
+internal void release_table(u32 index) {
+	u32 entry = directory[index];
+	if (!is_table(entry))
+		return;
+	memory::free_page((void *)(entry & address_mask));
+}
+
+// The page table of directory entry `index`. Made from the 4 MB page there, or empty, if there isn't one.
+internal u32 *table_for(u32 index) {
+	u32 entry = directory[index];
+	if (is_table(entry))
+		return (u32 *)(entry & address_mask);
+
+	bool split = entry & entry_present;
+	auto table = (u32 *)memory::allocate_page(!split);
+	if (split) {
+		u32 base = entry & large_address_mask;
+		u32 flags = flags_of_large(entry) | entry_present;
+		for (u32 i = 0; i < entry_count; ++i)
+			table[i] = (base + i * page_size) | flags;
+		++stats.splits;
+	}
+	// The table entries decide, so the directory entry allows everything
+	directory[index] = (u32)table | entry_present | flag_writable | flag_user;
+	return table;
+}
+
+internal u32 &table_entry(u32 index, umm virtual_address) {
+	return table_for(index)[(virtual_address / page_size) % entry_count];
+}
+
+internal bool covers_large_page(umm virtual_address, umm remaining) {
+	return virtual_address % large_page_size == 0 && remaining >= large_page_size;
+}
+
+internal void flush_all() {
+	if (global_pages) {
+		// Toggling PGE is the only thing that drops global entries too
+		u32 cr4 = cpu::read_cr4();
+		cpu::write_cr4(cr4 & ~cpu::cr4_pge);
+		cpu::write_cr4(cr4);
+	} else {
+		cpu::write_cr3(cpu::read_cr3());
+	}
+	++stats.full_flushes;
+}
+
+// invlpg drops the entry of whatever size covers the address, so this also takes care of 4 MB pages that
+// were split.
+internal void flush(umm virtual_address, umm size) {
+	umm page_count = size / page_size;
+	if (page_count > max_page_flushes) {
+		flush_all();
+		return;
+	}
+	for (umm i = 0; i < page_count; ++i)
+		cpu::invalidate_page((void const *)(virtual_address + i * page_size));
+	stats.page_flushes += page_count;
+}
+
+internal void check_range(umm virtual_address, umm size) {
+	assert(virtual_address % page_size == 0);
+	assert(size % page_size == 0);
+}
+
+// The PAT bit is reserved without a PAT, setting it would fault.
+internal u32 supported_flags(u32 flags) {
+	assert(!(flags & ~flags_mask));
+	return write_combining ? flags : flags & ~flag_pat;
+}
+
+bool map(umm virtual_address, umm physical_address, umm size, u32 flags) {
+	if (!enabled)
+		return false;
+	check_range(virtual_address, size);
+	assert(physical_address % page_size == 0);
+	flags = supported_flags(flags);
+
+	cpu::InterruptGuard guard;
+	umm start = virtual_address;
+	for (umm remaining = size; remaining;) {
+		u32 index = virtual_address / large_page_size;
+		if (covers_large_page(virtual_address, remaining) && physical_address % large_page_size == 0) {
+			release_table(index);
+			directory[index] = large_entry(physical_address, flags);
+			virtual_address += large_page_size;
+			physical_address += large_page_size;
+			remaining -= large_page_size;
+		} else {
+			table_entry(index, virtual_address) = (u32)physical_address | flags | entry_present;
+			virtual_address += page_size;
+			physical_address += page_size;
+			remaining -= page_size;
+		}
+	}
+	flush(start, size);
+	return true;
+}
+
+bool unmap(umm virtual_address, umm size) {
+	if (!enabled)
+		return false;
+	check_range(virtual_address, size);
+
+	cpu::InterruptGuard guard;
+	umm start = virtual_address;
+	for (umm remaining = size; remaining;) {
+		u32 index = virtual_address / large_page_size;
+		if (covers_large_page(virtual_address, remaining)) {
+			release_table(index);
+			directory[index] = 0;
+			virtual_address += large_page_size;
+			remaining -= large_page_size;
+		} else {
+			// Nothing to split if the 4 MB around it is unmapped already
+			if (directory[index] & entry_present)
+				table_entry(index, virtual_address) = 0;
+			virtual_address += page_size;
+			remaining -= page_size;
+		}
+	}
+	flush(start, size);
+	return true;
+}
+
+bool protect(umm virtual_address, umm size, u32 flags) {
+	if (!enabled)
+		return false;
+	check_range(virtual_address, size);
+	flags = supported_flags(flags);
+
+	cpu::InterruptGuard guard;
+	bool all_mapped = true;
+	umm start = virtual_address;
+	for (umm remaining = size; remaining;) {
+		u32 index = virtual_address / large_page_size;
+		u32 entry = directory[index];
+		if (!(entry & entry_present)) {
+			all_mapped = false;
+			virtual_address += page_size;
+			remaining -= page_size;
+		} else if (covers_large_page(virtual_address, remaining) && (entry & entry_large)) {
+			directory[index] = large_entry(entry & large_address_mask, flags);
+			virtual_address += large_page_size;
+			remaining -= large_page_size;
+		} else {
+			u32 &page = table_entry(index, virtual_address);
+			if (page & entry_present)
+				page = (page & address_mask) | flags | entry_present;
+			else
+				all_mapped = false;
+			virtual_address += page_size;
+			remaining -= page_size;
+		}
+	}
+	flush(start, size);
+	return all_mapped;
+}
+
+bool map_write_combining(umm physical_address, umm size) {
+	return map(physical_address, physical_address, size, flag_writable | flag_write_combining | global_pages);
+}
+
+bool query(umm virtual_address, umm &physical_address, u32 &flags) {
+	u32 entry = directory[virtual_address / large_page_size];
+	if (!enabled || !(entry & entry_present))
+		return false;
+	if (entry & entry_large) {
+		physical_address = (entry & large_address_mask) | (virtual_address % large_page_size);
+		flags = flags_of_large(entry);
+		return true;
+	}
+	u32 page = ((u32 *)(entry & address_mask))[(virtual_address / page_size) % entry_count];
+	if (!(page & entry_present))
+		return false;
+	physical_address = (page & address_mask) | (virtual_address % page_size);
+	flags = page & flags_mask;
+	return true;
+}
+
+void *reserve(umm size, u32 flags) {
+	if (!enabled)
+		return 0;
+	size = (size + page_size - 1) / page_size * page_size;
+
+	cpu::InterruptGuard guard;
+	if (size > lazy_window_size - lazy_window_used || regions.count == max_region_count)
+		return 0;
+	umm start = lazy_window_start + lazy_window_used;
+	regions.add({start, size, supported_flags(flags)});
+	lazy_window_used += size;
+	return (void *)start;
+}
+
+internal u64 align_up(u64 value, umm alignment) {
+	return (value + alignment - 1) & ~(u64)(alignment - 1);
+}
+
+// The firmware's memory map, or the RAM size multiboot reports without one. False if there is neither.
+internal bool window_overlaps_memory(u64 start, u64 end, u64 &overlap_end) {
+	auto info = boot::multiboot_info();
+	if (!info)
+		return false;
+	if (info->flags & boot::multiboot_info_memory_map) {
+		bool result = false;
+		for (umm cursor = info->memory_map; cursor < info->memory_map + info->memory_map_length;) {
+			auto range = (boot::MultibootMemoryRange *)cursor;
+			u64 range_end = range->address + range->length;
+			if (range->length && range->address < end && range_end > start) {
+				overlap_end = result ? max(overlap_end, range_end) : range_end;
+				result = true;
+			}
+			cursor += range->size + sizeof(range->size);
+		}
+		return result;
+	}
+	if (info->flags & boot::multiboot_info_memory) {
+		u64 ram_end = 0x100000 + (u64)info->memory_upper * 1024;
+		if (ram_end > start) {
+			overlap_end = ram_end;
+			return true;
+		}
+	}
+	return false;
+}
+
+internal void place_window() {
+	u64 start = default_lazy_window_start;
+	u64 overlap_end;
+	while (start < lazy_window_limit && window_overlaps_memory(start, start + default_lazy_window_size, overlap_end))
+		start = align_up(overlap_end, large_page_size);
+	u64 end = min<u64>(start + default_lazy_window_size, lazy_window_limit);
+	if (start >= end) {
+		lazy_window_start = (umm)lazy_window_limit;
+		lazy_window_size = 0;
+		return;
+	}
+	lazy_window_start = (umm)start;
+	lazy_window_size = (umm)(end - start);
+}
+
+void exclude(u64 address, u64 size) {
+	if (!enabled || !size || !lazy_window_size)
+		return;
+	u64 start = lazy_window_start;
+	u64 end = start + lazy_window_size;
+	u64 first = address & ~(u64)(page_size - 1);
+	u64 last = align_up(address + size, page_size);
+	if (last <= start || first >= end)
+		return;
+
+	cpu::InterruptGuard guard;
+	// Reservations are handed out from the start, and nothing may have been handed out in the range
+	assert(first >= start + lazy_window_used || !lazy_window_used);
+	u64 new_start = start;
+	u64 new_end = end;
+	if (!lazy_window_used && end - min(last, end) > max(first, start) - start)
+		new_start = min(last, end);
+	else
+		new_end = max(first, start);
+
+	if (new_start > start)
+		map((umm)start, (umm)start, (umm)(new_start - start), flag_writable | global_pages);
+	if (new_end < end)
+		map((umm)new_end, (umm)new_end, (umm)(end - new_end), flag_writable | global_pages);
+	lazy_window_start = (umm)new_start;
+	lazy_window_size = (umm)(new_end - new_start);
+
+	debug::print("paging: "s);
+	debug::print(format_int((u32)first, 16));
+	debug::print(" is in the demand zero window, which is now "s);
+	debug::print((u32)(lazy_window_size / 1024));
+	debug::print(" KB at "s);
+	debug::print(format_int((u32)lazy_window_start, 16));
+	debug::print('\n');
+}
+
+internal Region *find_region(umm address) {
+	for (auto &region : regions) {
+		if (address - region.start < region.size)
+			return &region;
+	}
+	return 0;
+}
+
+void decommit(void *address, umm size) {
+	check_range((umm)address, size);
+	cpu::InterruptGuard guard;
+	auto region = find_region((umm)address);
+	assert(region && size <= region->size - ((umm)address - region->start));
+
+	for (umm offset = 0; offset < size; offset += page_size) {
+		umm physical_address;
+		u32 flags;
+		if (!query((umm)address + offset, physical_address, flags))
+			continue;
+		memory::free_page((void *)physical_address);
+		--stats.committed_pages;
+	}
+	unmap((umm)address, size);
+}
+
+// Maps a zeroed page if the address is in a reservation.
+internal bool commit_page(umm address) {
+	auto region = find_region(address);
+	if (!region)
+		return false;
+
+	void *page = memory::allocate_page(true);
+	map(address / page_size * page_size, (umm)page, page_size, region->flags);
+	++stats.committed_pages;
+	return true;
+}
+
+// Nothing is paged out, so every page fault other than the first touch of demand zero memory is a bug,
+// which ends user code or stops the kernel.
+internal void page_fault(Registers &registers, void *context) {
+	(void)context;
+
+	u32 error = registers.err_code;
+	if (!(error & fault_present) && commit_page(cpu::read_cr2())) {
+		u64 entry = ((u64)registers.entry_timestamp_high << 32) | registers.entry_timestamp_low;
+		++stats.demand_faults;
+		stats.demand_fault_cycles += cpu::read_timestamp() - entry;
+		return;
+	}
+
+	debug::print("page fault: "s);
+	debug::print(error & fault_write ? "write to "s : error & fault_fetch ? "fetch from "s : "read from "s);
+	debug::print(format_int(cpu::read_cr2(), 16));
+	debug::print(error & fault_present ? ", protected page"s : ", unmapped page"s);
+	debug::print(error & fault_user ? ", user mode"s : ", kernel mode"s);
+	if (error & fault_reserved)
+		debug::print(", reserved bit set"s);
+	debug::print(", eip "s);
+	debug::print(format_int(registers.eip, 16));
+	debug::print('\n');
+	if (error & fault_user)
+		user::terminate();
+	unreachable();
+}
+
+void init() {
+	if (!cpuid::info.pse) {
+		debug::print("paging: no 4 MB pages, staying off\n"s);
+		return;
+	}
+	global_pages = cpuid::info.pge ? flag_global : 0;
+
+	// Nothing maps through entry 4 yet, so there are no cache lines or TLB entries of the old type to flush
+	if (cpuid::info.pat) {
+		cpu::write_msr(msr_pat, pat_value);
+		write_combining = true;
+	}
+
+	place_window();
+	for (u32 i = 0; i < entry_count; ++i) {
+		umm address = i * large_page_size;
+		if (address - lazy_window_start < lazy_window_size)
+			directory[i] = 0;
+		else
+			directory[i] = large_entry(address, flag_writable | global_pages);
+	}
+	interrupt::set_handler(vector_page_fault, page_fault);
+
+	u32 cr4 = cpu::read_cr4() | cpu::cr4_pse;
+	if (global_pages)
+		cr4 |= cpu::cr4_pge;
+	cpu::write_cr4(cr4);
+	cpu::write_cr3((u32)directory);
+	// Write protect makes read-only pages read-only for the kernel too
+	cpu::write_cr0(cpu::read_cr0() | cpu::cr0_paging | cpu::cr0_write_protect);
+	enabled = true;
+}
+
+void print_info() {
+	if (!enabled) {
+		debug::print("paging: off\n"s);
+		return;
+	}
+	debug::print(global_pages ? "paging: 4 MB pages, global, "s : "paging: 4 MB pages, "s);
+	debug::print(write_combining ? "write combining, "s : "no PAT, "s);
+	debug::print(stats.splits);
+	debug::print(" splits, "s);
+	debug::print(stats.page_flushes);
+	debug::print(" invlpg, "s);
+	debug::print(stats.full_flushes);
+	debug::print(" full flushes\npaging: "s);
+	debug::print(stats.demand_faults);
+	debug::print(" demand zero faults, "s);
+	debug::print(stats.demand_faults ? divide(stats.demand_fault_cycles, stats.demand_faults) : 0);
+	debug::print(" cycles each, "s);
+	debug::print(stats.committed_pages);
+	debug::print(" pages committed, "s);
+	debug::print((u32)(lazy_window_used / 1024));
+	debug::print(" of "s);
+	debug::print((u32)(lazy_window_size / 1024));
+	debug::print(" KB reserved at "s);
+	debug::print(format_int((u32)lazy_window_start, 16));
+	debug::print('\n');
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "common.h"
+#include "memory.h"
+
+// 32 bit paging, one address space.
+//
+// `init` identity maps all 4 GB with 4 MB pages, RAM and devices alike: one page directory and no page
+// tables, so the whole kernel fits in a handful of TLB entries. Ranges that need to be different are
+// changed with `map`, `unmap` and `protect`, which split a 4 MB page into 4 KB ones where a range doesn't
+// cover it whole. Every change is followed by `invlpg` for what it touched, or by a full flush when that
+// would take more instructions.
+namespace paging {
+
+inline static constexpr umm page_size = memory::page_size;
+inline static constexpr umm large_page_size = 4 * 1024 * 1024;
+
+// Entry flags, the ones that mean the same thing in both sizes. Present is implied.
+inline static constexpr u32 flag_writable      = 1 << 1;
+inline static constexpr u32 flag_user          = 1 << 2;
+inline static constexpr u32 flag_write_through = 1 << 3;
+inline static constexpr u32 flag_cache_disable = 1 << 4;
+inline static constexpr u32 flag_pat           = 1 << 7; // Bit 12 in a 4 MB page, translated here
+inline static constexpr u32 flag_global        = 1 << 8;
+inline static constexpr u32 flags_mask = flag_writable | flag_user | flag_write_through | flag_cache_disable | flag_pat | flag_global;
+
+// Memory types. The PAT entry is picked by flag_pat, flag_cache_disable and flag_write_through, in that
+// order from the top bit. `init` leaves entries 0 to 3 at the reset values, write back, write through,
+// uncached minus and uncached, and puts write combining into 4, so flag_pat alone selects it.
+// Without a PAT, flag_pat is dropped and the MTRRs decide, which for device memory is uncached.
+inline static constexpr u32 flag_write_combining = flag_pat;
+inline static constexpr u32 flag_uncached = flag_cache_disable | flag_write_through;
+
+// True if flag_write_combining means write combining.
+extern bool write_combining;
+
+// Turns paging on, if the cpu has 4 MB pages. Needs cpuid and interrupt, and memory for page tables.
+void init();
+
+extern bool enabled;
+
+// Addresses and sizes are multiples of `page_size`. Wherever both addresses are 4 MB aligned and the
+// range covers all of a 4 MB page, that page is mapped whole. False if paging is off.
+bool map(umm virtual_address, umm physical_address, umm size, u32 flags);
+
+// Accessing an unmapped page is a page fault. False if paging is off.
+bool unmap(umm virtual_address, umm size);
+
+// Replaces the flags and keeps the addresses. False if paging is off or part of the range isn't mapped,
+// which is skipped.
+bool protect(umm virtual_address, umm size, u32 flags);
+
+// Identity maps device memory, like a framebuffer, write combining where the cpu can: stores are gathered
+// into bursts and may reach the device late and out of order, until cpu::store_fence.
+bool map_write_combining(umm physical_address, umm size);
+
+// False if the address isn't mapped.
+bool query(umm virtual_address, umm &physical_address, u32 &flags);
+
+// Demand zero memory: address space reserved up front, with a zeroed page allocated and mapped by the
+// page fault handler when something first touches it. For large sparse buffers that only use part of
+// what they could.
+//
+// Reservations come from a window of address space that `init` leaves unmapped. It starts out at
+// 0x80000000 with 512 MB, and is moved up past every range in the multiboot memory map, but no higher
+// than 0xc0000000, which shrinks it. Loaded by our boot sector there is no map, so RAM is assumed to end
+// below 2 GB. Whatever turns up in the window later, ACPI tables, ECAM or BARs, has to go through
+// `exclude` before it is touched, and before the first reservation.
+inline static constexpr umm default_lazy_window_start = 0x80000000;
+inline static constexpr umm default_lazy_window_size  = 512 * 1024 * 1024;
+inline static constexpr umm lazy_window_limit         = 0xc0000000;
+
+extern umm lazy_window_start;
+extern umm lazy_window_size; // Zero if nothing was left of it
+
+// Takes the range out of the demand zero window and maps it back, moving the start of the window past
+// it or cutting the window short, whichever leaves more. For device memory and firmware tables that
+// are found after `init`.
+void exclude(u64 address, u64 size);
+
+// Rounded up to whole pages, and never given back. Null if paging is off or the window is used up.
+void *reserve(umm size, u32 flags = flag_writable);
+
+// Gives the pages of a part of a reservation back to memory::free_page. It reads as zeros again.
+void decommit(void *address, umm size);
+
+struct Stats {
+	u32 splits;          // 4 MB pages turned into page tables
+	u32 page_flushes;    // invlpg
+	u32 full_flushes;
+	u32 demand_faults;
+	u64 demand_fault_cycles; // From the interrupt stub to the end of the handler
+	u32 committed_pages;     // Demand zero pages mapped right now
+};
+
+extern Stats stats;
+
+void print_info();
+
+}
@@ -0,0 +1,331 @@
+#include "pci.h"
+#include "port.h"
+#include "acpi.h"
+#include "debug.h"
+#include "paging.h"
+
+namespace pci {
+
+StaticList<Device, max_device_count> devices;
+bool ecam_enabled;
+
+internal u8 *ecam_base;
+internal u8 ecam_start_bus;
+internal u8 ecam_end_bus;
+
+struct PACKED McfgEntry {
+	u64 base;
+	u16 segment;
+	u8 start_bus;
+	u8 end_bus;
+	u32 reserved;
+};
+
+// Entries follow
+struct PACKED Mcfg {
+	acpi::TableHeader header;
+	u64 reserved;
+};
+
+internal bool use_ecam(Address address) {
+	return ecam_enabled && ecam_start_bus <= address.bus && address.bus <= ecam_end_bus;
+}
+
+internal void volatile *ecam_address(Address address, u16 offset) {
+	return ecam_base
+		+ ((address.bus - ecam_start_bus) << 20)
+		+ (address.device << 15)
+		+ (address.function << 12)
+		+ offset;
+}
+
+internal void select(Address address, u16 offset) {
+	bounds_check(offset < 256);
+	port::write_u32(port::pci_config_address,
+		(1u << 31) | (address.bus << 16) | (address.device << 11) | (address.function << 8) | (offset & 0xfc));
+}
+
+u32 read_u32(Address address, u16 offset) {
+	if (use_ecam(address))
+		return *(u32 volatile *)ecam_address(address, offset & ~3);
+	select(address, offset);
+	return port::read_u32(port::pci_config_data);
+}
+
+u16 read_u16(Address address, u16 offset) {
+	return (u16)(read_u32(address, offset) >> ((offset & 2) * 8));
+}
+
+u8 read_u8(Address address, u16 offset) {
+	return (u8)(read_u32(address, offset) >> ((offset & 3) * 8));
+}
+
+void write_u32(Address address, u16 offset, u32 value) {
+	if (use_ecam(address)) {
+		*(u32 volatile *)ecam_address(address, offset & ~3) = value;
+		return;
+	}
+	select(address, offset);
+	port::write_u32(port::pci_config_data, value);
+}
+
+void write_u16(Address address, u16 offset, u16 value) {
+	if (use_ecam(address)) {
+		*(u16 volatile *)ecam_address(address, offset & ~1) = value;
+		return;
+	}
+	select(address, offset);
+	port::write_u16(port::pci_config_data + (offset & 2), value);
+}
+
+// Only segment group 0, the one the legacy ports reach too.
+internal void init_ecam() {
+	auto mcfg = (Mcfg *)acpi::find_table("MCFG");
+	if (!mcfg)
+		return;
+	u32 entry_count = (mcfg->header.length - sizeof(Mcfg)) / sizeof(McfgEntry);
+	auto entries = (McfgEntry *)(mcfg + 1);
+	for (u32 i = 0; i < entry_count; ++i) {
+		auto &entry = entries[i];
+		if (entry.segment != 0 || entry.base > 0xffffffff)
+			continue;
+		ecam_base = (u8 *)(umm)entry.base;
+		ecam_start_bus = entry.start_bus;
+		ecam_end_bus = entry.end_bus;
+		// 4 KB of configuration space for each function, 256 functions per bus
+		paging::exclude((umm)ecam_base, (u64)(ecam_end_bus - ecam_start_bus + 1) << 20);
+		ecam_enabled = true;
+		return;
+	}
+}
+
+// Sizes a BAR by writing all ones and seeing which bits stick.
+internal u32 probe_bar(Address address, u16 offset, u32 &original) {
+	original = read_u32(address, offset);
+	write_u32(address, offset, 0xffffffff);
+	u32 mask = read_u32(address, offset);
+	write_u32(address, offset, original);
+	return mask;
+}
+
+internal void decode_bars(Device &device) {
+	auto address = device.address;
+	u8 type = device.header_type & header_type_mask;
+	u32 bar_count = type == 0 ? 6 : type == header_type_bridge ? 2 : 0;
+
+	// Decoding a half-written BAR could claim somebody else's addresses
+	u16 command = read_u16(address, config_command);
+	write_u16(address, config_command, command & ~(command_io | command_memory));
+
+	for (u32 i = 0; i < bar_count; ++i) {
+		u16 offset = config_bar_0 + i * 4;
+		u32 original;
+		u32 mask = probe_bar(address, offset, original);
+		if (!mask)
+			continue;
+
+		auto &bar = device.bars[i];
+		if (original & 1) {
+			bar.flags = bar_io;
+			bar.address = original & ~3u;
+			bar.size = (~(mask & ~3u) + 1) & 0xffff;
+			continue;
+		}
+
+		bar.address = original & ~0xfu;
+		u64 size_mask = (mask & ~0xfu) | 0xffffffff00000000;
+		if (original & (1 << 3))
+			bar.flags |= bar_prefetchable;
+		if (((original >> 1) & 3) == 2 && i + 1 < bar_count) {
+			bar.flags |= bar_64;
+			u32 original_high;
+			u32 mask_high = probe_bar(address, offset + 4, original_high);
+			bar.address |= (u64)original_high << 32;
+			size_mask = (size_mask & 0xffffffff) | ((u64)mask_high << 32);
+			++i;
+		}
+		bar.size = ~size_mask + 1;
+		paging::exclude(bar.address, bar.size);
+	}
+
+	write_u16(address, config_command, command);
+}
+
+internal void parse_capabilities(Device &device) {
+	auto address = device.address;
+	if (!(read_u16(address, config_status) & status_capabilities))
+		return;
+
+	u8 offset = read_u8(address, config_capabilities) & 0xfc;
+	// The list is at most 48 entries long in 192 bytes, this protects from a looping one.
+	for (u32 i = 0; offset && i < 48; ++i) {
+		switch (read_u8(address, offset)) {
+			case capability_msi: {
+				device.msi_offset = offset;
+				break;
+			}
+			case capability_msix: {
+				device.msix_offset = offset;
+				u16 control = read_u16(address, offset + 2);
+				u32 table = read_u32(address, offset + 4);
+				u32 pending = read_u32(address, offset + 8);
+				device.msix.table_size = (control & 0x7ff) + 1;
+				device.msix.table_bar = table & 7;
+				device.msix.table_offset = table & ~7u;
+				device.msix.pending_bar = pending & 7;
+				device.msix.pending_offset = pending & ~7u;
+				break;
+			}
+			case capability_express: {
+				device.express_offset = offset;
+				break;
+			}
+		}
+		offset = read_u8(address, offset + 1) & 0xfc;
+	}
+}
+
+internal void scan_bus(u8 bus);
+
+internal void scan_function(Address address) {
+	if (devices.count == devices.capacity) {
+		debug::print("pci: device table is full\n"s);
+		return;
+	}
+
+	Device device = {};
+	device.address = address;
+	device.vendor_id = read_u16(address, config_vendor_id);
+	device.device_id = read_u16(address, config_device_id);
+	device.revision = read_u8(address, config_revision);
+	device.prog_if = read_u8(address, config_prog_if);
+	device.subclass = read_u8(address, config_subclass);
+	device.class_code = read_u8(address, config_class);
+	device.header_type = read_u8(address, config_header_type);
+	device.interrupt_line = read_u8(address, config_interrupt_line);
+	device.interrupt_pin = read_u8(address, config_interrupt_pin);
+	decode_bars(device);
+	parse_capabilities(device);
+	devices.add(device);
+
+	if (device.class_code == class_bridge && device.subclass == subclass_pci_bridge) {
+		u8 secondary = read_u8(address, config_secondary_bus);
+		// An unconfigured bridge would send us around in circles
+		if (secondary > address.bus)
+			scan_bus(secondary);
+	}
+}
+
+internal void scan_device(u8 bus, u8 device) {
+	Address address = {bus, device, 0};
+	if (read_u16(address, config_vendor_id) == 0xffff)
+		return;
+	scan_function(address);
+
+	if (!(read_u8(address, config_header_type) & header_type_multifunction))
+		return;
+	for (address.function = 1; address.function < 8; ++address.function) {
+		if (read_u16(address, config_vendor_id) != 0xffff)
+			scan_function(address);
+	}
+}
+
+internal void scan_bus(u8 bus) {
+	for (u8 device = 0; device < 32; ++device)
+		scan_device(bus, device);
+}
+
+void init() {
+	init_ecam();
+
+	// With several host bridges, function N of the root one is responsible for bus N
+	Address root = {0, 0, 0};
+	if (read_u8(root, config_header_type) & header_type_multifunction) {
+		for (u8 function = 0; function < 8; ++function) {
+			root.function = function;
+			if (read_u16(root, config_vendor_id) != 0xffff)
+				scan_bus(function);
+		}
+	} else {
+		scan_bus(0);
+	}
+}
+
+Device *find(Match const &match, Device *after) {
+	for (auto device = after ? after + 1 : devices.begin(); device < devices.end(); ++device) {
+		if ((match.vendor_id  == any || match.vendor_id  == device->vendor_id)
+		 && (match.device_id  == any || match.device_id  == device->device_id)
+		 && (match.class_code == any || match.class_code == device->class_code)
+		 && (match.subclass   == any || match.subclass   == device->subclass)
+		 && (match.prog_if    == any || match.prog_if    == device->prog_if))
+			return device;
+	}
+	return 0;
+}
+
+void enable(Device &device, bool bus_master) {
+	u16 command = read_u16(device.address, config_command) | command_io | command_memory;
+	if (bus_master)
+		command |= command_bus_master;
+	// `quiesce` may have left it set
+	command &= ~command_interrupt_disable;
+	write_u16(device.address, config_command, command);
+}
+
+void quiesce() {
+	for (auto &device : devices) {
+		// A bridge without bus mastering stops forwarding DMA from behind it, and no driver turns it back on
+		if (device.class_code == class_bridge)
+			continue;
+		u16 command = read_u16(device.address, config_command);
+		command = (command & ~command_bus_master) | command_interrupt_disable;
+		write_u16(device.address, config_command, command);
+	}
+}
+
+void print_devices() {
+	debug::print("pci: "s);
+	debug::print(devices.count);
+	debug::print(ecam_enabled ? " devices, config space through ECAM\n"s : " devices, config space through ports\n"s);
+	for (auto &device : devices) {
+		debug::print("  "s);
+		debug::print(format_int(device.address.bus, 16));
+		debug::print(':');
+		debug::print(format_int(device.address.device, 16));
+		debug::print('.');
+		debug::print(format_int(device.address.function, 16));
+		debug::print(' ');
+		debug::print(format_int(device.vendor_id, 16));
+		debug::print(':');
+		debug::print(format_int(device.device_id, 16));
+		debug::print(" class "s);
+		debug::print(format_int(device.class_code, 16));
+		debug::print('.');
+		debug::print(format_int(device.subclass, 16));
+		debug::print('.');
+		debug::print(format_int(device.prog_if, 16));
+		for (u32 i = 0; i < 6; ++i) {
+			auto &bar = device.bars[i];
+			if (!bar.size)
+				continue;
+			debug::print(" bar"s);
+			debug::print(i);
+			debug::print(bar.flags & bar_io ? " io "s : " mem "s);
+			debug::print(format_int((u32)bar.address, 16));
+			debug::print('+');
+			debug::print(format_int((u32)bar.size, 16));
+		}
+		if (device.msi_offset)
+			debug::print(" msi"s);
+		if (device.msix_offset) {
+			debug::print(" msix("s);
+			debug::print(device.msix.table_size);
+			debug::print(')');
+		}
+		if (device.express_offset)
+			debug::print(" pcie"s);
+		debug::print('\n');
+	}
+}
+
+}
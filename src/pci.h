@@ -0,0 +1,135 @@
+#pragma once
+#include "common.h"
+
+// PCI configuration space and the table of devices found at boot.
+//
+// Configuration space is accessed through memory mapped ECAM if ACPI has an MCFG table (qemu's q35),
+// through the legacy 0xcf8 / 0xcfc ports otherwise. `init` walks the buses once and records every
+// function in `devices`, with its BARs and capabilities decoded. Drivers look themselves up in that table.
+namespace pci {
+
+struct Address {
+	u8 bus;
+	u8 device;
+	u8 function;
+};
+
+// Configuration space offsets
+inline static constexpr u16 config_vendor_id       = 0x00;
+inline static constexpr u16 config_device_id       = 0x02;
+inline static constexpr u16 config_command         = 0x04;
+inline static constexpr u16 config_status          = 0x06;
+inline static constexpr u16 config_revision        = 0x08;
+inline static constexpr u16 config_prog_if         = 0x09;
+inline static constexpr u16 config_subclass        = 0x0a;
+inline static constexpr u16 config_class           = 0x0b;
+inline static constexpr u16 config_header_type     = 0x0e;
+inline static constexpr u16 config_bar_0           = 0x10;
+inline static constexpr u16 config_secondary_bus   = 0x19; // Bridges only
+inline static constexpr u16 config_capabilities    = 0x34;
+inline static constexpr u16 config_interrupt_line  = 0x3c;
+inline static constexpr u16 config_interrupt_pin   = 0x3d;
+
+inline static constexpr u16 command_io         = 1 << 0;
+inline static constexpr u16 command_memory     = 1 << 1;
+inline static constexpr u16 command_bus_master = 1 << 2;
+inline static constexpr u16 command_interrupt_disable = 1 << 10;
+
+inline static constexpr u16 status_capabilities = 1 << 4;
+
+inline static constexpr u8 header_type_mask           = 0x7f;
+inline static constexpr u8 header_type_bridge         = 0x01;
+inline static constexpr u8 header_type_multifunction  = 0x80;
+
+inline static constexpr u8 class_mass_storage = 0x01;
+inline static constexpr u8 class_network      = 0x02;
+inline static constexpr u8 class_bridge       = 0x06;
+
+inline static constexpr u8 subclass_ide            = 0x01;
+inline static constexpr u8 subclass_pci_bridge     = 0x04;
+
+inline static constexpr u8 capability_msi     = 0x05;
+inline static constexpr u8 capability_express = 0x10;
+inline static constexpr u8 capability_msix    = 0x11;
+
+// Offsets can go up to 4 KB with ECAM and up to 256 bytes with the legacy ports.
+u32 read_u32(Address address, u16 offset);
+u16 read_u16(Address address, u16 offset);
+u8  read_u8 (Address address, u16 offset);
+void write_u32(Address address, u16 offset, u32 value);
+void write_u16(Address address, u16 offset, u16 value);
+
+inline static constexpr u8 bar_io           = 1 << 0;
+inline static constexpr u8 bar_64           = 1 << 1;
+inline static constexpr u8 bar_prefetchable = 1 << 2;
+
+struct Bar {
+	u64 address; // Zero if the BAR is not implemented
+	u64 size;
+	u8 flags;
+};
+
+struct Msix {
+	u16 table_size;
+	u8 table_bar;
+	u32 table_offset;
+	u8 pending_bar;
+	u32 pending_offset;
+};
+
+struct Device {
+	Address address;
+	u16 vendor_id;
+	u16 device_id;
+	u8 class_code;
+	u8 subclass;
+	u8 prog_if;
+	u8 revision;
+	u8 header_type;
+	u8 interrupt_line;
+	u8 interrupt_pin;
+	Bar bars[6]; // Only the first two for bridges. The upper half of a 64 bit BAR is left empty.
+
+	// Configuration space offsets of capabilities, zero if the device does not have them
+	u8 msi_offset;
+	u8 msix_offset;
+	u8 express_offset;
+	Msix msix;
+};
+
+inline static constexpr u32 max_device_count = 64;
+extern StaticList<Device, max_device_count> devices;
+
+// Whether config space goes through ECAM
+extern bool ecam_enabled;
+
+void init();
+
+// Matches everything in fields set to `any`.
+inline static constexpr u16 any = 0xffff;
+
+struct Match {
+	u16 vendor_id = any;
+	u16 device_id = any;
+	u16 class_code = any;
+	u16 subclass = any;
+	u16 prog_if = any;
+};
+
+// The first device after `after` that matches, or null. Pass the previous result to get the next one.
+Device *find(Match const &match, Device *after = 0);
+
+inline u16 io_bar(Device &device, u32 index) {
+	return (u16)device.bars[index].address;
+}
+
+// Turns on I/O and memory decoding and, if asked, bus mastering. Lets the device raise INTx again.
+void enable(Device &device, bool bus_master);
+
+// Stops every device that isn't a bridge from doing DMA or raising INTx, so nothing writes to memory or
+// interrupts while the kernel starts over. Drivers turn both back on with `enable`.
+void quiesce();
+
+void print_devices();
+
+}
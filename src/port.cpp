@@ -35,4 +35,22 @@ void write_u16(u16 port, u16 data) {
 	asm volatile("out %%ax, %%dx" : : "a" (data), "d" (port));
 }
 
+u32 read_u32(u16 port) {
+	u32 result;
+	asm volatile("in %%dx, %%eax" : "=a" (result) : "d" (port));
+	return result;
+}
+
+void write_u32(u16 port, u32 data) {
+	asm volatile("out %%eax, %%dx" : : "a" (data), "d" (port));
+}
+
+void read_u16s(u16 port, void *data, umm count) {
+	asm volatile("rep insw" : "+D" (data), "+c" (count) : "d" (port) : "memory");
+}
+
+void write_u16s(u16 port, void const *data, umm count) {
+	asm volatile("rep outsw" : "+S" (data), "+c" (count) : "d" (port) : "memory");
+}
+
 }
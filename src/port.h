@@ -6,6 +6,12 @@ namespace port {
 inline static constexpr u16 vga_control = 0x3d4;
 inline static constexpr u16 vga_data    = 0x3d5;
 inline static constexpr u16 com1        = 0x3f8;
+inline static constexpr u16 ps2_data    = 0x60;
+inline static constexpr u16 ps2_command = 0x64; // Status register when read
+inline static constexpr u16 pci_config_address = 0xcf8;
+inline static constexpr u16 pci_config_data    = 0xcfc;
+inline static constexpr u16 reset_control      = 0xcf9; // Chipset reset, Intel and most others
+inline static constexpr u16 qemu_debug_exit    = 0xf4;  // -device isa-debug-exit,iobase=0xf4,iosize=0x04
 inline static constexpr u8 pic_master_command   = 0x20;
 inline static constexpr u8 pic_master_data      = 0x21;
 inline static constexpr u8 pic_slave_command    = 0xa0;
@@ -16,5 +22,11 @@ u8 read_u8(u16 port);
 void write_u8(u16 port, u8 data);
 u16 read_u16(u16 port);
 void write_u16(u16 port, u16 data);
+u32 read_u32(u16 port);
+void write_u32(u16 port, u32 data);
+
+// `rep insw` / `rep outsw`: moves `count` words between a port and memory in one instruction.
+void read_u16s(u16 port, void *data, umm count);
+void write_u16s(u16 port, void const *data, umm count);
 
 }
@@ -0,0 +1,141 @@
+#include "power.h"
+#include "acpi.h"
+#include "boot.h"
+#include "cpu.h"
+#include "debug.h"
+#include "pci.h"
+#include "port.h"
+
+namespace power {
+
+inline static constexpr u8 ps2_status_input_full = 1 << 1;
+inline static constexpr u8 ps2_command_pulse_reset = 0xfe;
+
+inline static constexpr u8 reset_control_system = 1 << 1; // Full reset instead of just the cpu
+inline static constexpr u8 reset_control_cpu    = 1 << 2; // Does it, on the 0 -> 1 edge
+
+internal constexpr Array<Span<ascii>, ResetMethod_count> method_names = [] {
+	Array<Span<ascii>, ResetMethod_count> result = {};
+	result.data[ResetMethod_acpi]                = "acpi"s;
+	result.data[ResetMethod_keyboard_controller] = "keyboard_controller"s;
+	result.data[ResetMethod_reset_control]       = "reset_control"s;
+	result.data[ResetMethod_triple_fault]        = "triple_fault"s;
+	return result;
+}();
+
+internal void wait_cycles(u64 cycles) {
+	u64 start = cpu::read_timestamp();
+	while (cpu::read_timestamp() - start < cycles)
+		cpu::pause();
+}
+
+internal bool reset_keyboard_controller() {
+	// The controller ignores commands while its input buffer is full
+	for (u32 i = 0; port::read_u8(port::ps2_command) & ps2_status_input_full; ++i) {
+		if (i == 100'000)
+			return false;
+		cpu::pause();
+	}
+	port::write_u8(port::ps2_command, ps2_command_pulse_reset);
+	return true;
+}
+
+internal void reset_through_control() {
+	port::write_u8(port::reset_control, reset_control_system);
+	port::write_u8(port::reset_control, reset_control_system | reset_control_cpu);
+}
+
+internal void triple_fault() {
+	struct PACKED {
+		u16 limit;
+		u32 base;
+	} empty = {};
+	// Without an IDT neither the breakpoint nor the double fault after it can be delivered
+	asm volatile("lidt %0\n\tint3" : : "m" (empty) : "memory");
+}
+
+// False if the method isn't there at all, so there's no point in waiting for it.
+internal bool try_reset(ResetMethod method) {
+	switch (method) {
+		case ResetMethod_acpi:                return acpi::reset();
+		case ResetMethod_keyboard_controller: return reset_keyboard_controller();
+		case ResetMethod_reset_control:       reset_through_control(); return true;
+		case ResetMethod_triple_fault:        triple_fault(); return true;
+		case ResetMethod_count:               break;
+	}
+	return false;
+}
+
+void reset(Span<ResetMethod> order) {
+	cpu::disable_interrupts();
+	for (auto method : order) {
+		if (method >= ResetMethod_count)
+			continue;
+		debug::print("power: reset through "s);
+		debug::print(method_names[method]);
+		debug::print('\n');
+		if (try_reset(method))
+			wait_cycles(attempt_cycles);
+	}
+	debug::print("power: reset failed, halting\n"s);
+	while (1)
+		cpu::halt();
+}
+
+void exit_qemu(u8 code) {
+	port::write_u32(port::qemu_debug_exit, code);
+}
+
+void shutdown() {
+	debug::print("power: shutting down\n"s);
+	if (acpi::power_off())
+		wait_cycles(attempt_cycles);
+	exit_qemu(0);
+
+	cpu::disable_interrupts();
+	debug::print("power: shutdown failed, halting\n"s);
+	while (1)
+		cpu::halt();
+}
+
+void warm_restart() {
+	cpu::disable_interrupts();
+	pci::quiesce();
+	boot::warm_restart();
+}
+
+PERSISTENT internal u32 loop_count;
+PERSISTENT internal u32 loop_remaining;
+PERSISTENT internal u64 loop_start;
+PERSISTENT internal u64 loop_timeline_total;
+
+void start_restart_loop(u32 count) {
+	assert(count != 0);
+	loop_count = count;
+	loop_remaining = count;
+	loop_timeline_total = 0;
+	loop_start = cpu::read_timestamp();
+	--loop_remaining;
+	warm_restart();
+}
+
+void continue_restart_loop() {
+	if (!loop_count)
+		return;
+	loop_timeline_total += boot::timeline_total();
+	if (loop_remaining) {
+		--loop_remaining;
+		warm_restart();
+	}
+
+	debug::print("power: "s);
+	debug::print(loop_count);
+	debug::print(" warm restarts, "s);
+	debug::print(divide(cpu::read_timestamp() - loop_start, loop_count));
+	debug::print(" cycles each, "s);
+	debug::print(divide(loop_timeline_total, loop_count));
+	debug::print(" of them from the request to initialized\n"s);
+	loop_count = 0;
+}
+
+}
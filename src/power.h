@@ -0,0 +1,48 @@
+#pragma once
+#include "common.h"
+
+// Resetting, shutting down, and starting the kernel over.
+//
+// A reset tries the methods in the order it is given, and gives each one `attempt_cycles` to take effect
+// before moving on to the next. A warm restart doesn't reset anything: it stops the devices and runs
+// kernel_main again from the start, which skips the firmware and the disk load, most of a boot under qemu.
+namespace power {
+
+enum ResetMethod : u8 {
+	ResetMethod_acpi,                // The FADT reset register
+	ResetMethod_keyboard_controller, // Pulses the reset line through the 8042
+	ResetMethod_reset_control,       // Port 0xcf9
+	ResetMethod_triple_fault,        // Needs nothing from the chipset
+	ResetMethod_count,
+};
+
+// What the firmware says first, then what works on most PCs, then what works everywhere.
+inline static constexpr ResetMethod default_reset_order[] = {
+	ResetMethod_acpi,
+	ResetMethod_keyboard_controller,
+	ResetMethod_reset_control,
+	ResetMethod_triple_fault,
+};
+
+// About 50 ms at 4 GHz. Every method resets right away under qemu.
+inline static constexpr u64 attempt_cycles = 200'000'000;
+
+[[noreturn]] void reset(Span<ResetMethod> order = as_span(default_reset_order));
+
+// ACPI S5, then qemu's isa-debug-exit. Halts if neither works.
+[[noreturn]] void shutdown();
+
+// With an isa-debug-exit device qemu exits with status `(code << 1) | 1`. Returns if there is none.
+void exit_qemu(u8 code);
+
+// Stops DMA and interrupts from every PCI device and runs kernel_main again, see boot::warm_restart.
+[[noreturn]] void warm_restart();
+
+// Warm restarts `count` times in a row and prints how long a restart took on average, from the request
+// to kernel_main being done with initialization.
+[[noreturn]] void start_restart_loop(u32 count);
+
+// Called when kernel_main is done with initialization. Restarts again if a loop is running.
+void continue_restart_loop();
+
+}
@@ -0,0 +1,202 @@
+#include "routines.h"
+#include "cpuid.h"
+#include "debug.h"
+#include "fpu.h"
+
+// Copying goes forward, except when the destination overlaps the end of the source.
+internal bool copy_backward(void *destination, void const *source, umm byte_count) {
+	return (umm)destination - (umm)source < byte_count;
+}
+
+internal void copy_memory_backward(void *destination, void const *source, umm byte_count) {
+	auto destination_last = (u8 *)destination + byte_count - 1;
+	auto source_last = (u8 const *)source + byte_count - 1;
+	asm volatile("std\n\trep movsb\n\tcld" : "+D" (destination_last), "+S" (source_last), "+c" (byte_count) : : "memory");
+}
+
+internal void copy_memory_movsd(void *destination, void const *source, umm byte_count) {
+	if (destination == source)
+		return;
+	if (copy_backward(destination, source, byte_count)) {
+		copy_memory_backward(destination, source, byte_count);
+		return;
+	}
+	umm dword_count = byte_count / 4;
+	umm tail_count = byte_count % 4;
+	asm volatile("rep movsl\n\tmov %3, %%ecx\n\trep movsb"
+		: "+D" (destination), "+S" (source), "+c" (dword_count)
+		: "r" (tail_count)
+		: "memory");
+}
+
+internal void copy_memory_movsb(void *destination, void const *source, umm byte_count) {
+	if (destination == source)
+		return;
+	if (copy_backward(destination, source, byte_count)) {
+		copy_memory_backward(destination, source, byte_count);
+		return;
+	}
+	asm volatile("rep movsb" : "+D" (destination), "+S" (source), "+c" (byte_count) : : "memory");
+}
+
+internal void set_memory_stosd(void *destination, u8 value, umm byte_count) {
+	umm dword_count = byte_count / 4;
+	umm tail_count = byte_count % 4;
+	asm volatile("rep stosl\n\tmov %3, %%ecx\n\trep stosb"
+		: "+D" (destination), "+c" (dword_count)
+		: "a" (value * 0x01010101u), "r" (tail_count)
+		: "memory");
+}
+
+internal void set_memory_stosb(void *destination, u8 value, umm byte_count) {
+	asm volatile("rep stosb" : "+D" (destination), "+c" (byte_count) : "a" (value) : "memory");
+}
+
+void (*copy_memory_function)(void *destination, void const *source, umm byte_count) = copy_memory_movsd;
+void (*set_memory_function)(void *destination, u8 value, umm byte_count) = set_memory_stosd;
+
+namespace routines {
+
+// Below this, a kernel fpu section costs more than SSE saves
+inline static constexpr umm sse_threshold = 256;
+
+internal u32 sum_bytes_plain(void const *data, umm count) {
+	u32 sum = 0;
+	for (umm i = 0; i < count; ++i)
+		sum += ((u8 const *)data)[i];
+	return sum;
+}
+
+// psadbw against zero adds up 8 bytes into each half of the register.
+[[gnu::target("sse2"), gnu::noinline]] internal u32 sum_bytes_sse2_body(u8 const *data, umm block_count) {
+	using v2di = long long __attribute__((vector_size(16)));
+	using v16qi = char __attribute__((vector_size(16)));
+	v2di sums = {0, 0};
+	v16qi zero = {};
+	for (umm i = 0; i < block_count; ++i) {
+		v16qi block;
+		__builtin_memcpy(&block, data + i * 16, 16);
+		sums += (v2di)__builtin_ia32_psadbw128(block, zero);
+	}
+	return (u32)(sums[0] + sums[1]);
+}
+
+internal u32 sum_bytes_sse2(void const *data, umm count) {
+	if (count < sse_threshold)
+		return sum_bytes_plain(data, count);
+	umm block_count = count / 16;
+	u32 sum;
+	{
+		fpu::KernelGuard guard;
+		sum = sum_bytes_sse2_body((u8 const *)data, block_count);
+	}
+	return sum + sum_bytes_plain((u8 const *)data + block_count * 16, count % 16);
+}
+
+// Reversed 0x1edc6f41
+inline static constexpr u32 crc32c_polynomial = 0x82f63b78;
+
+internal constexpr Array<u32, 256> crc32c_table = [] {
+	Array<u32, 256> result = {};
+	for (u32 i = 0; i < 256; ++i) {
+		u32 crc = i;
+		for (u32 bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1) ^ (crc & 1 ? crc32c_polynomial : 0);
+		result.data[i] = crc;
+	}
+	return result;
+}();
+
+internal u32 crc32c_table_lookup(u32 crc, void const *data, umm count) {
+	crc = ~crc;
+	for (umm i = 0; i < count; ++i)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ ((u8 const *)data)[i]) & 0xff];
+	return ~crc;
+}
+
+internal u32 crc32c_sse4_2(u32 crc, void const *data, umm count) {
+	auto cursor = (u8 const *)data;
+	crc = ~crc;
+	for (; count >= 4; count -= 4, cursor += 4) {
+		u32 dword;
+		copy_memory_by_1_byte(&dword, cursor, 4);
+		asm("crc32l %1, %0" : "+r" (crc) : "rm" (dword));
+	}
+	for (; count; --count, ++cursor)
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*cursor));
+	return ~crc;
+}
+
+internal void zero_uncached_set_memory(void *data, umm byte_count) {
+	set_memory(data, 0, byte_count);
+}
+
+// movnti stores from general purpose registers, so unlike movntdq it needs no fpu section.
+internal void zero_uncached_movnti(void *data, umm byte_count) {
+	assert(byte_count % 16 == 0);
+	auto cursor = (u32 *)data;
+	for (umm i = 0; i < byte_count / 16; ++i, cursor += 4)
+		asm volatile("movnti %1, (%0)\n\tmovnti %1, 4(%0)\n\tmovnti %1, 8(%0)\n\tmovnti %1, 12(%0)" : : "r" (cursor), "r" (0) : "memory");
+	// Non-temporal stores are weakly ordered
+	asm volatile("sfence" : : : "memory");
+}
+
+u32 (*sum_bytes)(void const *data, umm count) = sum_bytes_plain;
+u32 (*crc32c)(u32 crc, void const *data, umm count) = crc32c_table_lookup;
+void (*zero_uncached)(void *data, umm byte_count) = zero_uncached_set_memory;
+
+template <class Function>
+struct Variant {
+	Span<ascii> name;
+	Function *function;
+	bool cpuid::Info::*feature; // Null if every cpu has it, which the last variant has to be
+};
+
+// Best variant first
+template <class Function, umm count>
+internal void bind(Span<ascii> routine, Function *&pointer, Variant<Function> const (&variants)[count]) {
+	for (auto &variant : variants) {
+		if (variant.feature && !(cpuid::info.*variant.feature))
+			continue;
+		pointer = variant.function;
+		debug::print("  "s);
+		debug::print(routine);
+		debug::print(": "s);
+		debug::print(variant.name);
+		debug::print('\n');
+		return;
+	}
+	unreachable();
+}
+
+using CopyMemory = void(void *destination, void const *source, umm byte_count);
+using SetMemory = void(void *destination, u8 value, umm byte_count);
+using SumBytes = u32(void const *data, umm count);
+using Crc32c = u32(u32 crc, void const *data, umm count);
+using ZeroUncached = void(void *data, umm byte_count);
+
+void init() {
+	debug::print("routines:\n"s);
+	bind<CopyMemory>("copy_memory"s, copy_memory_function, {
+		{"rep movsb"s, copy_memory_movsb, &cpuid::Info::erms},
+		{"rep movsd"s, copy_memory_movsd, 0},
+	});
+	bind<SetMemory>("set_memory"s, set_memory_function, {
+		{"rep stosb"s, set_memory_stosb, &cpuid::Info::erms},
+		{"rep stosd"s, set_memory_stosd, 0},
+	});
+	bind<SumBytes>("sum_bytes"s, sum_bytes, {
+		{"sse2"s, sum_bytes_sse2, &cpuid::Info::sse2},
+		{"plain"s, sum_bytes_plain, 0},
+	});
+	bind<Crc32c>("crc32c"s, crc32c, {
+		{"sse4.2"s, crc32c_sse4_2, &cpuid::Info::sse4_2},
+		{"table"s, crc32c_table_lookup, 0},
+	});
+	bind<ZeroUncached>("zero_uncached"s, zero_uncached, {
+		{"movnti"s, zero_uncached_movnti, &cpuid::Info::sse2},
+		{"set_memory"s, zero_uncached_set_memory, 0},
+	});
+}
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "common.h"
+
+// Hot routines with several implementations, bound to the best one for the cpu once at boot.
+//
+// Like ifuncs: callers go through a function pointer, which `init` points at the first variant the cpu
+// has. Before that they run the variant every i386 has, so early boot code can use them too.
+// copy_memory and set_memory in common.h are two of them.
+namespace routines {
+
+// The sum of the bytes, e.g. for ACPI tables, which add up to zero modulo 256.
+extern u32 (*sum_bytes)(void const *data, umm count);
+
+// CRC-32C (Castagnoli), the one the sse4.2 crc32 instruction computes.
+// Start with 0 and pass the previous result to continue over more data.
+extern u32 (*crc32c)(u32 crc, void const *data, umm count);
+
+// Zeroes memory that isn't about to be used, with stores that go around the caches where the cpu has
+// them, so it doesn't push out what is. `byte_count` is a multiple of 16.
+extern void (*zero_uncached)(void *data, umm byte_count);
+
+// Needs cpuid and fpu. Prints which variants it picked.
+void init();
+
+}
@@ -0,0 +1,74 @@
+#include "sync.h"
+
+namespace sync {
+
+void wake_all(WaitQueue &queue) {
+	cpu::InterruptGuard guard;
+	queue.generation = queue.generation + 1;
+}
+
+void wait(WaitQueue &queue) {
+	u32 seen = queue.generation;
+	wait(queue, [&] { return queue.generation != seen; });
+}
+
+bool try_lock(Mutex &mutex) {
+	return __atomic_exchange_n(&mutex.locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+void lock(Mutex &mutex) {
+	for (u32 i = 0; i < mutex_spin_count; ++i) {
+		if (!mutex.locked && try_lock(mutex))
+			return;
+		cpu::pause();
+	}
+	wait(mutex.waiters, [&] { return try_lock(mutex); });
+}
+
+void unlock(Mutex &mutex) {
+	__atomic_store_n(&mutex.locked, 0, __ATOMIC_RELEASE);
+	if (mutex.waiters.waiter_count)
+		wake_all(mutex.waiters);
+}
+
+bool try_acquire(Semaphore &semaphore) {
+	cpu::InterruptGuard guard;
+	if (semaphore.count > 0) {
+		semaphore.count = semaphore.count - 1;
+		return true;
+	}
+	return false;
+}
+
+void acquire(Semaphore &semaphore) {
+	wait(semaphore.waiters, [&] {
+		if (semaphore.count > 0) {
+			semaphore.count = semaphore.count - 1;
+			return true;
+		}
+		return false;
+	});
+}
+
+void release(Semaphore &semaphore, s32 count) {
+	cpu::InterruptGuard guard;
+	semaphore.count = semaphore.count + count;
+	wake_all(semaphore.waiters);
+}
+
+void wait(ConditionVariable &condition, Mutex &mutex) {
+	u32 seen = condition.waiters.generation;
+	unlock(mutex);
+	wait(condition.waiters, [&] { return condition.waiters.generation != seen; });
+	lock(mutex);
+}
+
+void signal(ConditionVariable &condition) {
+	wake_all(condition.waiters);
+}
+
+void broadcast(ConditionVariable &condition) {
+	wake_all(condition.waiters);
+}
+
+}
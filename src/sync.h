@@ -0,0 +1,68 @@
+#pragma once
+#include "common.h"
+#include "cpu.h"
+#include "idle.h"
+
+// Blocking synchronization.
+//
+// There is no scheduler yet, so "sleeping" means idle::sleep: deferred work, or halting the cpu until
+// the next interrupt. Every wait re-checks its condition with interrupts disabled and the halt is
+// `sti; hlt` or `sti; mwait`, so a wake-up coming from an irq handler between the two can't be lost.
+// None of the waiting functions may be called from an irq handler; waking functions may.
+namespace sync {
+
+struct WaitQueue {
+	u32 volatile generation = 0;
+	u32 volatile waiter_count = 0;
+};
+
+void wake_all(WaitQueue &queue);
+
+// Sleeps until `condition` returns true. `condition` is evaluated with interrupts disabled.
+template <class Condition>
+void wait(WaitQueue &queue, Condition &&condition) {
+	assert(cpu::interrupts_enabled());
+	cpu::disable_interrupts();
+	while (!condition()) {
+		queue.waiter_count = queue.waiter_count + 1;
+		idle::sleep();
+		queue.waiter_count = queue.waiter_count - 1;
+	}
+	cpu::enable_interrupts();
+}
+
+// Sleeps until somebody calls `wake_all` on the queue.
+void wait(WaitQueue &queue);
+
+inline static constexpr u32 mutex_spin_count = 64;
+
+// Spins for `mutex_spin_count` iterations, then sleeps.
+struct Mutex {
+	u32 volatile locked = 0;
+	WaitQueue waiters;
+};
+
+bool try_lock(Mutex &mutex);
+void lock(Mutex &mutex);
+void unlock(Mutex &mutex);
+
+struct Semaphore {
+	s32 volatile count = 0;
+	WaitQueue waiters;
+};
+
+bool try_acquire(Semaphore &semaphore);
+void acquire(Semaphore &semaphore);
+void release(Semaphore &semaphore, s32 count = 1);
+
+struct ConditionVariable {
+	WaitQueue waiters;
+};
+
+// `mutex` must be locked. It is unlocked while sleeping and locked again before returning.
+void wait(ConditionVariable &condition, Mutex &mutex);
+// There is only one thread of execution, so signal and broadcast are the same thing for now.
+void signal(ConditionVariable &condition);
+void broadcast(ConditionVariable &condition);
+
+}
@@ -0,0 +1,49 @@
+#include "timer.h"
+#include "port.h"
+#include "interrupt.h"
+#include "idle.h"
+
+namespace timer {
+
+u32 volatile tick = 0;
+u32 frequency = 0;
+sync::WaitQueue tick_queue;
+
+internal void callback(Registers &registers, void *context) {
+	(void)registers;
+	(void)context;
+
+	tick = tick + 1;
+	if (tick % frequency == 0)
+		idle::sample_load();
+	sync::wake_all(tick_queue);
+}
+
+void init(u32 frequency) {
+	timer::frequency = frequency;
+
+	/* Install the function we just wrote */
+	interrupt::set_handler(interrupt::irq_0, callback);
+
+	/* Get the PIT value: hardware clock at 1193180 Hz */
+	u32 divisor = 1193180 / frequency;
+	u8 low  = (u8)(divisor & 0xFF);
+	u8 high = (u8)((divisor >> 8) & 0xFF);
+	/* Send the command */
+	port::write_u8(0x43, 0x36); /* Command port */
+	port::write_u8(0x40, low);
+	port::write_u8(0x40, high);
+}
+
+u32 milliseconds_to_ticks(u32 milliseconds) {
+	return (milliseconds * frequency + 999) / 1000;
+}
+
+void sleep(u32 milliseconds) {
+	assert(frequency != 0);
+	u32 start = tick;
+	u32 duration = milliseconds_to_ticks(milliseconds);
+	sync::wait(tick_queue, [&] { return tick - start >= duration; });
+}
+
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "common.h"
+#include "sync.h"
+
+namespace timer {
+
+inline static constexpr u32 default_frequency = 100;
+
+extern u32 volatile tick;
+extern u32 frequency;
+
+// Woken up on every tick.
+extern sync::WaitQueue tick_queue;
+
+void init(u32 frequency);
+
+u32 milliseconds_to_ticks(u32 milliseconds);
+
+// Sleeps at least `milliseconds`, rounded up to whole ticks.
+void sleep(u32 milliseconds);
+
+}
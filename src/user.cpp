@@ -0,0 +1,252 @@
+#include "user.h"
+#include "cpuid.h"
+#include "debug.h"
+#include "fpu.h"
+#include "memory.h"
+#include "paging.h"
+
+extern "C" u32 user_enter(u32 eip, u32 esp, u32 *kernel_esp);
+extern "C" [[noreturn]] void user_exit(u32 kernel_esp, u32 code);
+extern "C" u8 sysenter_entry[];
+
+// Defined in entry.asm and script.ld
+extern "C" u64 gdt[];
+extern "C" u8 kernel_user_start[];
+extern "C" u8 kernel_user_end[];
+
+namespace user {
+
+inline static constexpr u16 kernel_code_segment = 0x08;
+inline static constexpr u16 kernel_data_segment = 0x10;
+inline static constexpr u16 tss_segment = 0x28;
+
+inline static constexpr u32 msr_sysenter_cs  = 0x174;
+inline static constexpr u32 msr_sysenter_esp = 0x175;
+inline static constexpr u32 msr_sysenter_eip = 0x176;
+
+// Exceptions that aren't `fault`'s: nmi, and the ones fpu and paging handle
+inline static constexpr u8 vector_nmi = 2;
+inline static constexpr u8 vector_device_not_available = 7;
+inline static constexpr u8 vector_page_fault = 14;
+
+inline static constexpr umm kernel_stack_size = 8 * 1024;
+inline static constexpr umm user_stack_size = 64 * 1024;
+
+inline static constexpr u32 benchmark_calls = 10000;
+
+struct PACKED Tss {
+	u32 link;
+	u32 esp0;
+	u32 ss0;
+	u32 unused[22]; // Hardware task switching, which we don't do
+	u16 trap;
+	u16 io_map_base;
+};
+
+static_assert(sizeof(Tss) == 104);
+
+Stats stats;
+
+internal Tss tss;
+// Where interrupts and system calls from ring 3 run
+alignas(16) internal u8 kernel_stack[kernel_stack_size];
+// Reserved by the first `run`, after acpi and pci took their ranges out of the demand zero window
+internal u8 *user_stack;
+internal bool user_stack_demand_zero;
+// Where user_enter left the stack of `run`, zero when nothing runs in ring 3
+internal u32 kernel_esp;
+internal fpu::Context fpu_context;
+
+void terminate() {
+	assert(kernel_esp);
+	++stats.faults;
+	user_exit(kernel_esp, exit_fault);
+}
+
+// Every page of the range has to be there for ring 3, so user mode can't make the kernel read for it.
+internal bool user_accessible(u32 address, u32 count) {
+	if (!paging::enabled)
+		return true;
+	if (address + count < address)
+		return false;
+	for (umm page = address / paging::page_size * paging::page_size; page < address + count; page += paging::page_size) {
+		umm physical_address;
+		u32 flags;
+		if (!paging::query(page, physical_address, flags) || !(flags & paging::flag_user))
+			return false;
+	}
+	return true;
+}
+
+internal u32 syscall_null(u32 a, u32 b, u32 c) {
+	(void)a;
+	(void)b;
+	(void)c;
+	return 0;
+}
+
+internal u32 syscall_exit(u32 code, u32 b, u32 c) {
+	(void)b;
+	(void)c;
+	user_exit(kernel_esp, code);
+}
+
+internal u32 syscall_write(u32 address, u32 count, u32 c) {
+	(void)c;
+	if (!user_accessible(address, count))
+		return syscall_error;
+	debug::print(Span<ascii>{(ascii *)address, count});
+	return count;
+}
+
+using SyscallFunction = u32(u32 a, u32 b, u32 c);
+
+internal constexpr Array<SyscallFunction *, Syscall_count> syscalls = [] {
+	Array<SyscallFunction *, Syscall_count> result = {};
+	result.data[Syscall_null]  = syscall_null;
+	result.data[Syscall_exit]  = syscall_exit;
+	result.data[Syscall_write] = syscall_write;
+	return result;
+}();
+
+internal u32 dispatch(u32 number, u32 a, u32 b, u32 c) {
+	if (number >= Syscall_count)
+		return syscall_error;
+	return syscalls.data[number](a, b, c);
+}
+
+extern "C" u32 sysenter_dispatch(u32 number, u32 a, u32 b, u32 c) {
+	++stats.sysenter_calls;
+	return dispatch(number, a, b, c);
+}
+
+internal void syscall_interrupt_handler(Registers &registers, void *context) {
+	(void)context;
+	++stats.interrupt_calls;
+	registers.eax = dispatch(registers.eax, registers.ebx, registers.esi, registers.edi);
+}
+
+// Exceptions nobody else handles end user code, and stop the kernel.
+internal void fault(Registers &registers, void *context) {
+	(void)context;
+	debug::print("exception "s);
+	debug::print(registers.int_no);
+	debug::print(" at eip "s);
+	debug::print(format_int(registers.eip, 16));
+	if (from_user_mode(registers)) {
+		debug::print(" in user mode\n"s);
+		terminate();
+	}
+	debug::print('\n');
+	unreachable();
+}
+
+void init() {
+	tss.ss0 = kernel_data_segment;
+	tss.esp0 = (u32)(kernel_stack + kernel_stack_size);
+	// Past the limit, so there is no io permission bitmap and ring 3 can't use any port
+	tss.io_map_base = sizeof(Tss);
+
+	// Present, ring 0, 32 bit available TSS, byte granular limit
+	u64 base = (u32)&tss;
+	u64 limit = sizeof(Tss) - 1;
+	gdt[tss_segment / 8] = (limit & 0xffff) | ((base & 0xffffff) << 16) | (0x89ull << 40) | ((limit >> 16) << 48) | ((base >> 24) << 56);
+	asm volatile("ltr %0" : : "r" (tss_segment));
+
+	if (cpuid::info.sysenter) {
+		cpu::write_msr(msr_sysenter_cs, kernel_code_segment);
+		cpu::write_msr(msr_sysenter_esp, (u32)(kernel_stack + kernel_stack_size));
+		cpu::write_msr(msr_sysenter_eip, (u32)sysenter_entry);
+	}
+
+	interrupt::set_handler(interrupt::vector_syscall, syscall_interrupt_handler);
+	for (u8 vector = 0; vector < interrupt::irq_0; ++vector) {
+		if (vector != vector_nmi && vector != vector_device_not_available && vector != vector_page_fault)
+			interrupt::set_handler(vector, fault);
+	}
+
+	paging::protect((umm)kernel_user_start, kernel_user_end - kernel_user_start, paging::flag_writable | paging::flag_user);
+
+	debug::print(cpuid::info.sysenter ? "user: sysenter and int 0x80, "s : "user: int 0x80, "s);
+	debug::print((u32)(kernel_user_end - kernel_user_start));
+	debug::print(" bytes of user code\n"s);
+}
+
+u32 run(void (*entry)()) {
+	assert(!kernel_esp);
+	if (!user_stack) {
+		// Demand zero, so only what is used of the stack is there
+		user_stack = (u8 *)paging::reserve(user_stack_size, paging::flag_writable | paging::flag_user);
+		user_stack_demand_zero = user_stack;
+		if (!user_stack)
+			user_stack = (u8 *)memory::allocate(user_stack_size, 16);
+	}
+
+	fpu::release(&fpu_context);
+	fpu::switch_to(&fpu_context);
+	u32 code = user_enter((u32)entry, (u32)(user_stack + user_stack_size), &kernel_esp);
+	fpu::switch_to(0);
+	kernel_esp = 0;
+
+	// Nothing of this run is left for the next one
+	if (user_stack_demand_zero)
+		paging::decommit(user_stack, user_stack_size);
+	else
+		set_memory(user_stack, 0, user_stack_size);
+	return code;
+}
+
+struct BenchmarkResult {
+	bool use_sysenter;
+	u64 sysenter_cycles;
+	u64 interrupt_cycles;
+};
+
+USER_DATA internal BenchmarkResult benchmark_result;
+
+// Runs in ring 3, so it may only touch .user and its stack: no calls into the kernel, no string literals.
+USER_TEXT internal void benchmark_main() {
+	auto &result = benchmark_result;
+	if (result.use_sysenter) {
+		u64 start = cpu::read_timestamp();
+		for (u32 i = 0; i < benchmark_calls; ++i)
+			syscall_sysenter(Syscall_null);
+		result.sysenter_cycles = cpu::read_timestamp() - start;
+	}
+	u64 start = cpu::read_timestamp();
+	for (u32 i = 0; i < benchmark_calls; ++i)
+		syscall_interrupt(Syscall_null);
+	result.interrupt_cycles = cpu::read_timestamp() - start;
+	syscall_interrupt(Syscall_exit, 0);
+	__builtin_unreachable();
+}
+
+void benchmark() {
+	benchmark_result = {};
+	benchmark_result.use_sysenter = cpuid::info.sysenter;
+	u32 code = run(benchmark_main);
+	if (code) {
+		debug::print("user: benchmark exited with "s);
+		debug::print(code);
+		debug::print('\n');
+		return;
+	}
+	if (benchmark_result.use_sysenter) {
+		debug::print("user: sysenter "s);
+		debug::print(divide(benchmark_result.sysenter_cycles, benchmark_calls));
+		debug::print(" cycles per null system call, "s);
+	} else {
+		debug::print("user: no sysenter, "s);
+	}
+	debug::print("int 0x80 "s);
+	debug::print(divide(benchmark_result.interrupt_cycles, benchmark_calls));
+	debug::print(" cycles\nuser: "s);
+	debug::print(stats.sysenter_calls);
+	debug::print(" sysenter calls, "s);
+	debug::print(stats.interrupt_calls);
+	debug::print(" int 0x80 calls, "s);
+	debug::print(stats.faults);
+	debug::print(" faults\n"s);
+}
+
+}
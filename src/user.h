@@ -0,0 +1,76 @@
+#pragma once
+#include "common.h"
+#include "cpu.h"
+#include "interrupt.h"
+
+// Ring 3, and system calls into the kernel.
+//
+// User code is linked into the kernel, in the .user section, which `init` makes the only pages ring 3
+// can touch besides its stack. `run` calls into it on the current task and returns when it makes the
+// exit system call or faults; interrupts still come in meanwhile, but nothing else of the kernel runs.
+//
+// A system call has its number in eax and up to three arguments in ebx, esi and edi, and returns its
+// result in eax. `sysenter` is the fast way in, `int 0x80` works on every cpu. Both end up in the same
+// table, with interrupts off, on a stack of their own that the TSS and the sysenter MSRs point at.
+//
+// Any exception ring 3 raises, besides page faults that paging handles, ends the run.
+
+// For functions and variables that user code uses. Everything in .user is readable and writable in ring 3.
+#define USER_TEXT [[gnu::section(".user.text")]]
+#define USER_DATA [[gnu::section(".user.data")]]
+
+namespace user {
+
+enum Syscall : u32 {
+	Syscall_null,   // Does nothing, to time the way in and out
+	Syscall_exit,   // (code), back to `run`
+	Syscall_write,  // (address, count), to the debug output
+	Syscall_count,
+};
+
+// What a system call returns for a number that isn't in the table or arguments it can't use
+inline static constexpr u32 syscall_error = 0xffffffff;
+// What `run` returns for code that faulted
+inline static constexpr u32 exit_fault = 0xffffffff;
+
+// Segments, TSS, the int 0x80 gate and the sysenter MSRs. Needs interrupt, cpuid and paging.
+void init();
+
+// Runs `entry` in ring 3 with a zeroed stack and cleared fpu registers, so nothing is left over from
+// the run before. Returns the exit code.
+u32 run(void (*entry)());
+
+forceinline inline bool from_user_mode(Registers const &registers) {
+	return (registers.cs & 3) == 3;
+}
+
+// For exception handlers, after a fault in ring 3: `run` returns exit_fault.
+[[noreturn]] void terminate();
+
+// For code in .user.
+
+forceinline inline u32 syscall_sysenter(Syscall number, u32 a = 0, u32 b = 0, u32 c = 0) {
+	u32 result;
+	asm volatile("mov %%esp, %%ecx\n\tmov $1f, %%edx\n\tsysenter\n1:"
+		: "=a" (result) : "a" (number), "b" (a), "S" (b), "D" (c) : "ecx", "edx", "memory");
+	return result;
+}
+
+forceinline inline u32 syscall_interrupt(Syscall number, u32 a = 0, u32 b = 0, u32 c = 0) {
+	u32 result;
+	asm volatile("int $0x80" : "=a" (result) : "a" (number), "b" (a), "S" (b), "D" (c) : "memory");
+	return result;
+}
+
+struct Stats {
+	u32 sysenter_calls;
+	u32 interrupt_calls;
+	u32 faults;
+};
+
+extern Stats stats;
+
+// Null system calls from ring 3 through both ways in.
+void benchmark();
+
+}
@@ -0,0 +1,95 @@
+[bits 32]
+[extern sysenter_dispatch]
+
+kernel_data_segment equ 0x10
+user_code_segment   equ 0x18 | 3
+user_data_segment   equ 0x20 | 3
+
+eflags_interrupt equ 1 << 9
+eflags_reserved  equ 1 << 1
+
+section .text
+
+; u32 user_enter(u32 eip, u32 esp, u32 *kernel_esp)
+; Goes to ring 3 through iret, which unlike sysexit works on every cpu. Saves where the kernel stack is in
+; `kernel_esp`, and returns what user_exit is given.
+global user_enter
+user_enter:
+	pushfd
+	push ebp
+	push ebx
+	push esi
+	push edi
+	mov eax, [esp + 32]
+	mov [eax], esp
+	mov ecx, [esp + 24]
+	mov edx, [esp + 28]
+
+	mov ax, user_data_segment
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	push dword user_data_segment
+	push edx
+	push dword eflags_interrupt | eflags_reserved
+	push dword user_code_segment
+	push ecx
+	; Nothing of the kernel's left in registers
+	xor eax, eax
+	xor ebx, ebx
+	xor ecx, ecx
+	xor edx, edx
+	xor esi, esi
+	xor edi, edi
+	xor ebp, ebp
+	iret
+
+; [[noreturn]] void user_exit(u32 kernel_esp, u32 code)
+; Called from a system call or an exception in user mode, on the stack the TSS points at, which is simply
+; dropped. Back to where user_enter was called, with the kernel's eflags.
+global user_exit
+user_exit:
+	mov eax, [esp + 8]
+	mov esp, [esp + 4]
+	mov cx, kernel_data_segment
+	mov ds, cx
+	mov es, cx
+	mov fs, cx
+	mov gs, cx
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
+	popfd
+	ret
+
+; sysenter comes here with cs, ss and esp from the MSRs and interrupts off; everything else is the way
+; user mode left it. User mode passes its stack pointer in ecx and where to return to in edx, which is what
+; sysexit takes back; the number is in eax and the arguments in ebx, esi and edi, like for int 0x80.
+; The C side keeps ebx, esi, edi and ebp.
+global sysenter_entry
+sysenter_entry:
+	push ecx
+	push edx
+	; ds and es are the user's, which may be anything
+	push dword kernel_data_segment
+	pop ds
+	push dword kernel_data_segment
+	pop es
+	push edi
+	push esi
+	push ebx
+	push eax
+	cld
+	call sysenter_dispatch
+	add esp, 16
+	push dword user_data_segment
+	pop ds
+	push dword user_data_segment
+	pop es
+	pop edx
+	pop ecx
+	; sysexit doesn't touch eflags. The interrupt shadow of sti lasts until we are in ring 3.
+	sti
+	sysexit
@@ -0,0 +1,463 @@
+#include "virtio_blk.h"
+#include "port.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "cpu.h"
+#include "pci.h"
+#include "disk_benchmark.h"
+
+namespace virtio_blk {
+
+Device devices[max_device_count];
+u32 device_count;
+
+async::Channel<Request *, completion_capacity> completions;
+
+inline static constexpr u16 vendor_id = 0x1af4;
+inline static constexpr u16 device_id_legacy_block = 0x1001;
+
+// Offsets from io_base
+inline static constexpr u16 register_device_features = 0x00;
+inline static constexpr u16 register_driver_features = 0x04;
+inline static constexpr u16 register_queue_address   = 0x08; // Page number
+inline static constexpr u16 register_queue_size      = 0x0c;
+inline static constexpr u16 register_queue_select    = 0x0e;
+inline static constexpr u16 register_queue_notify    = 0x10;
+inline static constexpr u16 register_device_status   = 0x12;
+inline static constexpr u16 register_isr             = 0x13; // Reading it acknowledges the interrupt
+// Device specific configuration, at this offset while MSI-X is off
+inline static constexpr u16 register_capacity        = 0x14;
+
+inline static constexpr u8 status_acknowledge = 1 << 0;
+inline static constexpr u8 status_driver      = 1 << 1;
+inline static constexpr u8 status_driver_ok   = 1 << 2;
+inline static constexpr u8 status_failed      = 1 << 7;
+
+inline static constexpr u8 isr_queue = 1 << 0;
+
+inline static constexpr u32 feature_flush       = 1 << 9;
+inline static constexpr u32 feature_event_index = 1 << 29;
+
+// The legacy transport wants the rings laid out in this many byte pages
+inline static constexpr u32 queue_alignment = 4096;
+
+inline static constexpr u32 request_in    = 0;
+inline static constexpr u32 request_out   = 1;
+inline static constexpr u32 request_flush = 4;
+
+inline static constexpr u8 request_ok = 0;
+// Not something the device writes, tells an unanswered request apart
+inline static constexpr u8 request_pending = 0xff;
+
+internal u16 volatile *used_event(Queue &queue) {
+	return &queue.available->ring[queue.size];
+}
+
+internal u16 volatile *available_event(Queue &queue) {
+	return (u16 volatile *)&queue.used->ring[queue.size];
+}
+
+// Whether an index moving from `old_index` to `new_index` went past `event`
+internal bool need_event(u16 event, u16 new_index, u16 old_index) {
+	return (u16)(new_index - event - 1) < (u16)(new_index - old_index);
+}
+
+// Builds the request's descriptor chain and puts it on the available ring.
+internal bool enqueue(Request &request, u32 type) {
+	auto &device = *request.device;
+	auto &queue = device.queue;
+
+	request.header = {.type = type, .reserved = 0, .sector = request.lba};
+	request.status = request_pending;
+	request.success = false;
+	request.done = false;
+	request.submit_timestamp = cpu::read_timestamp();
+
+	u32 needed = request.segments.count + 2;
+	cpu::InterruptGuard guard;
+	if (queue.free_count < needed)
+		return false;
+
+	// The free list is linked through `next` already, the chain just keeps those links
+	u16 head = queue.free_first;
+	u16 index = head;
+	u16 last = head;
+	auto add = [&](void const *data, u32 length, u16 flags) {
+		auto &descriptor = queue.descriptors[index];
+		descriptor.address = (u32)data;
+		descriptor.length = length;
+		descriptor.flags = flags | descriptor_next;
+		last = index;
+		index = descriptor.next;
+	};
+
+	add(&request.header, sizeof(RequestHeader), 0);
+	for (auto segment : request.segments)
+		add(segment.data, segment.size, request.write ? 0 : descriptor_write);
+	add((void const *)&request.status, 1, descriptor_write);
+	queue.descriptors[last].flags &= ~descriptor_next;
+
+	queue.free_first = index;
+	queue.free_count -= needed;
+	queue.requests[head] = &request;
+
+	queue.available->ring[queue.next_available % queue.size] = head;
+	queue.next_available += 1;
+	return true;
+}
+
+bool submit(Request &request) {
+	auto &device = *request.device;
+	bounds_check(request.lba + request.sector_count <= device.sector_count);
+	assert(request.sector_count != 0);
+	u32 byte_count = 0;
+	for (auto segment : request.segments)
+		byte_count += segment.size;
+	assert(byte_count == request.sector_count * sector_size);
+
+	request.synchronous = false;
+	return enqueue(request, request.write ? request_out : request_in);
+}
+
+void kick(Device &device) {
+	auto &queue = device.queue;
+	u16 new_index = queue.next_available;
+	u16 old_index = queue.kicked_index;
+	if (new_index == old_index)
+		return;
+	queue.kicked_index = new_index;
+
+	// The ring entries have to be visible before the index
+	__atomic_store_n(&queue.available->index, new_index, __ATOMIC_RELEASE);
+	// And the index before we look at what the device wants, or we could both decide the other one is late
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	bool notify = device.event_index
+		? need_event(*available_event(queue), new_index, old_index)
+		: !(__atomic_load_n(&queue.used->flags, __ATOMIC_ACQUIRE) & used_no_notify);
+	if (notify) {
+		port::write_u16(device.io_base + register_queue_notify, 0);
+		device.notifications += 1;
+	}
+}
+
+// Puts a finished chain back on the free list.
+internal void free_chain(Queue &queue, u16 head) {
+	u16 last = head;
+	u16 count = 1;
+	while (queue.descriptors[last].flags & descriptor_next) {
+		last = queue.descriptors[last].next;
+		++count;
+	}
+	queue.descriptors[last].next = queue.free_first;
+	queue.free_first = head;
+	queue.free_count += count;
+}
+
+// Interrupts have to be disabled.
+internal void complete(Queue &queue, u16 head) {
+	auto request = queue.requests[head];
+	free_chain(queue, head);
+	request->success = request->status == request_ok;
+	request->complete_timestamp = cpu::read_timestamp();
+	request->done = true;
+	if (!request->synchronous) {
+		bool pushed = async::push(completions, request);
+		assert(pushed);
+	}
+}
+
+// Takes everything the device has finished off the used ring.
+internal void reap(Device &device) {
+	auto &queue = device.queue;
+	while (1) {
+		u16 used_index = __atomic_load_n(&queue.used->index, __ATOMIC_ACQUIRE);
+		while (queue.last_used != used_index) {
+			auto element = queue.used->ring[queue.last_used % queue.size];
+			queue.last_used += 1;
+			complete(queue, (u16)element.id);
+		}
+
+		// Interrupt on the next one. One that finished before the device saw this won't interrupt, so look again.
+		*used_event(queue) = queue.last_used;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&queue.used->index, __ATOMIC_ACQUIRE) == queue.last_used)
+			break;
+	}
+}
+
+internal void irq_handler(Registers &registers, void *context) {
+	(void)registers;
+	auto &device = *(Device *)context;
+
+	// Zero if the interrupt came from somebody else on a shared line
+	if (!(port::read_u8(device.io_base + register_isr) & isr_queue))
+		return;
+	device.interrupts += 1;
+	reap(device);
+	sync::wake_all(device.completion_queue);
+}
+
+// Submits and kicks a synchronous request and sleeps until it is done.
+internal bool run(Request &request, u32 type) {
+	auto &device = *request.device;
+	request.synchronous = true;
+	// The queue may be full of asynchronous requests, which free descriptors as they finish
+	sync::wait(device.completion_queue, [&] {
+		if (enqueue(request, type))
+			return true;
+		kick(device);
+		return false;
+	});
+	kick(device);
+	sync::wait(device.completion_queue, [&] { return request.done; });
+	return request.success;
+}
+
+internal bool transfer(Device &device, u64 lba, u32 sector_count, Span<Segment> segments, bool write) {
+	bounds_check(lba + sector_count <= device.sector_count);
+	Request request = {};
+	request.device = &device;
+	request.lba = lba;
+	request.sector_count = sector_count;
+	request.write = write;
+	request.segments = segments;
+	return run(request, write ? request_out : request_in);
+}
+
+bool read(Device &device, u64 lba, u32 sector_count, Span<Segment> segments) {
+	return transfer(device, lba, sector_count, segments, false);
+}
+
+bool write(Device &device, u64 lba, u32 sector_count, Span<Segment> segments) {
+	return transfer(device, lba, sector_count, segments, true);
+}
+
+bool flush(Device &device) {
+	if (!device.has_flush)
+		return true;
+	Request request = {};
+	request.device = &device;
+	return run(request, request_flush);
+}
+
+block_cache::Device block_device(Device &device) {
+	block_cache::Device result = {};
+	result.read = [](void *context, u64 lba, u32 sector_count, Span<Segment> segments) {
+		return read(*(Device *)context, lba, sector_count, segments);
+	};
+	result.write = [](void *context, u64 lba, u32 sector_count, Span<Segment> segments) {
+		return write(*(Device *)context, lba, sector_count, segments);
+	};
+	result.context = &device;
+	result.sector_count = device.sector_count;
+	return result;
+}
+
+internal void init_queue(Queue &queue, u16 size) {
+	// Descriptors and the available ring share the first pages, the used ring starts on a page of its own
+	u32 used_offset = (size * sizeof(Descriptor) + sizeof(AvailableRing) + (size + 1) * sizeof(u16) + queue_alignment - 1) & ~(queue_alignment - 1);
+	u32 total_size = used_offset + sizeof(UsedRing) + size * sizeof(UsedElement) + sizeof(u16);
+	auto memory = (u8 *)memory::allocate(total_size, queue_alignment);
+	set_memory(memory, 0, total_size);
+
+	queue.size = size;
+	queue.descriptors = (Descriptor *)memory;
+	queue.available = (AvailableRing *)(memory + size * sizeof(Descriptor));
+	queue.used = (UsedRing *)(memory + used_offset);
+	queue.requests = memory::allocate<Request *>(size);
+
+	for (u16 i = 0; i < size; ++i)
+		queue.descriptors[i].next = i + 1;
+	queue.free_first = 0;
+	queue.free_count = size;
+}
+
+internal void init_device(pci::Device &pci_device) {
+	if (!(pci_device.bars[0].flags & pci::bar_io))
+		return;
+	// Legacy interrupts only, and the firmware has to have routed them
+	if (!pci_device.interrupt_pin || pci_device.interrupt_line >= interrupt::irq_count)
+		return;
+	if (device_count == max_device_count) {
+		debug::print("virtio-blk: device table is full\n"s);
+		return;
+	}
+
+	u16 io = pci::io_bar(pci_device, 0);
+	pci::enable(pci_device, true);
+
+	port::write_u8(io + register_device_status, 0); // Reset
+	port::write_u8(io + register_device_status, status_acknowledge);
+	port::write_u8(io + register_device_status, status_acknowledge | status_driver);
+
+	u32 features = port::read_u32(io + register_device_features) & (feature_flush | feature_event_index);
+	port::write_u32(io + register_driver_features, features);
+
+	port::write_u16(io + register_queue_select, 0);
+	u16 size = port::read_u16(io + register_queue_size);
+	// Ring positions are indices modulo the size, that only works for a power of two
+	if (!size || (size & (size - 1))) {
+		port::write_u8(io + register_device_status, status_failed);
+		return;
+	}
+
+	auto &device = devices[device_count++];
+	device.io_base = io;
+	device.irq = interrupt::irq_0 + pci_device.interrupt_line;
+	device.event_index = features & feature_event_index;
+	device.has_flush = features & feature_flush;
+	device.sector_count = port::read_u32(io + register_capacity) | ((u64)port::read_u32(io + register_capacity + 4) << 32);
+	init_queue(device.queue, size);
+	port::write_u32(io + register_queue_address, (u32)device.queue.descriptors / queue_alignment);
+
+	// PCI interrupt lines can be shared, hence add_handler
+	interrupt::add_handler(device.irq, irq_handler, &device);
+	port::write_u8(io + register_device_status, status_acknowledge | status_driver | status_driver_ok);
+}
+
+void init() {
+	for (auto device = pci::find({.vendor_id = vendor_id, .device_id = device_id_legacy_block}); device;
+		 device = pci::find({.vendor_id = vendor_id, .device_id = device_id_legacy_block}, device))
+	{
+		init_device(*device);
+	}
+}
+
+void print_devices() {
+	for (u32 i = 0; i < device_count; ++i) {
+		auto &device = devices[i];
+		debug::print("virtio-blk: vd"s);
+		debug::print(i);
+		debug::print(": "s);
+		debug::print(device.sector_count);
+		debug::print(" sectors, queue size "s);
+		debug::print(device.queue.size);
+		debug::print(", irq "s);
+		debug::print((u8)(device.irq - interrupt::irq_0));
+		if (device.event_index)
+			debug::print(", event index"s);
+		if (device.has_flush)
+			debug::print(", flush"s);
+		debug::print('\n');
+	}
+}
+
+// The same shapes as `ata::benchmark`: a few long sequential reads, or many random pages
+inline static constexpr u32 benchmark_sequential_depth = 4;
+inline static constexpr u32 benchmark_random_depth = 32;
+inline static constexpr u32 benchmark_chunk_size = disk_benchmark::sequential_sectors * sector_size;
+inline static constexpr u32 benchmark_segment_count = benchmark_chunk_size / disk_benchmark::segment_size;
+
+internal u8 *benchmark_buffer;
+internal Request benchmark_requests[benchmark_random_depth];
+internal Segment benchmark_segments[benchmark_random_depth][benchmark_segment_count];
+
+// Keeps `depth` requests in flight. Everything that finished together is resubmitted with one kick.
+internal disk_benchmark::Result benchmark_reads(Device &device, u32 depth, bool random) {
+	return disk_benchmark::measure([&](disk_benchmark::Result &result, auto &&running) {
+		u64 lba = 0;
+		u32 random_state = 1;
+		u32 in_flight = 0;
+
+		auto submit_next = [&](u32 index) {
+			auto &request = benchmark_requests[index];
+			u32 count;
+			if (random) {
+				count = disk_benchmark::random_sectors;
+				lba = disk_benchmark::random_lba(random_state, device.sector_count);
+			} else {
+				count = (u32)min<u64>(disk_benchmark::sequential_sectors, device.sector_count - lba);
+			}
+			u8 *data = benchmark_buffer + index * (random ? disk_benchmark::segment_size : benchmark_chunk_size);
+			u32 remaining = count * sector_size;
+			u32 segment_count = 0;
+			while (remaining) {
+				u32 size = min(remaining, disk_benchmark::segment_size);
+				benchmark_segments[index][segment_count++] = {.data = data, .size = size};
+				data += size;
+				remaining -= size;
+			}
+			request = {};
+			request.device = &device;
+			request.lba = lba;
+			request.sector_count = count;
+			request.segments = {benchmark_segments[index], segment_count};
+			bool submitted = submit(request);
+			assert(submitted);
+			++in_flight;
+			if (!random) {
+				lba += count;
+				if (lba == device.sector_count)
+					lba = 0;
+			}
+		};
+
+		auto finish = [&](Request *request) {
+			--in_flight;
+			if (!request->success) {
+				result.failed = true;
+				result.failed_lba = request->lba;
+			}
+			result.bytes += request->sector_count * sector_size;
+			result.requests += 1;
+			if (!result.failed && running())
+				submit_next((u32)(request - benchmark_requests));
+		};
+
+		for (u32 i = 0; i < depth; ++i)
+			submit_next(i);
+		kick(device);
+
+		while (in_flight) {
+			finish(async::receive(completions));
+			Request *request = 0;
+			while (async::try_receive(completions, request))
+				finish(request);
+			kick(device);
+		}
+	});
+}
+
+internal void print_result(u32 device_index, Span<ascii> test, disk_benchmark::Result const &result,
+						   u32 notifications, u32 interrupts) {
+	debug::print("virtio-blk: vd"s);
+	debug::print(device_index);
+	disk_benchmark::print(test, result);
+	debug::print("  "s);
+	debug::print(notifications);
+	debug::print(" notifications, "s);
+	debug::print(interrupts);
+	debug::print(" interrupts for "s);
+	debug::print(result.requests);
+	debug::print(" requests\n"s);
+}
+
+void benchmark() {
+	static_assert(benchmark_sequential_depth * benchmark_chunk_size >= benchmark_random_depth * disk_benchmark::segment_size);
+	if (!benchmark_buffer)
+		benchmark_buffer = (u8 *)memory::allocate(benchmark_sequential_depth * benchmark_chunk_size, disk_benchmark::segment_size);
+
+	for (u32 i = 0; i < device_count; ++i) {
+		auto &device = devices[i];
+		struct {
+			Span<ascii> name;
+			u32 depth;
+			bool random;
+		} tests[] = {
+			{"sequential read"s,    benchmark_sequential_depth, false},
+			{"random 4 KB read"s,   benchmark_random_depth,     true},
+		};
+		for (auto &test : tests) {
+			// Too small for a single page
+			if (test.random && device.sector_count < disk_benchmark::random_sectors)
+				continue;
+			u32 notifications = device.notifications;
+			u32 interrupts = device.interrupts;
+			auto result = benchmark_reads(device, test.depth, test.random);
+			print_result(i, test.name, result, device.notifications - notifications, device.interrupts - interrupts);
+		}
+	}
+}
+
+}
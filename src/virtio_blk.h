@@ -0,0 +1,148 @@
+#pragma once
+#include "common.h"
+#include "sync.h"
+#include "async.h"
+#include "memory.h"
+#include "block_cache.h"
+
+// Virtio block devices (qemu's `if=virtio`) through the legacy PCI transport.
+//
+// Requests go through a split virtqueue: a table of descriptors, an available ring we put request chains on
+// and a used ring the device gives them back on. `submit` only puts a request on the available ring;
+// `kick` shows everything submitted since the last kick to the device and notifies it once, and only if
+// the device asked for it (event index). The irq handler takes every finished request off the used ring
+// at once and pushes them to `completions`.
+namespace virtio_blk {
+
+inline static constexpr u32 sector_size = 512;
+
+struct Descriptor {
+	u64 address;
+	u32 length;
+	u16 flags;
+	u16 next;
+};
+
+inline static constexpr u16 descriptor_next  = 1 << 0;
+inline static constexpr u16 descriptor_write = 1 << 1; // The device writes to the buffer
+
+// Written by the driver
+struct AvailableRing {
+	u16 flags;
+	u16 index;
+	u16 ring[]; // `size` entries, followed by `used_event`
+};
+
+struct UsedElement {
+	u32 id; // Head of the descriptor chain
+	u32 length;
+};
+
+// Written by the device
+struct UsedRing {
+	u16 flags;
+	u16 index;
+	UsedElement ring[]; // `size` entries, followed by `available_event`
+};
+
+inline static constexpr u16 used_no_notify = 1 << 0; // Without event index only
+
+struct Request;
+
+struct Queue {
+	u16 size;
+	Descriptor *descriptors;
+	AvailableRing *available;
+	UsedRing *used;
+
+	// Descriptors not in any chain, linked through `next`
+	u16 free_first;
+	u16 free_count;
+
+	u16 next_available;  // Where the next submitted chain goes. Shown to the device by `kick`.
+	u16 kicked_index;    // The available index at the last kick
+	u16 last_used;       // Used entries before this one have been reaped
+
+	Request **requests;  // By the head descriptor of their chain
+};
+
+struct Device {
+	u16 io_base;
+	u8 irq;
+	bool event_index;
+	bool has_flush; // Otherwise the device writes through and there's nothing to flush
+	u64 sector_count;
+	Queue queue;
+
+	// Woken up by the irq handler whenever requests finish
+	sync::WaitQueue completion_queue;
+
+	u32 notifications;
+	u32 interrupts;
+};
+
+inline static constexpr u32 max_device_count = 4;
+extern Device devices[max_device_count];
+extern u32 device_count;
+
+// Needs pci.
+void init();
+
+using Segment = memory::Segment;
+
+// What the device reads first
+struct RequestHeader {
+	u32 type;
+	u32 reserved;
+	u64 sector;
+};
+
+struct Request {
+	Device *device;
+	u64 lba;
+	u32 sector_count;
+	bool write;
+	Span<Segment> segments; // Has to add up to `sector_count` sectors
+
+	// Set before the request goes to `completions`
+	bool success;
+	u64 submit_timestamp;
+	u64 complete_timestamp;
+
+	// Synchronous requests don't go to `completions`, their submitter waits for `done` instead.
+	bool synchronous;
+	bool volatile done;
+
+	// Read by the device, and the status it writes back
+	RequestHeader header;
+	u8 volatile status;
+};
+
+inline static constexpr u32 completion_capacity = 64;
+
+// Finished requests, except synchronous ones. Filled from the irq handler, so no more than
+// `completion_capacity` requests may be submitted and not yet received.
+extern async::Channel<Request *, completion_capacity> completions;
+
+// Puts the request on the available ring, without telling the device. Returns false if the queue doesn't
+// have the `segments.count + 2` descriptors the request needs right now.
+// The request must stay alive until it comes out of `completions`.
+bool submit(Request &request);
+
+// Shows the device every request submitted since the last kick, notifying it if it wants to be.
+void kick(Device &device);
+
+// Synchronous versions. Unlike ata commands these don't time out: the buffers belong to the device
+// until it answers.
+bool read(Device &device, u64 lba, u32 sector_count, Span<Segment> segments);
+bool write(Device &device, u64 lba, u32 sector_count, Span<Segment> segments);
+bool flush(Device &device);
+
+block_cache::Device block_device(Device &device);
+
+void print_devices();
+
+// Sequential and random 4 KB read throughput, IOPS and cpu usage, measured like `ata::benchmark`.
+void benchmark();
+
+}